@@ -0,0 +1,492 @@
+/**
+ * Copyright 2018 Comcast Cable Communications Management, LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Benchmark and load generator.  Each run pushes a workload into either the curtail binary through a pipe or into a
+// libcurtail program (this program re-executed after crtl_init_ex) through stdout, and reports throughput, the latency
+// of the producer's writes, the fallocate and file write calls counted by the crtl_shim LD_PRELOAD library and the CPU
+// time spent by curtail per MB.  The direct target writes compressed output from the producing thread with
+// crtl_direct_write, 4MB at a time for the binary workload.  The shim also emulates collapse on filesystems without it, so runs work on tmpfs
+// without root.  For numbers that match production, point --dir at a loop mounted ext4 or XFS image.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <linux/limits.h>
+#include <fcntl.h>
+#include <argp.h>
+#include "curtail.h"
+#include "crtl_private.h"
+
+#define CRTL_BENCH_BUCKETS   (512) // Latency histogram: 8 linear sub-buckets per power of two nanoseconds
+#define CRTL_BENCH_OUTPUT    "curtail_bench.out"
+#define CRTL_BENCH_STATS     "curtail_bench.stats"
+#define CRTL_BENCH_LIB_CHILD (256)
+
+typedef enum {
+   CRTL_BENCH_TARGET_ALL    = 0,
+   CRTL_BENCH_TARGET_BINARY = 1, // curtail reading a pipe
+   CRTL_BENCH_TARGET_LIB    = 2, // libcurtail capturing stdout
+   CRTL_BENCH_TARGET_DIRECT = 3  // libcurtail writing compressed frames with crtl_direct_write
+} crtl_bench_target_t;
+
+typedef enum {
+   CRTL_BENCH_WORKLOAD_ALL    = 0,
+   CRTL_BENCH_WORKLOAD_LINES  = 1, // Text lines at a fixed rate
+   CRTL_BENCH_WORKLOAD_BURST  = 2, // Groups of lines written back to back, then idle
+   CRTL_BENCH_WORKLOAD_BINARY = 3  // Large binary writes as fast as possible
+} crtl_bench_workload_t;
+
+typedef struct {
+   uint64_t records;
+   uint64_t bytes;
+   uint64_t wall_ns;            // From the first write until curtail has written everything
+   uint64_t cpu_us;             // Spent by curtail, excluding the producer
+   uint64_t latency[CRTL_BENCH_BUCKETS];
+} crtl_bench_result_t;
+
+typedef struct {
+   crtl_bench_target_t   target;
+   crtl_bench_workload_t workload;
+   uint64_t              bytes;
+   uint64_t              size_max;
+   uint32_t              record;     // 0 for the workload default
+   uint32_t              rate;       // Lines per second for the lines workload (0 for unpaced)
+   uint32_t              burst;      // Lines per burst
+   uint32_t              burst_ms;   // Time between the start of bursts
+   char *                engine;
+   char *                storage;
+   char *                dir;
+   char *                curtail;
+   char *                shim;
+   int                   fd_result;  // Set in the re-executed libcurtail child
+   char *                program;
+} crtl_bench_t;
+
+static crtl_bench_t g_bench = { .target   = CRTL_BENCH_TARGET_ALL,
+                                .workload = CRTL_BENCH_WORKLOAD_ALL,
+                                .bytes    = 64 * 1024 * 1024,
+                                .size_max = 16 * 1024 * 1024,
+                                .record   = 0,
+                                .rate     = 200000,
+                                .burst    = 4096,
+                                .burst_ms = 10,
+                                .engine   = "copy",
+                                .storage  = "collapse",
+                                .dir      = "/tmp",
+                                .curtail  = "./curtail",
+                                .shim     = NULL,
+                                .fd_result = -1 };
+
+const char *argp_program_version = "curtail_bench 1.0";
+
+static char doc[] = "curtail_bench -- measure curtail and libcurtail under configurable workloads";
+
+static struct argp_option options[] = {
+  {"target",   't', "name", 0,  "What to drive: all, binary, lib or direct (default: all)" },
+  {"workload", 'w', "name", 0,  "Workload: all, lines, burst or binary (default: all)" },
+  {"bytes",    'n', "size", 0,  "Amount of data written per run (default: 64M)" },
+  {"size",     's', "size", 0,  "Maximum size of the output file (default: 16M)" },
+  {"record",   'b', "size", 0,  "Size of each write (default: 100 for lines, 64K for binary, 4M for direct binary)" },
+  {"rate",     'R', "lines", 0, "Lines per second for the lines workload, 0 for unpaced (default: 200000)" },
+  {"burst",    'B', "lines", 0, "Lines per burst (default: 4096)" },
+  {"interval", 'i', "ms",   0,  "Time between bursts (default: 10)" },
+  {"engine",   'e', "name", 0,  "curtail I/O engine (default: copy)" },
+  {"storage",  'm', "name", 0,  "curtail storage (default: collapse)" },
+  {"dir",      'd', "path", 0,  "Directory for the output file, ie. a loop mounted ext4 or XFS image (default: /tmp)" },
+  {"curtail",  'C', "path", 0,  "curtail binary (default: ./curtail)" },
+  {"shim",     'P', "path", 0,  "crtl_shim library preloaded to count system calls and emulate collapse" },
+  {"lib-child", CRTL_BENCH_LIB_CHILD, "fd", OPTION_HIDDEN, "" },
+  { 0 }
+};
+
+static const char *g_target_names[]   = { "all", "binary", "lib", "direct" };
+static const char *g_workload_names[] = { "all", "lines", "burst", "binary" };
+
+static int crtl_bench_name_parse(const char *arg, const char **names, int count) {
+   for(int index = 0; index < count; index++) {
+      if(0 == strcmp(arg, names[index])) {
+         return(index);
+      }
+   }
+   return(-1);
+}
+
+static error_t crtl_bench_parse_opt(int key, char *arg, struct argp_state *state) {
+   crtl_bench_t *bench = state->input;
+   switch(key) {
+      case 't': {
+         int index = crtl_bench_name_parse(arg, g_target_names, 4);
+         if(index < 0) {
+            argp_error(state, "invalid target <%s>", arg);
+         }
+         bench->target = index;
+         break;
+      }
+      case 'w': {
+         int index = crtl_bench_name_parse(arg, g_workload_names, 4);
+         if(index < 0) {
+            argp_error(state, "invalid workload <%s>", arg);
+         }
+         bench->workload = index;
+         break;
+      }
+      case 'n': bench->bytes    = crtl_parse_size(arg); break;
+      case 's': bench->size_max = crtl_parse_size(arg); break;
+      case 'b': bench->record   = crtl_parse_size(arg); break;
+      case 'R': bench->rate     = atoi(arg);            break;
+      case 'B': bench->burst    = atoi(arg);            break;
+      case 'i': bench->burst_ms = atoi(arg);            break;
+      case 'e': bench->engine   = arg;                  break;
+      case 'm': bench->storage  = arg;                  break;
+      case 'd': bench->dir      = arg;                  break;
+      case 'C': bench->curtail  = arg;                  break;
+      case 'P': bench->shim     = arg;                  break;
+      case CRTL_BENCH_LIB_CHILD: bench->fd_result = atoi(arg); break;
+      case ARGP_KEY_END: {
+         if(bench->bytes == 0 || bench->size_max == 0 || bench->burst == 0) {
+            argp_error(state, "sizes and burst must be greater than 0");
+         }
+         if(bench->record == 1) {
+            argp_error(state, "records must be at least 2 bytes");
+         }
+         break;
+      }
+      default: return(ARGP_ERR_UNKNOWN);
+   }
+   return(0);
+}
+
+static struct argp argp = { options, crtl_bench_parse_opt, NULL, doc };
+
+static uint64_t crtl_bench_now_ns(void) {
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return((uint64_t)now.tv_sec * 1000000000 + now.tv_nsec);
+}
+
+static void crtl_bench_sleep_until(uint64_t deadline_ns) {
+   if(crtl_bench_now_ns() >= deadline_ns) { // Behind schedule
+      return;
+   }
+   struct timespec deadline = { .tv_sec = deadline_ns / 1000000000, .tv_nsec = deadline_ns % 1000000000 };
+   while(EINTR == clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL));
+}
+
+static uint32_t crtl_bench_bucket(uint64_t ns) {
+   if(ns < 8) {
+      return(ns);
+   }
+   uint32_t msb = 63 - __builtin_clzll(ns);
+   return((msb - 2) * 8 + ((ns >> (msb - 3)) & 7));
+}
+
+// Lower bound of a histogram bucket in nanoseconds
+static uint64_t crtl_bench_bucket_ns(uint32_t bucket) {
+   if(bucket < 8) {
+      return(bucket);
+   }
+   uint32_t msb = bucket / 8 + 2;
+   return((uint64_t)(8 + bucket % 8) << (msb - 3));
+}
+
+static double crtl_bench_percentile_us(const crtl_bench_result_t *result, double percentile) {
+   uint64_t target = result->records * percentile;
+   uint64_t count  = 0;
+   for(uint32_t bucket = 0; bucket < CRTL_BENCH_BUCKETS; bucket++) {
+      count += result->latency[bucket];
+      if(count > target) {
+         return(crtl_bench_bucket_ns(bucket) / 1000.0);
+      }
+   }
+   return(0);
+}
+
+static uint32_t crtl_bench_record_size(crtl_bench_target_t target, crtl_bench_workload_t workload) {
+   if(g_bench.record > 0) {
+      return(g_bench.record);
+   }
+   if(workload != CRTL_BENCH_WORKLOAD_BINARY) {
+      return(100);
+   }
+   return(target == CRTL_BENCH_TARGET_DIRECT ? 4 * 1024 * 1024 : 64 * 1024);
+}
+
+// Write the workload to fd, or with crtl_direct_write when fd is -1, timing every write
+static bool crtl_bench_produce(int fd, crtl_bench_target_t target, crtl_bench_workload_t workload, crtl_bench_result_t *result) {
+   uint32_t record = crtl_bench_record_size(target, workload);
+   char *   buffer = malloc(record);
+   if(buffer == NULL) {
+      return(false);
+   }
+   if(workload == CRTL_BENCH_WORKLOAD_BINARY) {
+      uint64_t state = 88172645463325252ULL;
+      for(uint32_t index = 0; index < record; index++) {
+         state ^= state << 13;
+         state ^= state >> 7;
+         state ^= state << 17;
+         buffer[index] = state;
+      }
+   } else {
+      memset(buffer, 'x', record);
+      buffer[record - 1] = '\n';
+   }
+
+   uint64_t start = crtl_bench_now_ns();
+   for(uint64_t seq = 0; result->bytes < g_bench.bytes; seq++) {
+      if(workload == CRTL_BENCH_WORKLOAD_LINES && g_bench.rate > 0) {
+         crtl_bench_sleep_until(start + seq * 1000000000 / g_bench.rate);
+      } else if(workload == CRTL_BENCH_WORKLOAD_BURST && seq % g_bench.burst == 0) {
+         crtl_bench_sleep_until(start + (seq / g_bench.burst) * g_bench.burst_ms * 1000000ULL);
+      }
+      if(workload != CRTL_BENCH_WORKLOAD_BINARY) { // Keep every line different
+         char number[24];
+         int  length = snprintf(number, sizeof(number), "%" PRIu64 " ", seq);
+         memcpy(buffer, number, (uint32_t)length < record - 1 ? (uint32_t)length : record - 1);
+      }
+
+      uint64_t before  = crtl_bench_now_ns();
+      uint32_t written = 0;
+      while(written < record) {
+         ssize_t rc = (fd < 0) ? crtl_direct_write(buffer + written, record - written) : write(fd, buffer + written, record - written);
+         if(rc < 0 && errno == EINTR) {
+            continue;
+         }
+         if(rc <= 0) {
+            int errsv = errno;
+            fprintf(stderr, "write failed <%s>\n", strerror(errsv));
+            free(buffer);
+            return(false);
+         }
+         written += rc;
+      }
+      result->latency[crtl_bench_bucket(crtl_bench_now_ns() - before)]++;
+      result->records++;
+      result->bytes += record;
+   }
+   free(buffer);
+   return(true);
+}
+
+static uint64_t crtl_bench_rusage_us(const struct rusage *usage) {
+   return((uint64_t)(usage->ru_utime.tv_sec + usage->ru_stime.tv_sec) * 1000000 + usage->ru_utime.tv_usec + usage->ru_stime.tv_usec);
+}
+
+// Runs in the re-executed child: capture stdout with libcurtail, produce and send the result to the parent
+static int crtl_bench_lib_child(const char *filename) {
+   crtl_bench_result_t result;
+   memset(&result, 0, sizeof(result));
+
+   crtl_params_t params;
+   memset(&params, 0, sizeof(params));
+   if(!crtl_engine_parse(g_bench.engine, &params.engine) || !crtl_storage_parse(g_bench.storage, &params.storage)) {
+      fprintf(stderr, "invalid engine or storage\n");
+      return(-1);
+   }
+   params.direct_only = (g_bench.target == CRTL_BENCH_TARGET_DIRECT);
+   params.compress    = params.direct_only;
+   if(!crtl_init_ex(filename, g_bench.size_max, CRTL_LEVEL_ERROR, false, &params)) {
+      return(-1);
+   }
+   uint64_t start = crtl_bench_now_ns();
+   bool     ok    = crtl_bench_produce(params.direct_only ? -1 : STDOUT_FILENO, g_bench.target, g_bench.workload, &result);
+   struct rusage producer;
+   getrusage(RUSAGE_THREAD, &producer);
+   crtl_term();
+   result.wall_ns = crtl_bench_now_ns() - start;
+
+   struct rusage total;
+   getrusage(RUSAGE_SELF, &total);
+   result.cpu_us = crtl_bench_rusage_us(&total) - crtl_bench_rusage_us(&producer);
+   if(!ok || sizeof(result) != crtl_write(g_bench.fd_result, &result, sizeof(result))) {
+      return(-1);
+   }
+   return(0);
+}
+
+static void crtl_bench_child_env(const char *stats) {
+   unlink(stats);
+   if(g_bench.shim != NULL) {
+      setenv("LD_PRELOAD", g_bench.shim, 1);
+      setenv("CRTL_SHIM_STATS", stats, 1);
+   }
+}
+
+// Run curtail reading a pipe and produce into it
+static bool crtl_bench_run_binary(crtl_bench_workload_t workload, const char *filename, const char *stats, crtl_bench_result_t *result) {
+   int fds[2];
+   if(0 != pipe(fds)) {
+      return(false);
+   }
+   char size[32];
+   snprintf(size, sizeof(size), "%" PRIu64, g_bench.size_max);
+   pid_t pid = fork();
+   if(pid < 0) {
+      return(false);
+   }
+   if(pid == 0) {
+      dup2(fds[0], STDIN_FILENO);
+      close(fds[0]);
+      close(fds[1]);
+      crtl_bench_child_env(stats);
+      execl(g_bench.curtail, g_bench.curtail, "-q", "-s", size, "-e", g_bench.engine, "-m", g_bench.storage, filename, (char *)NULL);
+      int errsv = errno;
+      fprintf(stderr, "unable to run <%s> <%s>\n", g_bench.curtail, strerror(errsv));
+      _exit(127);
+   }
+   close(fds[0]);
+
+   uint64_t start = crtl_bench_now_ns();
+   bool     ok    = crtl_bench_produce(fds[1], CRTL_BENCH_TARGET_BINARY, workload, result);
+   close(fds[1]);
+
+   int           status;
+   struct rusage usage;
+   while(pid != wait4(pid, &status, 0, &usage) && errno == EINTR);
+   result->wall_ns = crtl_bench_now_ns() - start;
+   result->cpu_us  = crtl_bench_rusage_us(&usage);
+   return(ok && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+// Re-execute this program as a libcurtail application and collect its result
+static bool crtl_bench_run_lib(crtl_bench_target_t target, crtl_bench_workload_t workload, const char *stats, crtl_bench_result_t *result) {
+   int fds[2];
+   if(0 != pipe(fds)) {
+      return(false);
+   }
+   char fd_arg[16];
+   snprintf(fd_arg, sizeof(fd_arg), "%d", fds[1]);
+   pid_t pid = fork();
+   if(pid < 0) {
+      return(false);
+   }
+   if(pid == 0) {
+      close(fds[0]);
+      crtl_bench_child_env(stats);
+      // Pass the parsed settings, crtl_parse_size modifies its argument
+      char bytes[24], size[24], record[24], rate[16], burst[16], burst_ms[16];
+      snprintf(bytes, sizeof(bytes), "%" PRIu64, g_bench.bytes);
+      snprintf(size, sizeof(size), "%" PRIu64, g_bench.size_max);
+      snprintf(record, sizeof(record), "%u", crtl_bench_record_size(target, workload));
+      snprintf(rate, sizeof(rate), "%u", g_bench.rate);
+      snprintf(burst, sizeof(burst), "%u", g_bench.burst);
+      snprintf(burst_ms, sizeof(burst_ms), "%u", g_bench.burst_ms);
+      char *argv[] = { g_bench.program, "--target", (char *)g_target_names[target], "--workload", (char *)g_workload_names[workload], "--bytes", bytes, "--size", size,
+                       "--record", record, "--rate", rate, "--burst", burst, "--interval", burst_ms, "--engine",
+                       g_bench.engine, "--storage", g_bench.storage, "--dir", g_bench.dir, "--lib-child", fd_arg, NULL };
+      execv("/proc/self/exe", argv);
+      _exit(127);
+   }
+   close(fds[1]);
+   bool ok = (sizeof(*result) == crtl_read(fds[0], result, sizeof(*result)));
+   close(fds[0]);
+   int status;
+   while(pid != waitpid(pid, &status, 0) && errno == EINTR);
+   return(ok && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+// Read the counts left by the shim, "-" when it wasn't loaded
+static void crtl_bench_stats(const char *stats, char *fallocates, char *writes, size_t size) {
+   snprintf(fallocates, size, "-");
+   snprintf(writes, size, "-");
+   FILE *file = fopen(stats, "r");
+   if(file == NULL) {
+      return;
+   }
+   char     name[32];
+   uint64_t value;
+   while(2 == fscanf(file, "%31s %" SCNu64, name, &value)) {
+      if(0 == strcmp(name, "fallocate")) {
+         snprintf(fallocates, size, "%" PRIu64, value);
+      } else if(0 == strcmp(name, "write")) {
+         snprintf(writes, size, "%" PRIu64, value);
+      }
+   }
+   fclose(file);
+}
+
+static bool crtl_bench_run(crtl_bench_target_t target, crtl_bench_workload_t workload) {
+   char filename[PATH_MAX];
+   char stats[PATH_MAX];
+   snprintf(filename, sizeof(filename), "%s/%s", g_bench.dir, CRTL_BENCH_OUTPUT);
+   snprintf(stats, sizeof(stats), "%s/%s", g_bench.dir, CRTL_BENCH_STATS);
+   unlink(filename);
+
+   crtl_bench_result_t *result = calloc(1, sizeof(crtl_bench_result_t));
+   if(result == NULL) {
+      return(false);
+   }
+   bool ok = (target == CRTL_BENCH_TARGET_BINARY) ? crtl_bench_run_binary(workload, filename, stats, result) :
+                                                     crtl_bench_run_lib(target, workload, stats, result);
+   if(!ok) {
+      fprintf(stderr, "%s %s run failed\n", g_target_names[target], g_workload_names[workload]);
+      free(result);
+      return(false);
+   }
+
+   char   fallocates[24];
+   char   writes[24];
+   double mb = result->bytes / (1024.0 * 1024.0);
+   crtl_bench_stats(stats, fallocates, writes, sizeof(fallocates));
+   printf("%-7s %-7s %9.1f %9.1f %9.1f %9.1f %10s %10s %9.2f\n", g_target_names[target], g_workload_names[workload],
+      mb / (result->wall_ns / 1e9), crtl_bench_percentile_us(result, 0.50), crtl_bench_percentile_us(result, 0.99),
+      crtl_bench_percentile_us(result, 0.999), fallocates, writes, result->cpu_us / 1000.0 / mb);
+   fflush(stdout);
+   unlink(filename);
+   unlink(stats);
+   free(result);
+   return(true);
+}
+
+int main(int argc, char *argv[]) {
+   g_bench.program = argv[0];
+   argp_parse(&argp, argc, argv, 0, 0, &g_bench);
+   if(g_bench.fd_result >= 0) {
+      char filename[PATH_MAX];
+      snprintf(filename, sizeof(filename), "%s/%s", g_bench.dir, CRTL_BENCH_OUTPUT);
+      return(crtl_bench_lib_child(filename));
+   }
+   signal(SIGPIPE, SIG_IGN);
+
+   printf("%-7s %-7s %9s %9s %9s %9s %10s %10s %9s\n", "target", "load", "MB/s", "p50 us", "p99 us", "p999 us",
+      "fallocate", "writes", "cpu ms/MB");
+   bool ok = true;
+   for(int target = CRTL_BENCH_TARGET_BINARY; target <= CRTL_BENCH_TARGET_DIRECT; target++) {
+      if(g_bench.target != CRTL_BENCH_TARGET_ALL && g_bench.target != (crtl_bench_target_t)target) {
+         continue;
+      }
+      for(int workload = CRTL_BENCH_WORKLOAD_LINES; workload <= CRTL_BENCH_WORKLOAD_BINARY; workload++) {
+         if(g_bench.workload != CRTL_BENCH_WORKLOAD_ALL && g_bench.workload != (crtl_bench_workload_t)workload) {
+            continue;
+         }
+         ok = crtl_bench_run(target, workload) && ok;
+      }
+   }
+   return(ok ? 0 : 1);
+}
@@ -0,0 +1,155 @@
+/**
+ * Copyright 2018 Comcast Cable Communications Management, LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Page cache footprint control.  In dontneed mode written data is dropped from the page cache with posix_fadvise once
+// a window of CRTL_CACHE_WINDOW bytes has been written.  Only clean pages are dropped, and the advice starts write-back
+// of the dirty ones, so about two windows stay cached.  In direct mode writes bypass the page cache: data is staged in
+// a block aligned buffer and written with O_DIRECT a whole block at a time.  The partial final block is written padded
+// and the file is truncated back to its real size, and the block stays in the buffer to be rewritten with the next
+// data.  Collapses remove whole blocks from the start of the file, so the final block stays at size_cur rounded down.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "curtail.h"
+#include "crtl_private.h"
+
+#define CRTL_CACHE_WINDOW  (1024 * 1024)
+#define CRTL_CACHE_STAGING (64 * 1024)
+
+const char *crtl_cache_str(crtl_cache_t cache) {
+   switch(cache) {
+      case CRTL_CACHE_DEFAULT:  return("default");
+      case CRTL_CACHE_DONTNEED: return("dontneed");
+      case CRTL_CACHE_DIRECT:   return("direct");
+   }
+   return("invalid");
+}
+
+bool crtl_cache_parse(const char *str, crtl_cache_t *cache) {
+   for(crtl_cache_t index = CRTL_CACHE_DEFAULT; index <= CRTL_CACHE_DIRECT; index++) {
+      if(0 == strcmp(str, crtl_cache_str(index))) {
+         *cache = index;
+         return(true);
+      }
+   }
+   return(false);
+}
+
+// Set up the cache mode of a newly opened output.  Must be called after everything that reads the file on open, as
+// those reads are not aligned.
+bool crtl_cache_open(crtl_output_t *output) {
+   if(output->cache == CRTL_CACHE_DONTNEED && output->map != NULL) {
+      LOG_WARN("page cache advice not used with mmap storage");
+      output->cache = CRTL_CACHE_DEFAULT;
+   }
+   if(output->cache != CRTL_CACHE_DIRECT) {
+      return(true);
+   }
+   if(output->storage != CRTL_STORAGE_COLLAPSE) {
+      LOG_ERROR("direct I/O requires collapse storage");
+      return(false);
+   }
+
+   uint32_t block_size = output->block_size;
+   output->staging_size = ((CRTL_CACHE_STAGING + block_size - 1) / block_size) * block_size;
+   if(0 != posix_memalign((void **)&output->staging, block_size, output->staging_size)) {
+      output->staging = NULL;
+      LOG_ERROR("unable to allocate direct I/O buffer");
+      return(false);
+   }
+   // The partial final block is rewritten with the next data
+   uint32_t tail = output->size_cur % block_size;
+   if(tail > 0 && (int)tail != crtl_pread(output->fd, output->staging, tail, output->size_cur - tail)) {
+      int errsv = errno;
+      LOG_ERROR("unable to read end of output file <%s>", strerror(errsv));
+      return(false);
+   }
+   int flags = fcntl(output->fd, F_GETFL);
+   if(flags < 0 || 0 > fcntl(output->fd, F_SETFL, flags | O_DIRECT)) {
+      int errsv = errno;
+      LOG_ERROR("unable to enable direct I/O <%s>", strerror(errsv));
+      return(false);
+   }
+   return(true);
+}
+
+void crtl_cache_close(crtl_output_t *output) {
+   free(output->staging);
+   output->staging = NULL;
+}
+
+// Write data after the end of a collapse storage file with O_DIRECT.  Returns the number of bytes written or -1.
+int crtl_cache_write(crtl_output_t *output, const char *buffer, uint32_t data_size) {
+   uint32_t block_size = output->block_size;
+   uint32_t tail       = output->size_cur % block_size;
+   off_t    offset     = output->size_cur - tail;
+   uint32_t written    = 0;
+   while(written < data_size) {
+      uint32_t length = output->staging_size - tail;
+      if(length > data_size - written) {
+         length = data_size - written;
+      }
+      memcpy(output->staging + tail, buffer + written, length);
+      uint32_t filled = tail + length;
+      uint32_t padded = ((filled + block_size - 1) / block_size) * block_size;
+      memset(output->staging + filled, 0, padded - filled);
+      int rc = crtl_pwrite(output->fd, output->staging, padded, offset);
+      if(rc != (int)padded) {
+         if(rc >= 0) {
+            errno = EIO;
+         }
+         return(-1);
+      }
+      // Keep the partial final block for the next write
+      uint32_t full = filled - filled % block_size;
+      memmove(output->staging, output->staging + full, filled - full);
+      tail     = filled - full;
+      offset  += full;
+      written += length;
+   }
+   if(tail > 0 && 0 != ftruncate(output->fd, offset + tail)) { // Drop the padding
+      return(-1);
+   }
+   return(written);
+}
+
+// Drop written data from the page cache once a window has been written
+void crtl_cache_written(crtl_output_t *output, uint64_t size) {
+   if(output->cache != CRTL_CACHE_DONTNEED) {
+      return;
+   }
+   output->cache_pending += size;
+   if(output->cache_pending < CRTL_CACHE_WINDOW) {
+      return;
+   }
+   output->cache_pending = 0;
+   // The partial final block of a collapse storage file is kept as it is written again.  Ring files wrap and the fd of
+   // segment storage is the segment being written, so the whole file is advised.
+   off_t length = (output->storage != CRTL_STORAGE_COLLAPSE) ? 0 : output->size_cur - output->size_cur % output->block_size;
+   int   rc     = posix_fadvise(output->fd, 0, length, POSIX_FADV_DONTNEED);
+   if(rc != 0) {
+      LOG_ERROR("unable to advise output file <%s>", strerror(rc));
+   }
+}
@@ -16,13 +16,38 @@
  * SPDX-License-Identifier: Apache-2.0
  */
 
+#include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <inttypes.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
 #include "curtail.h"
 #include "crtl_private.h"
 
+const char *crtl_engine_str(crtl_engine_t engine) {
+   switch(engine) {
+      case CRTL_ENGINE_AUTO:   return("auto");
+      case CRTL_ENGINE_COPY:   return("copy");
+      case CRTL_ENGINE_SPLICE: return("splice");
+      case CRTL_ENGINE_URING:  return("uring");
+   }
+   return("invalid");
+}
+
+bool crtl_engine_parse(const char *str, crtl_engine_t *engine) {
+   for(crtl_engine_t index = CRTL_ENGINE_AUTO; index <= CRTL_ENGINE_URING; index++) {
+      if(0 == strcmp(str, crtl_engine_str(index))) {
+         *engine = index;
+         return(true);
+      }
+   }
+   return(false);
+}
+
 const char *crtl_log_level_str(crtl_log_level_t level) {
    switch(level) {
       case CRTL_LEVEL_DEBUG: return("DEBUG");
@@ -34,9 +59,164 @@ const char *crtl_log_level_str(crtl_log_level_t level) {
    return("INVALID");
 }
 
-bool crtl_file_open(const char *filename, int *fd, uint32_t *block_size, uint64_t *file_size) {
-   if(filename == NULL || fd == NULL || block_size == NULL || file_size == NULL) {
-      LOG_ERROR("Invalid parameters filename %p fd %p block_size %p file_size %p", filename, fd, block_size, file_size);
+// Collapse offsets and lengths must be a multiple of the filesystem block size.  Filesystems with larger allocation
+// units (ie. XFS extent size hints) require collapses to be aligned to those instead.
+static uint32_t crtl_file_granularity(int fd, uint32_t block_size) {
+   struct fsxattr fsx;
+   if(0 == crtl_ioctl(fd, FS_IOC_FSGETXATTR, &fsx) && fsx.fsx_extsize > block_size && (fsx.fsx_extsize % block_size) == 0) {
+      LOG_DEBUG("using extent size %u instead of block size %u", fsx.fsx_extsize, block_size);
+      return(fsx.fsx_extsize);
+   }
+   return(block_size);
+}
+
+// Number of extents in the file, including space reserved beyond its end, or -1 if the filesystem can't tell
+static int64_t crtl_file_extents(int fd) {
+   struct fiemap fiemap;
+   memset(&fiemap, 0, sizeof(fiemap));
+   fiemap.fm_length = FIEMAP_MAX_OFFSET;
+   if(0 != crtl_ioctl(fd, FS_IOC_FIEMAP, &fiemap)) { // With no room for extents only the count is returned
+      return(-1);
+   }
+   return(fiemap.fm_mapped_extents);
+}
+
+// Reserve the space between the end of the file and the high watermark, so blocks are allocated in a few large
+// extents rather than one write at a time.  A collapse moves the reserved space down with the data.  Once its end
+// drops below the high watermark another eighth of the maximum size is reserved past it in one go, as topping up
+// after every collapse would add a small extent each time.
+static void crtl_file_prealloc(crtl_output_t *output) {
+   if(output->prealloc_end >= output->size_max) {
+      return;
+   }
+   uint64_t start = (output->prealloc_end > output->size_cur) ? output->prealloc_end : output->size_cur;
+   uint64_t end   = output->size_max + output->size_max / 8;
+   end -= end % output->block_size;
+   if(start >= end) { // Reopened with a smaller maximum size, the file already reaches past what would be reserved
+      return;
+   }
+   if(0 > crtl_fallocate(output->fd, FALLOC_FL_KEEP_SIZE, start, end - start)) {
+      int errsv = errno;
+      LOG_WARN("unable to preallocate output file <%s>", strerror(errsv));
+      output->prealloc = false;
+      return;
+   }
+   output->prealloc_end = end;
+}
+
+// Parse a size with an optional K, M or G suffix
+uint64_t crtl_parse_size(char *arg) {
+   size_t length = strlen(arg);
+   if(length == 0) {
+      return(0);
+   }
+   char last_char = arg[length - 1];
+   uint64_t multiplier = 1;
+   if(last_char == 'k' || last_char == 'K') {
+      multiplier = 1024;
+      arg[length - 1] = '\0';
+   } else if(last_char == 'm' || last_char == 'M') {
+      multiplier = 1024 * 1024;
+      arg[length - 1] = '\0';
+   } else if(last_char == 'g' || last_char == 'G') {
+      multiplier = 1024 * 1024 * 1024;
+      arg[length - 1] = '\0';
+   }
+
+   int size = atoi(arg);
+   if(size <= 0) {
+      return(0);
+   }
+   return(size * multiplier);
+}
+
+// Cut "<size>" off "<name>:<size>" when what follows the last colon is a size, being digits with an optional K, M or
+// G suffix.  A colon followed by anything but a digit is part of the name.  Returns 1 with size set if there was a
+// size, 0 if there was none or -1 if it isn't a valid non-zero size.
+int crtl_parse_spec_size(char *spec, uint64_t *size) {
+   char *colon = strrchr(spec, ':');
+   if(colon == NULL || colon == spec || !isdigit((unsigned char)colon[1])) {
+      return(0);
+   }
+   char *end = NULL;
+   errno = 0;
+   uint64_t value      = strtoull(colon + 1, &end, 10);
+   uint64_t multiplier = 1;
+   if(*end == 'k' || *end == 'K') {
+      multiplier = 1024;
+      end++;
+   } else if(*end == 'm' || *end == 'M') {
+      multiplier = 1024 * 1024;
+      end++;
+   } else if(*end == 'g' || *end == 'G') {
+      multiplier = 1024 * 1024 * 1024;
+      end++;
+   }
+   if(errno != 0 || *end != '\0' || value == 0 || value > UINT64_MAX / multiplier) {
+      LOG_ERROR("invalid size <%s> in <%s>", colon + 1, spec);
+      return(-1);
+   }
+   *colon = '\0';
+   *size  = value * multiplier;
+   return(1);
+}
+
+// Track lines in the data already in the file.  Ring files start at a line once their head has moved, plain files
+// get the offset of their first complete line published.
+static bool crtl_file_lines_open(const char *filename, crtl_output_t *output) {
+   uint64_t size_max = CRTL_STORAGE_IS_RING(output) ? output->ring_capacity : output->size_max;
+   output->lines = crtl_lines_open(filename, output->fd, size_max, output->block_size);
+   if(output->lines == NULL) {
+      return(false);
+   }
+   uint64_t position = CRTL_STORAGE_IS_RING(output) ? output->ring_head : 0;
+   uint64_t end      = position + output->size_cur;
+   char buffer[64 * 1024];
+   while(position < end) {
+      uint64_t length = end - position;
+      off_t    offset = position;
+      if(CRTL_STORAGE_IS_RING(output)) {
+         offset = output->ring_offset + (position % output->ring_capacity);
+         if(length > output->ring_capacity - (position % output->ring_capacity)) {
+            length = output->ring_capacity - (position % output->ring_capacity);
+         }
+      }
+      if(length > sizeof(buffer)) {
+         length = sizeof(buffer);
+      }
+      int rc = crtl_pread(output->fd, buffer, length, offset);
+      if(rc <= 0) {
+         break;
+      }
+      crtl_lines_add(output->lines, position, buffer, rc);
+      position += rc;
+   }
+   if(!CRTL_STORAGE_IS_RING(output)) {
+      crtl_lines_publish(output->lines, output->fd, crtl_lines_first(output->lines, 0, output->size_cur));
+   }
+   return(true);
+}
+
+static bool crtl_file_compress_open(crtl_output_t *output) {
+   if(output->storage != CRTL_STORAGE_COLLAPSE) {
+      LOG_ERROR("compression requires collapse storage");
+      return(false);
+   }
+   if(output->size_cur > 0 && !crtl_compress_detect(output->fd)) {
+      LOG_ERROR("output file exists and is not compressed");
+      return(false);
+   }
+   if(output->line_head) {
+      LOG_WARN("line tracking not available with compression");
+      output->line_head = false;
+   }
+   output->compressor = crtl_compress_open(output, output->compress_threads);
+   return(output->compressor != NULL);
+}
+
+bool crtl_file_open(const char *filename, crtl_output_t *output) {
+   if(filename == NULL || output == NULL) {
+      LOG_ERROR("Invalid parameters filename %p output %p", filename, output);
       return(false);
    }
    int fd_file = crtl_open(filename, O_RDWR | O_CREAT, 0644);
@@ -64,9 +244,74 @@ bool crtl_file_open(const char *filename, int *fd, uint32_t *block_size, uint64_
       return(false);
    }
    
-   *fd         = fd_file;
-   *block_size = statbuf.st_blksize;
-   *file_size  = offset_end;
+   output->fd         = fd_file;
+   output->block_size = crtl_file_granularity(fd_file, statbuf.st_blksize);
+   output->size_cur   = offset_end;
+   if(!crtl_storage_open(filename, output)) {
+      crtl_file_close(&output->fd);
+      return(false);
+   }
+   output->collapsed = 0;
+   if(output->storage == CRTL_STORAGE_COLLAPSE && output->size_max < 2 * (uint64_t)output->block_size) {
+      // A collapse never reaches the last granule, below two of them nothing could ever be removed
+      LOG_WARN("file size must be at least 2x the collapse granularity (%u bytes), using %" PRIu64 " bytes", output->block_size, 2 * (uint64_t)output->block_size);
+      output->size_max = 2 * (uint64_t)output->block_size;
+   }
+   if(output->storage == CRTL_STORAGE_COLLAPSE && !output->compress && crtl_compress_detect(output->fd)) {
+      LOG_ERROR("output file is compressed");
+      crtl_storage_close(output);
+      return(false);
+   }
+   if(output->compress && !crtl_file_compress_open(output)) {
+      crtl_storage_close(output);
+      return(false);
+   }
+   if(output->line_head && !crtl_file_lines_open(filename, output)) {
+      crtl_storage_close(output);
+      return(false);
+   }
+   if(output->publish && output->storage == CRTL_STORAGE_COLLAPSE) { // Ring files and segment indexes keep logical offsets themselves
+      output->offsets = crtl_offsets_open(filename, output->fd);
+      if(output->offsets == NULL) {
+         LOG_WARN("collapse offsets not published, the file can't be followed");
+      }
+   }
+   if(output->sync != CRTL_SYNC_NONE) {
+      output->syncer = crtl_sync_open(output);
+      if(output->syncer == NULL) {
+         crtl_storage_close(output);
+         return(false);
+      }
+   }
+   if(output->timestamp) {
+      output->stamp = crtl_stamp_open();
+      if(output->stamp == NULL) {
+         crtl_storage_close(output);
+         return(false);
+      }
+   }
+   if(!crtl_cache_open(output)) {
+      crtl_storage_close(output);
+      return(false);
+   }
+   if(output->prealloc && output->storage != CRTL_STORAGE_COLLAPSE) { // Ring files are allocated in full, segments are reused
+      output->prealloc = false;
+   }
+   if(output->prealloc && output->staging != NULL) {
+      LOG_WARN("preallocation not used with direct I/O, which truncates the file after every write");
+      output->prealloc = false;
+   }
+   if(output->prealloc) {
+      output->prealloc_end = 0;
+      crtl_file_prealloc(output);
+   }
+   int64_t extents = crtl_file_extents(output->fd);
+   if(extents >= 0) {
+      LOG_INFO("output file has %" PRId64 " extents", extents);
+      if(output->stats_extents) {
+         crtl_stats_set(CRTL_GAUGE_EXTENTS, extents);
+      }
+   }
    return(true);
 }
 
@@ -78,20 +323,121 @@ void crtl_file_close(int *fd) {
    *fd = -1;
 }
 
-int crtl_process_input(int fd, uint64_t *file_size_cur, uint64_t file_size_max, uint32_t logical_block_size, const char *buffer, uint32_t data_size) {
-   if(*file_size_cur + data_size > file_size_max) { // Log file is full or oversized, deallocate blocks
-      int numblocks = (*file_size_cur + data_size - file_size_max + (logical_block_size - 1)) / logical_block_size;
-      if(0 > crtl_fallocate(fd, FALLOC_FL_COLLAPSE_RANGE, 0, logical_block_size * numblocks)) {
+bool crtl_fd_is_pipe(int fd) {
+   struct stat statbuf;
+   if(crtl_fstat(fd, &statbuf) != 0) {
+      return(false);
+   }
+   return(S_ISFIFO(statbuf.st_mode));
+}
+
+// Sanitize the high and low watermarks of an output
+void crtl_file_limits(crtl_output_t *output) {
+   if(output->size_max % DEFAULT_SECTOR_SIZE) {
+      LOG_WARN("file size should be an integer multiple of the block size (%u bytes)", DEFAULT_SECTOR_SIZE);
+      output->size_max -= output->size_max % DEFAULT_SECTOR_SIZE;
+   }
+   if(output->size_max < 2 * DEFAULT_SECTOR_SIZE) {
+      LOG_WARN("file size must be greater than 2x block size (%u bytes)", DEFAULT_SECTOR_SIZE);
+      output->size_max = 2 * DEFAULT_SECTOR_SIZE;
+   }
+   if(output->size_low == 0 || output->size_low > output->size_max) { // Default to only freeing what is needed
+      output->size_low = output->size_max;
+   }
+}
+
+// Number of bytes that must be deallocated from the start of the file to make room for data_size more bytes.  Once
+// the high watermark would be exceeded, the file is collapsed down to the low watermark in a single operation.
+uint64_t crtl_file_collapse_length(const crtl_output_t *output, uint32_t data_size) {
+   if(output->size_cur + data_size <= output->size_max) {
+      return(0);
+   }
+   uint64_t granularity = output->block_size;
+   uint64_t length      = output->size_cur + data_size - output->size_low;
+   length = ((length + (granularity - 1)) / granularity) * granularity;
+   if(output->compressor != NULL) { // Whole frames only
+      return(crtl_compress_collapse_length(output->compressor, length, output->size_cur));
+   }
+
+   // A collapse may not reach the end of the file
+   uint64_t length_max = output->size_cur > 0 ? ((output->size_cur - 1) / granularity) * granularity : 0;
+   if(length > length_max) {
+      length = length_max;
+   }
+   return(length);
+}
+
+// Account for size bytes written to the output file, after size_cur has been updated
+void crtl_output_written(crtl_output_t *output, uint64_t size) {
+   crtl_stats_add(CRTL_STAT_BYTES_WRITTEN, size);
+   if(output->syncer != NULL) {
+      crtl_sync_written(output->syncer, size);
+   }
+   crtl_cache_written(output, size);
+}
+
+// Account for data appended to a collapse storage file
+void crtl_file_written(crtl_output_t *output, const char *buffer, uint32_t size) {
+   if(output->lines != NULL) {
+      crtl_lines_add(output->lines, output->collapsed + output->size_cur, buffer, size);
+   }
+   output->size_cur += size;
+   crtl_output_written(output, size);
+}
+
+// Tell followers that length bytes are about to be removed from the start of a collapse storage file, or that a
+// collapse failed when length is 0
+void crtl_file_collapsing(crtl_output_t *output, uint64_t length) {
+   if(output->offsets != NULL) {
+      crtl_offsets_publish(output->offsets, output->fd, output->collapsed, length);
+   }
+}
+
+// Account for length bytes removed from the start of a collapse storage file
+void crtl_file_collapsed(crtl_output_t *output, uint64_t length) {
+   output->size_cur  -= length;
+   output->collapsed += length;
+   if(output->offsets != NULL) {
+      crtl_offsets_publish(output->offsets, output->fd, output->collapsed, 0);
+   }
+   if(output->prealloc) {
+      output->prealloc_end = (output->prealloc_end > length) ? output->prealloc_end - length : 0;
+      crtl_file_prealloc(output);
+      if(output->stats_extents) { // Only preallocation changes the extents much between collapses
+         int64_t extents = crtl_file_extents(output->fd);
+         if(extents >= 0) {
+            crtl_stats_set(CRTL_GAUGE_EXTENTS, extents);
+         }
+      }
+   }
+   crtl_stats_add(CRTL_STAT_BYTES_COLLAPSED, length);
+   crtl_stats_add(CRTL_STAT_COLLAPSES, 1);
+   if(output->compressor != NULL) {
+      crtl_compress_collapsed(output->compressor, length);
+   }
+   if(output->lines != NULL) {
+      uint64_t line = crtl_lines_first(output->lines, output->collapsed, output->collapsed + output->size_cur);
+      crtl_lines_publish(output->lines, output->fd, line - output->collapsed);
+   }
+}
+
+// Deallocate blocks from the start of the file to make room for data_size more bytes
+static int crtl_file_collapse(crtl_output_t *output, uint32_t data_size) {
+   uint64_t length = crtl_file_collapse_length(output, data_size);
+   if(length > 0) { // Log file is full or oversized, deallocate blocks
+      crtl_file_collapsing(output, length);
+      if(0 > crtl_fallocate(output->fd, FALLOC_FL_COLLAPSE_RANGE, 0, length)) {
          int errsv = errno;
          LOG_ERROR("error fallocate output file <%s>", strerror(errsv));
+         crtl_file_collapsing(output, 0);
          return(-1);
       } else {
-         LOG_DEBUG("truncated output file from %" PRIu64 " to %" PRIu64 " bytes(numblocks: %d)",
-            *file_size_cur, *file_size_cur - (logical_block_size * numblocks), numblocks);
-            *file_size_cur -= (logical_block_size * numblocks);
+         LOG_DEBUG("truncated output file from %" PRIu64 " to %" PRIu64 " bytes(numblocks: %" PRIu64 ")",
+            output->size_cur, output->size_cur - length, length / output->block_size);
+         crtl_file_collapsed(output, length);
 
          // Reset the file pointer to the new end of the file
-         off_t offset_end = crtl_seek(fd, 0, SEEK_END);
+         off_t offset_end = crtl_seek(output->fd, 0, SEEK_END);
          if(offset_end < 0) {
             int errsv = errno;
             LOG_ERROR("unable to seek end of output file <%s>", strerror(errsv));
@@ -99,13 +445,275 @@ int crtl_process_input(int fd, uint64_t *file_size_cur, uint64_t file_size_max,
          }
       }
    }
+   return(0);
+}
+
+void crtl_output_lock(crtl_output_t *output) {
+   if(output->lock != NULL) {
+      pthread_mutex_lock(output->lock);
+   }
+}
+
+void crtl_output_unlock(crtl_output_t *output) {
+   if(output->lock != NULL) {
+      pthread_mutex_unlock(output->lock);
+   }
+}
+
+// Set up an output with the settings of another, leaving out everything that belongs to the other's open file
+void crtl_output_settings(crtl_output_t *output, const crtl_output_t *settings) {
+   *output = *settings;
+   output->fd            = -1;
+   output->block_size    = 0;
+   output->size_cur      = 0;
+   output->lock          = NULL;
+   output->ring_offset   = 0;
+   output->ring_capacity = 0;
+   output->ring_head     = 0;
+   output->ring_tail     = 0;
+   output->map           = NULL;
+   output->msync_time    = 0;
+   output->segments      = NULL;
+   output->collapsed     = 0;
+   output->lines         = NULL;
+   output->offsets       = NULL;
+   output->compressor    = NULL;
+   output->syncer        = NULL;
+   output->prealloc_end  = 0;
+   output->staging       = NULL;
+   output->staging_size  = 0;
+   output->cache_pending = 0;
+   output->stamp         = NULL;
+   output->tee           = NULL;
+   output->tee_pipe[0]   = -1;
+   output->tee_pipe[1]   = -1;
+   output->matcher       = NULL;
+}
+
+static int crtl_process_target(crtl_output_t *output, const char *buffer, uint32_t data_size) {
+   if(output->stamp != NULL) {
+      return(crtl_stamp_input(output->stamp, output, buffer, data_size));
+   }
+   return(crtl_process_output(output, buffer, data_size));
+}
+
+// Write data to an output and its tee targets
+int crtl_process_write(crtl_output_t *output, const char *buffer, uint32_t data_size) {
+   int rc = crtl_process_target(output, buffer, data_size);
+   for(crtl_output_t *target = output->tee; target != NULL && rc >= 0; target = target->tee) {
+      // A tee target may be smaller than the output the data was sized for, or large enough not to fit 32 bits
+      uint64_t half_max   = target->size_max / 2;
+      uint32_t length_max = (half_max < data_size) ? (uint32_t)half_max : data_size;
+      if(length_max == 0) {
+         length_max = 1;
+      }
+      for(uint32_t written = 0; written < data_size && rc >= 0; written += length_max) {
+         uint32_t length = (data_size - written < length_max) ? data_size - written : length_max;
+         if(0 > crtl_process_target(target, buffer + written, length)) {
+            rc = -1;
+         }
+      }
+   }
+   return(rc);
+}
+
+int crtl_process_input(crtl_output_t *output, const char *buffer, uint32_t data_size) {
+   crtl_stats_add(CRTL_STAT_BYTES_IN, data_size);
+   int rc = crtl_process_write(output, buffer, data_size);
+   if(rc >= 0 && output->matcher != NULL && 0 > crtl_match_input(output->matcher, buffer, data_size)) {
+      rc = -1;
+   }
+   return(rc);
+}
+
+// Write data to the output, compressed or not
+int crtl_process_output(crtl_output_t *output, const char *buffer, uint32_t data_size) {
+   if(output->compressor != NULL) { // Only the compression workers write to the file
+      return(crtl_compress_input(output->compressor, buffer, data_size));
+   }
+   crtl_output_lock(output);
+   int rc;
+   if(CRTL_STORAGE_IS_RING(output)) {
+      rc = crtl_storage_write(output, buffer, data_size);
+   } else if(output->storage == CRTL_STORAGE_SEGMENT) {
+      rc = crtl_segment_write(output, buffer, data_size);
+   } else {
+      rc = crtl_file_append(output, buffer, data_size);
+   }
+   crtl_output_unlock(output);
+   return(rc);
+}
+
+// Make room for and write data at the end of a collapse storage file
+int crtl_file_append(crtl_output_t *output, const char *buffer, uint32_t data_size) {
+   if(0 > crtl_file_collapse(output, data_size)) {
+      return(-1);
+   }
    // Write to output file
-   int rc = crtl_write(fd, buffer, data_size);
+   int rc = (output->staging != NULL) ? crtl_cache_write(output, buffer, data_size) : crtl_write(output->fd, buffer, data_size);
    if(rc < 0) {
       int errsv = errno;
       LOG_ERROR("error writing to output file <%s>", strerror(errsv));
    } else {
-      *file_size_cur += rc;
+      crtl_file_written(output, buffer, rc);
+   }
+   return(rc);
+}
+
+// Format the line that stands in for size bytes of discarded data.  Returns its length.
+uint32_t crtl_dropped_marker(char *marker, size_t marker_size, uint64_t size) {
+   int length = snprintf(marker, marker_size, "[curtail: %" PRIu64 " bytes dropped]\n", size);
+   return((length > 0 && (size_t)length < marker_size) ? (uint32_t)length : 0);
+}
+
+// Record in the output that data was discarded rather than written
+int crtl_process_dropped(crtl_output_t *output, uint64_t size) {
+   char marker[CRTL_DROPPED_MARKER_MAX];
+   return(crtl_process_input(output, marker, crtl_dropped_marker(marker, sizeof(marker), size)));
+}
+
+// Splice exactly length bytes from a pipe to the end of a collapse storage output
+static int crtl_splice_all(int fd_pipe, crtl_output_t *output, uint32_t length) {
+   crtl_output_lock(output);
+   int rc = crtl_file_collapse(output, length);
+   for(uint32_t moved = 0; moved < length && rc >= 0; moved += rc) {
+      rc = crtl_splice(fd_pipe, output->fd, NULL, length - moved, SPLICE_F_MOVE);
+      if(rc == 0) { // The data is already in the pipe
+         errno = EIO;
+         rc    = -1;
+      } else if(rc > 0) {
+         output->size_cur += rc;
+         crtl_output_written(output, rc);
+      }
+   }
+   if(rc < 0) {
+      int errsv = errno;
+      LOG_ERROR("error splicing to output file <%s>", strerror(errsv));
+      errno = errsv;
+   }
+   crtl_output_unlock(output);
+   return(rc < 0 ? -1 : 0);
+}
+
+// Splice to an output and its tee targets.  The data is duplicated into each target's pipe with tee, which leaves it in
+// the input, and spliced from there to the target.  Then the same amount is spliced from the input to the output.
+static int crtl_process_tee(int fd_input, crtl_output_t *output, uint32_t data_size) {
+   int length = 0;
+   for(crtl_output_t *target = output->tee; target != NULL; target = target->tee) {
+      int rc = crtl_tee(fd_input, target->tee_pipe[1], (target == output->tee) ? data_size : (uint32_t)length);
+      if(rc < 0 && target == output->tee) { // Nothing was moved yet, so the caller can still fall back to copying
+         return(-1);
+      }
+      // A tee stops at the pipe buffers that fit in the target's pipe.  The pipes are all empty and the same size, so
+      // the first tee decides the length and the others must match.
+      if(rc <= 0 || (target != output->tee && rc != length)) {
+         int errsv = (rc < 0) ? errno : EIO;
+         LOG_ERROR("error duplicating input <%s>", strerror(errsv));
+         errno = (errsv == EINVAL) ? EIO : errsv;
+         return(-1);
+      }
+      length = rc;
+   }
+   // Some outputs may have the data by now, so an EINVAL must not make the caller fall back to copying
+   for(crtl_output_t *target = output->tee; target != NULL; target = target->tee) {
+      if(0 > crtl_splice_all(target->tee_pipe[0], target, length)) {
+         errno = (errno == EINVAL) ? EIO : errno;
+         return(-1);
+      }
+   }
+   if(0 > crtl_splice_all(fd_input, output, length)) {
+      errno = (errno == EINVAL) ? EIO : errno;
+      return(-1);
+   }
+   crtl_stats_add(CRTL_STAT_BYTES_IN, length);
+   return(length);
+}
+
+// Move data from the input pipe to the output file without copying it through user space.  Blocks until data is
+// available.  Returns the number of bytes moved, 0 at end of input or -1 on error.  If the output file does not
+// support splice, -1 is returned with errno set to EINVAL and the caller is expected to fall back to the copy path.
+int crtl_process_splice(int fd_input, crtl_output_t *output) {
+   for(crtl_output_t *target = output; target != NULL; target = target->tee) {
+      if(target->lines != NULL || target->compressor != NULL || target->staging != NULL || target->stamp != NULL || target->matcher != NULL || target->segments != NULL || target->map != NULL) { // These have to see the data
+         errno = EINVAL;
+         return(-1);
+      }
+      if(output->tee != NULL && (CRTL_STORAGE_IS_RING(target) || (target != output && target->tee_pipe[1] < 0))) {
+         errno = EINVAL; // Every output gets the same amount, which a ring could only take up to where it wraps
+         return(-1);
+      }
+   }
+   int available = 0;
+   if(0 > crtl_ioctl(fd_input, FIONREAD, &available)) {
+      int errsv = errno;
+      LOG_ERROR("unable to get input size <%s>", strerror(errsv));
+      return(-1);
+   }
+   if(available <= 0) { // Wait for data to arrive
+      struct pollfd pfd = { .fd = fd_input, .events = POLLIN };
+      if(0 > crtl_poll(&pfd, 1, -1)) {
+         int errsv = errno;
+         LOG_ERROR("error polling input <%s>", strerror(errsv));
+         return(-1);
+      }
+      if(0 > crtl_ioctl(fd_input, FIONREAD, &available)) {
+         int errsv = errno;
+         LOG_ERROR("unable to get input size <%s>", strerror(errsv));
+         return(-1);
+      }
+      if(available <= 0) { // Readable with nothing to read means the write end was closed
+         return(0);
+      }
+   }
+
+   // The amount moved must be known before the splice so that room can be made for it
+   uint32_t data_size = available;
+   if(data_size > CRTL_SPLICE_SIZE_MAX) {
+      data_size = CRTL_SPLICE_SIZE_MAX;
+   }
+   for(crtl_output_t *target = output; target != NULL; target = target->tee) {
+      if(data_size > target->size_max / 2) {
+         data_size = target->size_max / 2;
+      }
+   }
+   if(output->tee != NULL) {
+      return(crtl_process_tee(fd_input, output, data_size));
+   }
+
+   crtl_output_lock(output);
+   off_t  offset_ring;
+   loff_t offset_out;
+   loff_t *offset = NULL;
+   if(CRTL_STORAGE_IS_RING(output)) { // Splice to the tail of the ring, stopping where it wraps
+      if(0 > crtl_storage_reserve(output, &data_size, &offset_ring)) {
+         crtl_output_unlock(output);
+         return(-1);
+      }
+      offset_out = offset_ring;
+      offset     = &offset_out;
+   } else if(0 > crtl_file_collapse(output, data_size)) {
+      crtl_output_unlock(output);
+      return(-1);
+   }
+   int rc = crtl_splice(fd_input, output->fd, offset, data_size, SPLICE_F_MOVE);
+   int errsv = errno;
+   if(rc < 0) {
+      if(errsv != EINVAL) {
+         LOG_ERROR("error splicing to output file <%s>", strerror(errsv));
+      }
+   } else if(CRTL_STORAGE_IS_RING(output)) {
+      if(0 > crtl_storage_commit(output, rc)) {
+         errsv = errno;
+         rc    = -1;
+      }
+   } else {
+      output->size_cur += rc;
+      crtl_output_written(output, rc);
+   }
+   if(rc > 0) {
+      crtl_stats_add(CRTL_STAT_BYTES_IN, rc);
    }
+   crtl_output_unlock(output);
+   errno = errsv;
    return(rc);
 }
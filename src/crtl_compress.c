@@ -0,0 +1,506 @@
+/**
+ * Copyright 2018 Comcast Cable Communications Management, LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Compressed output.  Input is gathered into frames of up to CRTL_COMPRESS_FRAME_SIZE bytes which a small pool of
+// worker threads deflates independently of each other.  Each frame is a header followed by the zlib stream and is
+// padded to a whole number of blocks, and collapses are rounded up to frame boundaries, so the file always starts
+// with a complete frame.  Frames are written in input order by whichever worker finishes the oldest one.  A frame that
+// is not full is compressed once it has waited CRTL_COMPRESS_FLUSH_MS, on crtl_fsync and when the output is closed.
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "curtail.h"
+#include "crtl_private.h"
+
+#define CRTL_COMPRESS_MAGIC    "CRTZ"
+#define CRTL_COMPRESS_VERSION  (2)
+#define CRTL_COMPRESS_HEADER_1 (offsetof(crtl_frame_header_t, block_size)) // Version 1 headers end before block_size
+
+typedef struct {
+   char     magic[4];
+   uint32_t version;
+   uint32_t size_frame;      // Including the header and padding
+   uint32_t size_compressed;
+   uint32_t size_raw;
+   uint32_t block_size;      // Frames are padded to a multiple of this (0 when read from a version 1 header)
+} crtl_frame_header_t;
+
+// Size of the header as written, the compressed data follows it
+static uint32_t crtl_compress_header_size(const crtl_frame_header_t *header) {
+   return((header->version == 1) ? CRTL_COMPRESS_HEADER_1 : sizeof(*header));
+}
+
+// Returns 1 if a valid frame header was read at offset, 0 if not or -1 on error
+static int crtl_compress_header_read(int fd, off_t offset, crtl_frame_header_t *header) {
+   int rc = crtl_pread(fd, header, sizeof(*header), offset);
+   if(rc < 0) {
+      int errsv = errno;
+      LOG_ERROR("unable to read frame header <%s>", strerror(errsv));
+      return(-1);
+   }
+   if(rc < (int)CRTL_COMPRESS_HEADER_1 || 0 != memcmp(header->magic, CRTL_COMPRESS_MAGIC, sizeof(header->magic)) ||
+      header->version < 1 || header->version > CRTL_COMPRESS_VERSION) {
+      return(0);
+   }
+   if(header->version == 1) {
+      header->block_size = 0;
+   } else if(rc != sizeof(*header)) {
+      return(0);
+   }
+   if(header->size_frame < crtl_compress_header_size(header) + header->size_compressed) {
+      return(0);
+   }
+   return(1);
+}
+
+#ifdef HAVE_ZLIB_H
+#include <zlib.h>
+
+#define CRTL_COMPRESS_FRAME_SIZE (64 * 1024)
+#define CRTL_COMPRESS_FLUSH_MS   (1000)
+#define CRTL_COMPRESS_THREADS    (2)
+#define CRTL_COMPRESS_THREAD_MAX (16)
+
+typedef enum {
+   CRTL_FRAME_FREE      = 0, // Available to be filled
+   CRTL_FRAME_FILLING   = 1, // Receiving input
+   CRTL_FRAME_PENDING   = 2, // Waiting for a worker
+   CRTL_FRAME_BUSY      = 3, // Being compressed
+   CRTL_FRAME_DONE      = 4  // Waiting to be written
+} crtl_frame_state_t;
+
+typedef struct {
+   crtl_frame_state_t state;
+   char *             raw;
+   uint32_t           size_raw;
+   char *             data;      // Header, compressed data and padding
+   uint32_t           size_data;
+   uint64_t           filled_ms; // When the first byte was added
+} crtl_frame_t;
+
+struct crtl_compress_s {
+   crtl_output_t * output;
+   pthread_mutex_t mutex;
+   pthread_cond_t  work;      // Frames are pending or workers should exit
+   pthread_cond_t  space;     // A frame was freed
+   pthread_t       threads[CRTL_COMPRESS_THREAD_MAX];
+   uint32_t        thread_count;
+   bool            stop;
+   bool            failed;
+   bool            writing;   // A worker is writing frames
+   crtl_frame_t *  frames;
+   uint32_t        frame_count;
+   uint32_t        frame_raw_max;
+   uint32_t        frame_data_max;
+   uint64_t        seq_fill;  // Frame receiving input
+   uint64_t        seq_write; // Next frame to be written
+   uint32_t *      sizes;     // Sizes of the frames in the file, oldest first
+   uint32_t        sizes_capacity;
+   uint32_t        sizes_first;
+   uint32_t        sizes_count;
+};
+
+static uint64_t crtl_compress_time_ms(void) {
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+   return((uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000);
+}
+
+static void crtl_compress_size_push(crtl_compress_t *compress, uint32_t size) {
+   if(compress->sizes_count == compress->sizes_capacity) { // Can't happen as frames are at least a block
+      return;
+   }
+   compress->sizes[(compress->sizes_first + compress->sizes_count) % compress->sizes_capacity] = size;
+   compress->sizes_count++;
+}
+
+// Number of bytes to collapse to remove at least length bytes without splitting a frame.  Falls back to the last frame
+// boundary before the end of the file when there is no later one.
+uint64_t crtl_compress_collapse_length(const crtl_compress_t *compress, uint64_t length, uint64_t size_cur) {
+   uint64_t boundary = 0;
+   for(uint32_t index = 0; index < compress->sizes_count && boundary < length; index++) {
+      uint64_t next = boundary + compress->sizes[(compress->sizes_first + index) % compress->sizes_capacity];
+      if(next >= size_cur) {
+         break;
+      }
+      boundary = next;
+   }
+   return(boundary);
+}
+
+void crtl_compress_collapsed(crtl_compress_t *compress, uint64_t length) {
+   while(length > 0 && compress->sizes_count > 0) {
+      uint32_t size = compress->sizes[compress->sizes_first];
+      length -= (size < length) ? size : length;
+      compress->sizes_first = (compress->sizes_first + 1) % compress->sizes_capacity;
+      compress->sizes_count--;
+   }
+}
+
+static void crtl_compress_frame(crtl_compress_t *compress, crtl_frame_t *frame) {
+   crtl_frame_header_t header;
+   memcpy(header.magic, CRTL_COMPRESS_MAGIC, sizeof(header.magic));
+   header.version    = CRTL_COMPRESS_VERSION;
+   header.size_raw   = frame->size_raw;
+   header.block_size = compress->output->block_size;
+
+   uLongf size_compressed = compress->frame_data_max - sizeof(header);
+   int rc = compress2((Bytef *)frame->data + sizeof(header), &size_compressed, (const Bytef *)frame->raw, frame->size_raw, Z_DEFAULT_COMPRESSION);
+   if(rc != Z_OK) {
+      LOG_ERROR("unable to compress frame <%d>", rc);
+      frame->size_data = 0;
+      return;
+   }
+   // Pad to a whole number of blocks so the frame can be collapsed on its own
+   uint32_t block_size = compress->output->block_size;
+   uint32_t size       = sizeof(header) + size_compressed;
+   frame->size_data    = ((size + block_size - 1) / block_size) * block_size;
+   memset(frame->data + size, 0, frame->size_data - size);
+
+   header.size_frame      = frame->size_data;
+   header.size_compressed = size_compressed;
+   memcpy(frame->data, &header, sizeof(header));
+}
+
+// Write completed frames in order.  Called with the mutex held, which is released while writing.  The workers are the
+// only writers of a compressed output and take turns through the writing flag, so the output lock isn't taken here.
+// Callers hold it while adding input and waiting for a free frame, and a worker waiting for it would never free one.
+static void crtl_compress_write_done(crtl_compress_t *compress) {
+   while(!compress->writing) {
+      crtl_frame_t *frame = &compress->frames[compress->seq_write % compress->frame_count];
+      if(frame->state != CRTL_FRAME_DONE) {
+         break;
+      }
+      compress->writing = true;
+      pthread_mutex_unlock(&compress->mutex);
+
+      bool failed = (frame->size_data == 0);
+      if(!failed) {
+         failed = (0 > crtl_file_append(compress->output, frame->data, frame->size_data));
+         if(!failed) {
+            crtl_compress_size_push(compress, frame->size_data);
+         }
+      }
+
+      pthread_mutex_lock(&compress->mutex);
+      if(failed) {
+         compress->failed = true;
+      }
+      frame->state      = CRTL_FRAME_FREE;
+      frame->size_raw   = 0;
+      compress->seq_write++;
+      compress->writing = false;
+      pthread_cond_broadcast(&compress->space);
+   }
+}
+
+// Hand the frame receiving input to the workers.  Called with the mutex held.
+static void crtl_compress_submit(crtl_compress_t *compress) {
+   crtl_frame_t *frame = &compress->frames[compress->seq_fill % compress->frame_count];
+   if(frame->state == CRTL_FRAME_FILLING && frame->size_raw > 0) {
+      frame->state = CRTL_FRAME_PENDING;
+      compress->seq_fill++;
+      pthread_cond_signal(&compress->work);
+   }
+}
+
+static void *crtl_compress_worker(void *param) {
+   crtl_compress_t *compress = param;
+   pthread_mutex_lock(&compress->mutex);
+   while(!compress->stop) {
+      // Oldest pending frame first so frames complete roughly in order
+      crtl_frame_t *frame = NULL;
+      for(uint64_t seq = compress->seq_write; seq < compress->seq_fill; seq++) {
+         if(compress->frames[seq % compress->frame_count].state == CRTL_FRAME_PENDING) {
+            frame = &compress->frames[seq % compress->frame_count];
+            break;
+         }
+      }
+      if(frame != NULL) {
+         frame->state = CRTL_FRAME_BUSY;
+         pthread_mutex_unlock(&compress->mutex);
+         crtl_compress_frame(compress, frame);
+         pthread_mutex_lock(&compress->mutex);
+         frame->state = CRTL_FRAME_DONE;
+         crtl_compress_write_done(compress);
+         continue;
+      }
+
+      // Don't let a partial frame wait forever
+      crtl_frame_t *filling = &compress->frames[compress->seq_fill % compress->frame_count];
+      uint64_t      now     = crtl_compress_time_ms();
+      if(filling->state == CRTL_FRAME_FILLING && filling->size_raw > 0 && now - filling->filled_ms >= CRTL_COMPRESS_FLUSH_MS) {
+         crtl_compress_submit(compress);
+         continue;
+      }
+      struct timespec deadline;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_nsec += (long)CRTL_COMPRESS_FLUSH_MS * 1000000 / 2;
+      deadline.tv_sec  += deadline.tv_nsec / 1000000000;
+      deadline.tv_nsec %= 1000000000;
+      pthread_cond_timedwait(&compress->work, &compress->mutex, &deadline);
+   }
+   pthread_mutex_unlock(&compress->mutex);
+   return(NULL);
+}
+
+// Add input to the current frame.  Only blocks when every frame is waiting to be compressed or written.
+int crtl_compress_input(crtl_compress_t *compress, const char *buffer, uint32_t data_size) {
+   uint32_t added = 0;
+   pthread_mutex_lock(&compress->mutex);
+   while(added < data_size && !compress->failed) {
+      crtl_frame_t *frame = &compress->frames[compress->seq_fill % compress->frame_count];
+      if(frame->state == CRTL_FRAME_FREE) {
+         frame->state     = CRTL_FRAME_FILLING;
+         frame->size_raw  = 0;
+         frame->filled_ms = crtl_compress_time_ms();
+      } else if(frame->state != CRTL_FRAME_FILLING) {
+         pthread_cond_wait(&compress->space, &compress->mutex);
+         continue;
+      }
+      uint32_t length = compress->frame_raw_max - frame->size_raw;
+      if(length > data_size - added) {
+         length = data_size - added;
+      }
+      memcpy(frame->raw + frame->size_raw, buffer + added, length);
+      frame->size_raw += length;
+      added           += length;
+      if(frame->size_raw == compress->frame_raw_max) {
+         crtl_compress_submit(compress);
+      }
+   }
+   bool failed = compress->failed;
+   pthread_mutex_unlock(&compress->mutex);
+   if(failed) {
+      errno = EIO;
+      return(-1);
+   }
+   return(added);
+}
+
+// Compress and write everything added so far
+int crtl_compress_flush(crtl_compress_t *compress) {
+   pthread_mutex_lock(&compress->mutex);
+   crtl_compress_submit(compress);
+   while(compress->seq_write < compress->seq_fill && !compress->failed) {
+      pthread_cond_wait(&compress->space, &compress->mutex);
+   }
+   bool failed = compress->failed;
+   pthread_mutex_unlock(&compress->mutex);
+   return(failed ? -1 : 0);
+}
+
+// Find the frames already in the file so collapses keep to their boundaries
+static bool crtl_compress_load(crtl_compress_t *compress) {
+   crtl_output_t *output = compress->output;
+   uint64_t offset = 0;
+   while(offset < output->size_cur) {
+      crtl_frame_header_t header;
+      int rc = crtl_compress_header_read(output->fd, offset, &header);
+      if(rc < 0) {
+         return(false);
+      }
+      if(rc == 0 || header.size_frame > output->size_cur - offset) {
+         LOG_ERROR("invalid frame at offset %" PRIu64, offset);
+         return(false);
+      }
+      crtl_compress_size_push(compress, header.size_frame);
+      offset += header.size_frame;
+   }
+   return(true);
+}
+
+crtl_compress_t *crtl_compress_open(crtl_output_t *output, uint32_t thread_count) {
+   crtl_compress_t *compress = calloc(1, sizeof(crtl_compress_t));
+   if(compress == NULL) {
+      return(NULL);
+   }
+   if(thread_count == 0) {
+      thread_count = CRTL_COMPRESS_THREADS;
+   }
+   if(thread_count > CRTL_COMPRESS_THREAD_MAX) {
+      thread_count = CRTL_COMPRESS_THREAD_MAX;
+   }
+   compress->output = output;
+   pthread_mutex_init(&compress->mutex, NULL);
+   pthread_cond_init(&compress->work, NULL);
+   pthread_cond_init(&compress->space, NULL);
+
+   // A padded frame must fit within a single collapse
+   compress->frame_raw_max = CRTL_COMPRESS_FRAME_SIZE;
+   while(compress->frame_raw_max > output->block_size && compressBound(compress->frame_raw_max) + sizeof(crtl_frame_header_t) + output->block_size > output->size_max / 2) {
+      compress->frame_raw_max /= 2;
+   }
+   compress->frame_data_max = compressBound(compress->frame_raw_max) + sizeof(crtl_frame_header_t) + output->block_size;
+   compress->frame_count    = 2 * thread_count + 1;
+   compress->frames         = calloc(compress->frame_count, sizeof(crtl_frame_t));
+   compress->sizes_capacity = output->size_max / output->block_size + 1;
+   compress->sizes          = calloc(compress->sizes_capacity, sizeof(uint32_t));
+   bool ok = (compress->frames != NULL && compress->sizes != NULL);
+   for(uint32_t index = 0; ok && index < compress->frame_count; index++) {
+      compress->frames[index].raw  = malloc(compress->frame_raw_max);
+      compress->frames[index].data = malloc(compress->frame_data_max);
+      ok = (compress->frames[index].raw != NULL && compress->frames[index].data != NULL);
+   }
+   if(!ok || !crtl_compress_load(compress)) {
+      LOG_ERROR("unable to set up compression");
+      crtl_compress_close(compress);
+      return(NULL);
+   }
+   for(uint32_t index = 0; index < thread_count; index++) {
+      if(0 != pthread_create(&compress->threads[index], NULL, crtl_compress_worker, compress)) {
+         LOG_ERROR("unable to create compression thread");
+         crtl_compress_close(compress);
+         return(NULL);
+      }
+      compress->thread_count++;
+   }
+   LOG_DEBUG("compressing frames of %u bytes on %u threads", compress->frame_raw_max, compress->thread_count);
+   return(compress);
+}
+
+void crtl_compress_close(crtl_compress_t *compress) {
+   if(compress == NULL) {
+      return;
+   }
+   if(compress->thread_count > 0) {
+      crtl_compress_flush(compress);
+      pthread_mutex_lock(&compress->mutex);
+      compress->stop = true;
+      pthread_cond_broadcast(&compress->work);
+      pthread_mutex_unlock(&compress->mutex);
+      for(uint32_t index = 0; index < compress->thread_count; index++) {
+         pthread_join(compress->threads[index], NULL);
+      }
+   }
+   for(uint32_t index = 0; compress->frames != NULL && index < compress->frame_count; index++) {
+      free(compress->frames[index].raw);
+      free(compress->frames[index].data);
+   }
+   free(compress->frames);
+   free(compress->sizes);
+   pthread_cond_destroy(&compress->space);
+   pthread_cond_destroy(&compress->work);
+   pthread_mutex_destroy(&compress->mutex);
+   free(compress);
+}
+
+// Write the decompressed frames of a compressed file to fd.  A block that doesn't start a valid frame is skipped, using
+// the block size the frames were padded to by the writer, which may differ from the one seen by this reader.
+int crtl_compress_cat(int fd_file, int fd) {
+   struct stat statbuf;
+   if(0 != crtl_fstat(fd_file, &statbuf)) {
+      return(-1);
+   }
+   uint32_t block_size = statbuf.st_blksize; // Until a frame says otherwise, and for version 1 frames
+   uint64_t size       = statbuf.st_size;
+   uint64_t offset     = 0;
+   char *   compressed = NULL;
+   char *   raw        = NULL;
+   int      rc         = 0;
+   while(offset < size && rc == 0) {
+      crtl_frame_header_t header;
+      rc = crtl_compress_header_read(fd_file, offset, &header);
+      if(rc < 0) {
+         break;
+      }
+      if(rc == 0 || header.size_frame > size - offset) { // Skip to the next block that may start a frame
+         offset += block_size;
+         rc      = 0;
+         continue;
+      }
+      if(header.block_size > 0) {
+         block_size = header.block_size;
+      }
+      rc = -1;
+      char *buffer = realloc(compressed, header.size_compressed);
+      if(buffer == NULL) {
+         break;
+      }
+      compressed = buffer;
+      buffer     = realloc(raw, header.size_raw);
+      if(buffer == NULL) {
+         break;
+      }
+      raw = buffer;
+      if((int)header.size_compressed != crtl_pread(fd_file, compressed, header.size_compressed, offset + crtl_compress_header_size(&header))) {
+         break;
+      }
+      uLongf size_raw = header.size_raw;
+      if(Z_OK != uncompress((Bytef *)raw, &size_raw, (const Bytef *)compressed, header.size_compressed)) {
+         LOG_WARN("corrupt frame at offset %" PRIu64, offset);
+      } else if((int)size_raw != crtl_write(fd, raw, size_raw)) {
+         break;
+      }
+      offset += header.size_frame;
+      rc      = 0;
+   }
+   free(compressed);
+   free(raw);
+   return(rc);
+}
+
+#else
+
+uint64_t crtl_compress_collapse_length(const crtl_compress_t *compress, uint64_t length, uint64_t size_cur) {
+   return(length);
+}
+
+void crtl_compress_collapsed(crtl_compress_t *compress, uint64_t length) {
+}
+
+int crtl_compress_input(crtl_compress_t *compress, const char *buffer, uint32_t data_size) {
+   errno = ENOTSUP;
+   return(-1);
+}
+
+int crtl_compress_flush(crtl_compress_t *compress) {
+   return(0);
+}
+
+crtl_compress_t *crtl_compress_open(crtl_output_t *output, uint32_t thread_count) {
+   LOG_ERROR("compression not supported by this build");
+   return(NULL);
+}
+
+void crtl_compress_close(crtl_compress_t *compress) {
+}
+
+int crtl_compress_cat(int fd_file, int fd) {
+   LOG_ERROR("compression not supported by this build");
+   return(-1);
+}
+
+#endif
+
+// True if the file holds compressed frames
+bool crtl_compress_detect(int fd) {
+   crtl_frame_header_t header;
+   return(1 == crtl_compress_header_read(fd, 0, &header));
+}
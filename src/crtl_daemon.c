@@ -0,0 +1,520 @@
+/**
+ * Copyright 2018 Comcast Cable Communications Management, LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Daemon mode.  A single process services many inputs, each with its own output file and size limits, from one
+// epoll loop.  Inputs are named FIFOs given on the command line or pipes handed over a unix socket by
+// "curtail --attach", which passes its stdin to the daemon and exits.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <linux/limits.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "curtail.h"
+#include "crtl_private.h"
+
+#define CRTL_DAEMON_EVENTS_MAX (64)
+#define CRTL_DAEMON_MSG_MAX    (PATH_MAX + 64)
+
+// What an epoll event is for.  The listening socket has no source.
+typedef enum {
+   CRTL_SOURCE_STREAM = 0,
+   CRTL_SOURCE_CLIENT = 1  // Attach connection that hasn't sent its request yet
+} crtl_source_t;
+
+typedef struct crtl_client_s {
+   crtl_source_t         source;
+   int                   fd;
+   struct crtl_client_s *next;
+} crtl_client_t;
+
+typedef struct crtl_stream_s {
+   crtl_source_t         source;
+   int                   fd_input;
+   bool                  use_splice;
+   char *                name;
+   dev_t                 dev; // Identity of the output file, which only one stream may write
+   ino_t                 ino;
+   crtl_output_t         output;
+   struct crtl_stream_s *next;
+} crtl_stream_t;
+
+typedef struct {
+   int                  fd_epoll;
+   int                  fd_listen;
+   crtl_engine_t        engine;
+   const crtl_output_t *defaults; // Settings of attached streams apart from their limits
+   crtl_stream_t *      streams;
+   uint32_t             stream_count;
+   crtl_client_t *      clients;
+   char                 buffer[64 * 1024]; // Shared by all streams
+} crtl_daemon_t;
+
+static crtl_stream_t *crtl_stream_add(crtl_daemon_t *daemon, int fd_input, const char *name, const char *filename, const crtl_output_t *limits) {
+   crtl_stream_t *stream = calloc(1, sizeof(crtl_stream_t));
+   if(stream == NULL) {
+      LOG_ERROR("unable to allocate stream");
+      return(NULL);
+   }
+   stream->source   = CRTL_SOURCE_STREAM;
+   stream->fd_input = fd_input;
+   stream->name     = strdup(name);
+   crtl_output_settings(&stream->output, limits);
+   crtl_file_limits(&stream->output);
+
+   if(stream->name == NULL || !crtl_file_open(filename, &stream->output)) {
+      LOG_ERROR("unable to open output file <%s>", filename);
+      free(stream->name);
+      free(stream);
+      return(NULL);
+   }
+   struct stat statbuf;
+   if(0 == crtl_fstat(stream->output.fd, &statbuf)) {
+      stream->dev = statbuf.st_dev;
+      stream->ino = statbuf.st_ino;
+   }
+   stream->use_splice = (daemon->engine == CRTL_ENGINE_AUTO || daemon->engine == CRTL_ENGINE_SPLICE) && crtl_fd_is_pipe(fd_input);
+
+   struct epoll_event event = { .events = EPOLLIN, .data.ptr = stream };
+   if(0 > epoll_ctl(daemon->fd_epoll, EPOLL_CTL_ADD, fd_input, &event)) {
+      int errsv = errno;
+      LOG_ERROR("unable to watch input <%s> <%s>", name, strerror(errsv));
+      crtl_storage_close(&stream->output);
+      free(stream->name);
+      free(stream);
+      return(NULL);
+   }
+   stream->next    = daemon->streams;
+   daemon->streams = stream;
+   daemon->stream_count++;
+   LOG_INFO("added stream <%s> to <%s> max %" PRIu64 " low %" PRIu64 " (%u streams)", name, filename, stream->output.size_max, stream->output.size_low, daemon->stream_count);
+   return(stream);
+}
+
+static void crtl_stream_remove(crtl_daemon_t *daemon, crtl_stream_t *stream) {
+   LOG_INFO("removing stream <%s>", stream->name);
+   epoll_ctl(daemon->fd_epoll, EPOLL_CTL_DEL, stream->fd_input, NULL);
+   crtl_close(stream->fd_input);
+   crtl_storage_close(&stream->output);
+
+   crtl_stream_t **link = &daemon->streams;
+   while(*link != NULL && *link != stream) {
+      link = &(*link)->next;
+   }
+   if(*link != NULL) {
+      *link = stream->next;
+   }
+   daemon->stream_count--;
+   free(stream->name);
+   free(stream);
+}
+
+// Whether another stream already writes filename.  Two outputs on one file would each collapse it on their own.
+static bool crtl_daemon_served(crtl_daemon_t *daemon, const char *filename) {
+   struct stat statbuf;
+   if(0 > stat(filename, &statbuf)) { // Not there yet, so nobody writes it
+      return(false);
+   }
+   for(crtl_stream_t *stream = daemon->streams; stream != NULL; stream = stream->next) {
+      if(stream->dev == statbuf.st_dev && stream->ino == statbuf.st_ino) {
+         LOG_ERROR("output file <%s> is already written by stream <%s>", filename, stream->name);
+         return(true);
+      }
+   }
+   return(false);
+}
+
+// Parse "<input fifo>:<output file>[:<size>]" and add the stream
+static bool crtl_stream_add_fifo(crtl_daemon_t *daemon, char *spec, const crtl_output_t *defaults) {
+   crtl_output_t limits = *defaults;
+   char *fifo     = spec;
+   char *filename = strchr(spec, ':');
+   if(filename == NULL || filename == spec || filename[1] == '\0') {
+      LOG_ERROR("invalid stream <%s>, expected <input fifo>:<output file>[:<size>]", spec);
+      return(false);
+   }
+   *filename++ = '\0';
+   int rc = crtl_parse_spec_size(filename, &limits.size_max);
+   if(rc < 0) {
+      return(false);
+   }
+   if(rc > 0) {
+      limits.size_low = 0;
+   }
+
+   if(crtl_daemon_served(daemon, filename)) {
+      return(false);
+   }
+
+   // Opened for writing too so that the FIFO never reports end of input when a writer goes away
+   int fd_input = crtl_open(fifo, O_RDWR | O_NONBLOCK | O_CLOEXEC, 0);
+   if(fd_input < 0) {
+      int errsv = errno;
+      LOG_ERROR("unable to open input <%s> <%s>", fifo, strerror(errsv));
+      return(false);
+   }
+   if(!crtl_fd_is_pipe(fd_input)) {
+      LOG_ERROR("input <%s> is not a FIFO", fifo);
+      crtl_close(fd_input);
+      return(false);
+   }
+   if(NULL == crtl_stream_add(daemon, fd_input, fifo, filename, &limits)) {
+      crtl_close(fd_input);
+      return(false);
+   }
+   return(true);
+}
+
+// Accept an attach connection.  Its request is read once it arrives so that a slow client can't hold up the streams.
+static void crtl_daemon_accept(crtl_daemon_t *daemon) {
+   int fd_client = accept4(daemon->fd_listen, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+   if(fd_client < 0) {
+      int errsv = errno;
+      if(errsv != EAGAIN) {
+         LOG_ERROR("accept failed <%s>", strerror(errsv));
+      }
+      return;
+   }
+   crtl_client_t *client = calloc(1, sizeof(crtl_client_t));
+   if(client == NULL) {
+      LOG_ERROR("unable to allocate client");
+      crtl_close(fd_client);
+      return;
+   }
+   client->source = CRTL_SOURCE_CLIENT;
+   client->fd     = fd_client;
+   struct epoll_event event = { .events = EPOLLIN, .data.ptr = client };
+   if(0 > epoll_ctl(daemon->fd_epoll, EPOLL_CTL_ADD, fd_client, &event)) {
+      int errsv = errno;
+      LOG_ERROR("unable to watch client <%s>", strerror(errsv));
+      crtl_close(fd_client);
+      free(client);
+      return;
+   }
+   client->next    = daemon->clients;
+   daemon->clients = client;
+}
+
+static void crtl_client_remove(crtl_daemon_t *daemon, crtl_client_t *client) {
+   epoll_ctl(daemon->fd_epoll, EPOLL_CTL_DEL, client->fd, NULL);
+   crtl_close(client->fd);
+   crtl_client_t **link = &daemon->clients;
+   while(*link != NULL && *link != client) {
+      link = &(*link)->next;
+   }
+   if(*link != NULL) {
+      *link = client->next;
+   }
+   free(client);
+}
+
+// Whether the attaching process may write filename itself.  The daemon may have more privileges than the process
+// asking it to create and collapse the file, so anyone other than root or the daemon's own user must own the file,
+// or the directory it is to be created in, and have write permission on it.
+static bool crtl_daemon_permitted(int fd_client, const char *filename) {
+   struct ucred cred;
+   socklen_t    length = sizeof(cred);
+   if(0 > getsockopt(fd_client, SOL_SOCKET, SO_PEERCRED, &cred, &length)) {
+      int errsv = errno;
+      LOG_ERROR("unable to get attaching process credentials <%s>", strerror(errsv));
+      return(false);
+   }
+   if(cred.uid == 0 || cred.uid == geteuid()) {
+      return(true);
+   }
+   struct stat statbuf;
+   if(0 == stat(filename, &statbuf)) {
+      if(statbuf.st_uid == cred.uid && (statbuf.st_mode & S_IWUSR)) {
+         return(true);
+      }
+   } else {
+      char directory[PATH_MAX];
+      snprintf(directory, sizeof(directory), "%s", filename);
+      if(0 == stat(dirname(directory), &statbuf) && statbuf.st_uid == cred.uid && (statbuf.st_mode & (S_IWUSR | S_IXUSR)) == (S_IWUSR | S_IXUSR)) {
+         return(true);
+      }
+   }
+   LOG_ERROR("process %d of user %u may not write <%s>", (int)cred.pid, (unsigned)cred.uid, filename);
+   return(false);
+}
+
+// Receive "<size max> <size low> <output file>" with the input fd attached and reply with 0 or an errno.  Returns
+// false while the request hasn't arrived.
+static bool crtl_daemon_request(crtl_daemon_t *daemon, crtl_client_t *client) {
+   char msg[CRTL_DAEMON_MSG_MAX];
+   char control[CMSG_SPACE(sizeof(int))];
+   struct iovec  iov = { .iov_base = msg, .iov_len = sizeof(msg) - 1 };
+   struct msghdr hdr = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+
+   int result   = 0;
+   int fd_input = -1;
+   ssize_t rc;
+   do {
+      rc = recvmsg(client->fd, &hdr, MSG_CMSG_CLOEXEC | MSG_DONTWAIT);
+   } while(rc < 0 && errno == EINTR);
+   if(rc < 0 && errno == EAGAIN) {
+      return(false);
+   }
+   struct cmsghdr *cmsg = (rc > 0) ? CMSG_FIRSTHDR(&hdr) : NULL;
+   if(cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+      memcpy(&fd_input, CMSG_DATA(cmsg), sizeof(int));
+   }
+
+   uint64_t size_max = 0;
+   uint64_t size_low = 0;
+   int      offset   = 0;
+   if(rc > 0) {
+      msg[rc] = '\0';
+   }
+   if(rc <= 0 || fd_input < 0 || 2 != sscanf(msg, "%" SCNu64 " %" SCNu64 " %n", &size_max, &size_low, &offset) || offset == 0 || msg[offset] == '\0') {
+      LOG_ERROR("invalid attach request");
+      result = EINVAL;
+   } else if(!crtl_daemon_permitted(client->fd, &msg[offset])) {
+      result = EACCES;
+   } else if(crtl_daemon_served(daemon, &msg[offset])) {
+      result = EBUSY;
+   } else {
+      crtl_output_t limits = *daemon->defaults;
+      limits.size_max = size_max;
+      limits.size_low = size_low;
+      char name[32];
+      snprintf(name, sizeof(name), "fd:%d", fd_input);
+      fcntl(fd_input, F_SETFL, fcntl(fd_input, F_GETFL) | O_NONBLOCK);
+      if(NULL == crtl_stream_add(daemon, fd_input, name, &msg[offset], &limits)) {
+         result = EIO;
+      }
+   }
+   if(result != 0 && fd_input >= 0) {
+      crtl_close(fd_input);
+   }
+   // The reply is a few bytes on an otherwise empty socket, a client that doesn't read it only misses it
+   send(client->fd, &result, sizeof(result), MSG_DONTWAIT | MSG_NOSIGNAL);
+   return(true);
+}
+
+static bool crtl_daemon_listen(crtl_daemon_t *daemon, const char *socket_path) {
+   struct sockaddr_un addr = { .sun_family = AF_UNIX };
+   if(strlen(socket_path) >= sizeof(addr.sun_path)) {
+      LOG_ERROR("socket path too long <%s>", socket_path);
+      return(false);
+   }
+   strcpy(addr.sun_path, socket_path);
+
+   daemon->fd_listen = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+   if(daemon->fd_listen < 0) {
+      int errsv = errno;
+      LOG_ERROR("unable to create socket <%s>", strerror(errsv));
+      return(false);
+   }
+   unlink(socket_path);
+   // Only the daemon's own user may connect, the socket is created that way so there is no window before a chmod
+   mode_t mask = umask(0177);
+   int    rc   = bind(daemon->fd_listen, (struct sockaddr *)&addr, sizeof(addr));
+   umask(mask);
+   if(0 > rc || 0 > listen(daemon->fd_listen, 16)) {
+      int errsv = errno;
+      LOG_ERROR("unable to listen on <%s> <%s>", socket_path, strerror(errsv));
+      return(false);
+   }
+   struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };
+   if(0 > epoll_ctl(daemon->fd_epoll, EPOLL_CTL_ADD, daemon->fd_listen, &event)) {
+      int errsv = errno;
+      LOG_ERROR("unable to watch socket <%s>", strerror(errsv));
+      return(false);
+   }
+   LOG_INFO("listening on <%s>", socket_path);
+   return(true);
+}
+
+// Move whatever is available on the stream's input to its output file.  Returns false if the stream is done.
+static bool crtl_stream_service(crtl_daemon_t *daemon, crtl_stream_t *stream) {
+   if(stream->use_splice) {
+      int rc = crtl_process_splice(stream->fd_input, &stream->output);
+      if(rc < 0 && errno == EINVAL) {
+         LOG_INFO("splice not supported by output of <%s>, using copy", stream->name);
+         stream->use_splice = false;
+         return(true);
+      }
+      return(rc > 0);
+   }
+   uint32_t size = sizeof(daemon->buffer);
+   if(size > stream->output.size_max / 2) {
+      size = stream->output.size_max / 2;
+   }
+   int rc = crtl_read(stream->fd_input, daemon->buffer, size);
+   if(rc < 0 && errno == EAGAIN) {
+      return(true);
+   }
+   if(rc <= 0) {
+      return(false);
+   }
+   return(0 <= crtl_process_input(&stream->output, daemon->buffer, rc));
+}
+
+// Service FIFOs listed in specs and pipes attached through socket_path until quit is set.  Either may be empty.
+int crtl_daemon_run(const char *socket_path, char **specs, uint32_t spec_count, const crtl_output_t *defaults, crtl_engine_t engine, const bool *quit) {
+   crtl_daemon_t *daemon = calloc(1, sizeof(crtl_daemon_t));
+   if(daemon == NULL) {
+      LOG_ERROR("unable to allocate daemon");
+      return(-1);
+   }
+   daemon->fd_listen = -1;
+   daemon->engine    = engine;
+   daemon->defaults  = defaults;
+   daemon->fd_epoll  = epoll_create1(EPOLL_CLOEXEC);
+   if(daemon->fd_epoll < 0) {
+      int errsv = errno;
+      LOG_ERROR("unable to create epoll <%s>", strerror(errsv));
+      free(daemon);
+      return(-1);
+   }
+
+   int rc = 0;
+   if(socket_path != NULL && !crtl_daemon_listen(daemon, socket_path)) {
+      rc = -1;
+   }
+   for(uint32_t index = 0; index < spec_count && rc == 0; index++) {
+      if(!crtl_stream_add_fifo(daemon, specs[index], defaults)) {
+         rc = -1;
+      }
+   }
+
+   struct epoll_event events[CRTL_DAEMON_EVENTS_MAX];
+   while(rc == 0 && !*quit) {
+      int count = epoll_wait(daemon->fd_epoll, events, CRTL_DAEMON_EVENTS_MAX, -1);
+      if(count < 0) {
+         int errsv = errno;
+         if(errsv != EINTR) {
+            LOG_ERROR("epoll_wait failed <%s>", strerror(errsv));
+            rc = -1;
+         }
+         continue;
+      }
+      for(int index = 0; index < count; index++) {
+         crtl_source_t *source = events[index].data.ptr;
+         if(events[index].events == 0) { // Removed by an earlier event
+            continue;
+         }
+         if(source == NULL) {
+            crtl_daemon_accept(daemon);
+         } else if(*source == CRTL_SOURCE_CLIENT) {
+            crtl_client_t *client = events[index].data.ptr;
+            if(crtl_daemon_request(daemon, client)) {
+               crtl_client_remove(daemon, client);
+            }
+         } else {
+            crtl_stream_t *stream = events[index].data.ptr;
+            if(!crtl_stream_service(daemon, stream)) {
+               crtl_stream_remove(daemon, stream);
+               // Drop any later events for the removed stream
+               for(int later = index + 1; later < count; later++) {
+                  if(events[later].data.ptr == stream) {
+                     events[later].events = 0;
+                  }
+               }
+            }
+         }
+      }
+   }
+
+   while(daemon->streams != NULL) {
+      crtl_stream_remove(daemon, daemon->streams);
+   }
+   while(daemon->clients != NULL) {
+      crtl_client_remove(daemon, daemon->clients);
+   }
+   if(daemon->fd_listen >= 0) {
+      crtl_close(daemon->fd_listen);
+      if(socket_path != NULL) {
+         unlink(socket_path);
+      }
+   }
+   crtl_close(daemon->fd_epoll);
+   free(daemon);
+   return(rc);
+}
+
+// Hand stdin over to a daemon listening on socket_path, which will write it to filename
+int crtl_daemon_attach(const char *socket_path, const char *filename, const crtl_output_t *limits) {
+   struct sockaddr_un addr = { .sun_family = AF_UNIX };
+   if(strlen(socket_path) >= sizeof(addr.sun_path)) {
+      LOG_ERROR("socket path too long <%s>", socket_path);
+      return(-1);
+   }
+   strcpy(addr.sun_path, socket_path);
+
+   // The daemon may run in another directory
+   char path[PATH_MAX];
+   if(filename[0] != '/') {
+      char cwd[PATH_MAX];
+      if(NULL == getcwd(cwd, sizeof(cwd)) || (int)sizeof(path) <= snprintf(path, sizeof(path), "%s/%s", cwd, filename)) {
+         LOG_ERROR("unable to resolve output file <%s>", filename);
+         return(-1);
+      }
+   } else {
+      snprintf(path, sizeof(path), "%s", filename);
+   }
+
+   int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+   if(fd < 0 || 0 > connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+      int errsv = errno;
+      LOG_ERROR("unable to connect to <%s> <%s>", socket_path, strerror(errsv));
+      if(fd >= 0) {
+         crtl_close(fd);
+      }
+      return(-1);
+   }
+
+   char msg[CRTL_DAEMON_MSG_MAX];
+   int length = snprintf(msg, sizeof(msg), "%" PRIu64 " %" PRIu64 " %s", limits->size_max, limits->size_low, path);
+   char control[CMSG_SPACE(sizeof(int))];
+   memset(control, 0, sizeof(control));
+   struct iovec  iov = { .iov_base = msg, .iov_len = length };
+   struct msghdr hdr = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+   struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+   cmsg->cmsg_level = SOL_SOCKET;
+   cmsg->cmsg_type  = SCM_RIGHTS;
+   cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+   int fd_input = STDIN_FILENO;
+   memcpy(CMSG_DATA(cmsg), &fd_input, sizeof(int));
+
+   int result = EIO;
+   if(0 > sendmsg(fd, &hdr, 0) || (int)sizeof(result) != crtl_read(fd, &result, sizeof(result))) {
+      int errsv = errno;
+      LOG_ERROR("attach to <%s> failed <%s>", socket_path, strerror(errsv));
+      crtl_close(fd);
+      return(-1);
+   }
+   crtl_close(fd);
+   if(result != 0) {
+      LOG_ERROR("daemon rejected <%s> <%s>", path, strerror(result));
+      return(-1);
+   }
+   LOG_INFO("attached <%s> to daemon <%s>", path, socket_path);
+   return(0);
+}
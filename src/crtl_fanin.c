@@ -0,0 +1,281 @@
+/**
+ * Copyright 2018 Comcast Cable Communications Management, LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Fan-in.  Several inputs are merged into one output file from a single epoll loop.  Each input has its own buffer
+// that holds its partial last line, so only whole lines reach the output and lines from different inputs never
+// interleave.  Lines can be tagged with the name of their input.  Inputs are named FIFOs, opened for writing too so
+// that they never report end of input (like the daemon), or inherited descriptors given as fd:<number>, which end at
+// end of input.  The loop runs until every input has ended or quit is set.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include "curtail.h"
+#include "crtl_private.h"
+
+#define CRTL_FANIN_EVENTS_MAX (64)
+#define CRTL_FANIN_BUFFER     (64 * 1024)
+#define CRTL_FANIN_TAG_MAX    (64)
+
+typedef struct {
+   int          fd;
+   const char * name;
+   bool         open;
+   bool         line_start;              // The next byte read starts a line
+   char         tag[CRTL_FANIN_TAG_MAX]; // "[name] "
+   uint32_t     tag_size;
+   char *       carry;                   // Input not yet written, a partial line
+   uint32_t     carry_size;
+} crtl_source_t;
+
+typedef struct {
+   crtl_output_t *output;
+   crtl_source_t *sources;
+   uint32_t       source_count;
+   uint32_t       open_count;
+   uint32_t       capacity;          // Largest write to the output
+   bool           tag;
+   int            fd_epoll;
+   char           buffer[CRTL_FANIN_BUFFER];
+} crtl_fanin_t;
+
+static int crtl_fanin_flush(crtl_fanin_t *fanin, uint32_t *used) {
+   int rc = (*used > 0) ? crtl_process_input(fanin->output, fanin->buffer, *used) : 0;
+   *used = 0;
+   return(rc);
+}
+
+// Write whole lines of a source, with its tag in front of each line when tagging
+static int crtl_fanin_write(crtl_fanin_t *fanin, crtl_source_t *source, const char *data, uint32_t size) {
+   if(!fanin->tag) {
+      return(crtl_process_input(fanin->output, data, size));
+   }
+   const char *end  = data + size;
+   uint32_t    used = 0;
+   int         rc   = 0;
+   while(data < end && rc >= 0) {
+      if(source->line_start) {
+         if(used + source->tag_size > fanin->capacity) {
+            rc = crtl_fanin_flush(fanin, &used);
+            continue;
+         }
+         memcpy(fanin->buffer + used, source->tag, source->tag_size);
+         used += source->tag_size;
+         source->line_start = false;
+      }
+      const char *newline = crtl_scan_newline(data, end);
+      uint32_t    length  = ((newline != NULL) ? newline + 1 : end) - data;
+      if(length > fanin->capacity - used) {
+         length = fanin->capacity - used;
+      } else if(newline != NULL) {
+         source->line_start = true;
+      }
+      memcpy(fanin->buffer + used, data, length);
+      used += length;
+      data += length;
+      if(used == fanin->capacity) {
+         rc = crtl_fanin_flush(fanin, &used);
+      }
+   }
+   if(rc >= 0) {
+      rc = crtl_fanin_flush(fanin, &used);
+   }
+   return(rc);
+}
+
+static void crtl_fanin_close(crtl_fanin_t *fanin, crtl_source_t *source) {
+   epoll_ctl(fanin->fd_epoll, EPOLL_CTL_DEL, source->fd, NULL);
+   if(source->fd != STDIN_FILENO) {
+      crtl_close(source->fd);
+   }
+   source->open = false;
+   fanin->open_count--;
+   LOG_INFO("input <%s> ended", source->name);
+}
+
+// Read once from a source and write out its complete lines.  At end of input, or when reading it fails, the partial
+// last line is terminated and the source is closed.  Returns -1 only if the output failed.
+static int crtl_fanin_service(crtl_fanin_t *fanin, crtl_source_t *source) {
+   int rc = crtl_read(source->fd, source->carry + source->carry_size, fanin->capacity - source->carry_size);
+   if(rc < 0 && errno == EAGAIN) {
+      return(0);
+   }
+   if(rc <= 0) {
+      if(rc < 0) {
+         int errsv = errno;
+         LOG_ERROR("error reading input <%s> <%s>", source->name, strerror(errsv));
+      }
+      int written = 0;
+      if(source->carry_size > 0) {
+         source->carry[source->carry_size++] = '\n'; // The buffer has a spare byte
+         written = crtl_fanin_write(fanin, source, source->carry, source->carry_size);
+         source->carry_size = 0;
+      }
+      crtl_fanin_close(fanin, source); // The other inputs carry on
+      return(written < 0 ? -1 : 0);
+   }
+   source->carry_size += rc;
+   const char *newline  = memrchr(source->carry, '\n', source->carry_size);
+   uint32_t    complete = (newline != NULL) ? newline - source->carry + 1 : 0;
+   if(complete == 0 && source->carry_size == fanin->capacity) { // Split a line longer than the buffer
+      complete = source->carry_size;
+   }
+   if(complete == 0) {
+      return(0);
+   }
+   rc = crtl_fanin_write(fanin, source, source->carry, complete);
+   source->carry_size -= complete;
+   memmove(source->carry, source->carry + complete, source->carry_size);
+   return(rc < 0 ? -1 : 0);
+}
+
+// Open "fd:<number>" or a FIFO.  A regular file can't be watched, so it is read to the end right away.
+static bool crtl_fanin_open(crtl_fanin_t *fanin, crtl_source_t *source, const char *spec, const char *name) {
+   char *end = NULL;
+   if(0 == strncmp(spec, "fd:", 3)) {
+      long fd = strtol(spec + 3, &end, 10);
+      if(end == spec + 3 || *end != '\0' || fd < 0 || fd > INT32_MAX || 0 > fcntl(fd, F_GETFD)) {
+         LOG_ERROR("invalid input <%s>", spec);
+         return(false);
+      }
+      source->fd = fd;
+   } else {
+      source->fd = crtl_open(spec, O_RDWR | O_NONBLOCK | O_CLOEXEC, 0);
+      if(source->fd < 0) {
+         int errsv = errno;
+         LOG_ERROR("unable to open input <%s> <%s>", spec, strerror(errsv));
+         return(false);
+      }
+      if(!crtl_fd_is_pipe(source->fd)) {
+         LOG_ERROR("input <%s> is not a FIFO", spec);
+         crtl_close(source->fd);
+         return(false);
+      }
+   }
+   snprintf(source->tag, sizeof(source->tag), "[%.*s] ", CRTL_FANIN_TAG_MAX - 4, name);
+   source->name       = name;
+   source->tag_size   = strlen(source->tag);
+   source->line_start = true;
+   source->carry      = malloc(fanin->capacity + 1);
+   if(source->carry == NULL) {
+      LOG_ERROR("unable to allocate input buffer");
+      if(source->fd != STDIN_FILENO) {
+         crtl_close(source->fd);
+      }
+      return(false);
+   }
+   source->open = true;
+   fanin->open_count++;
+   struct epoll_event event = { .events = EPOLLIN, .data.ptr = source };
+   if(0 == epoll_ctl(fanin->fd_epoll, EPOLL_CTL_ADD, source->fd, &event)) {
+      LOG_INFO("reading input <%s>", name);
+      return(true);
+   }
+   int errsv = errno;
+   if(errsv == EPERM) {
+      LOG_INFO("reading file <%s>", name);
+      int rc = 0;
+      while(source->open && rc == 0) {
+         rc = crtl_fanin_service(fanin, source);
+      }
+      return(rc == 0);
+   }
+   LOG_ERROR("unable to watch input <%s> <%s>", name, strerror(errsv));
+   crtl_fanin_close(fanin, source);
+   return(false);
+}
+
+// Merge stdin (when use_stdin is set) and the inputs in specs into the output until they all end or quit is set.
+// Lines are tagged with their input name when tag is set.
+int crtl_fanin_run(crtl_output_t *output, bool use_stdin, char **specs, uint32_t spec_count, bool tag, const bool *quit) {
+   crtl_scan_init();
+   crtl_fanin_t *fanin = calloc(1, sizeof(crtl_fanin_t));
+   if(fanin == NULL) {
+      LOG_ERROR("unable to allocate fan-in");
+      return(-1);
+   }
+   fanin->output   = output;
+   fanin->tag      = tag;
+   fanin->capacity = CRTL_FANIN_BUFFER;
+   if(fanin->capacity > output->size_max / 2) { // Like the ring writer, never write more than half the file at once
+      fanin->capacity = output->size_max / 2;
+   }
+   fanin->sources  = calloc(spec_count + 1, sizeof(crtl_source_t));
+   fanin->fd_epoll = epoll_create1(EPOLL_CLOEXEC);
+   if(fanin->sources == NULL || fanin->fd_epoll < 0) {
+      LOG_ERROR("unable to set up fan-in");
+      if(fanin->fd_epoll >= 0) {
+         crtl_close(fanin->fd_epoll);
+      }
+      free(fanin->sources);
+      free(fanin);
+      return(-1);
+   }
+
+   int rc = 0;
+   if(use_stdin && !crtl_fanin_open(fanin, &fanin->sources[fanin->source_count++], "fd:0", "stdin")) {
+      rc = -1;
+   }
+   for(uint32_t index = 0; index < spec_count && rc == 0; index++) {
+      if(!crtl_fanin_open(fanin, &fanin->sources[fanin->source_count++], specs[index], specs[index])) {
+         rc = -1;
+      }
+   }
+
+   struct epoll_event events[CRTL_FANIN_EVENTS_MAX];
+   while(rc == 0 && fanin->open_count > 0 && !*quit) {
+      int count = epoll_wait(fanin->fd_epoll, events, CRTL_FANIN_EVENTS_MAX, -1);
+      if(count < 0) {
+         int errsv = errno;
+         if(errsv != EINTR) {
+            LOG_ERROR("epoll_wait failed <%s>", strerror(errsv));
+            rc = -1;
+         }
+         continue;
+      }
+      for(int index = 0; index < count && rc == 0; index++) {
+         crtl_source_t *source = events[index].data.ptr;
+         if(source->open) {
+            rc = crtl_fanin_service(fanin, source);
+         }
+      }
+   }
+
+   // Write out partial lines that are left
+   for(uint32_t index = 0; index < fanin->source_count; index++) {
+      crtl_source_t *source = &fanin->sources[index];
+      if(source->carry_size > 0 && rc == 0) {
+         source->carry[source->carry_size++] = '\n';
+         rc = (0 > crtl_fanin_write(fanin, source, source->carry, source->carry_size)) ? -1 : 0;
+      }
+      if(source->open) {
+         crtl_fanin_close(fanin, source);
+      }
+      free(source->carry);
+   }
+   crtl_close(fanin->fd_epoll);
+   free(fanin->sources);
+   free(fanin);
+   return(rc);
+}
@@ -23,12 +23,25 @@
 #include <stdbool.h>
 #include <errno.h>
 #include <unistd.h>
+#include <poll.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
 #include <fcntl.h>
 #include "curtail.h"
 #include "crtl_private.h"
 
+// Count a failed call, or a write of fewer than count bytes
+static void crtl_io_stats(ssize_t rc, size_t count) {
+   if(rc < 0) {
+      if(errno != EAGAIN) {
+         crtl_stats_add(CRTL_STAT_ERRORS, 1);
+      }
+   } else if((size_t)rc < count) {
+      crtl_stats_add(CRTL_STAT_SHORT_WRITES, 1);
+   }
+}
+
 // Perform open while ignoring signals
 int crtl_open(const char *pathname, int flags, mode_t mode) {
    int rc;
@@ -59,13 +72,15 @@ int crtl_fstat(int fd, struct stat *buf) {
    return(rc);
 }
 
-// Perform read while ignoring signals
+// Perform read while ignoring signals.  Only used on pipes, sockets and event descriptors, which block until there is
+// something to read, so the time isn't counted as read latency.
 int crtl_read(int fd, void *buf, size_t count) {
    int rc;
    do {
       errno = 0;
       rc    = read(fd, buf, count);
    } while(rc < 0 && errno == EINTR);
+   crtl_io_stats(rc, 0);
    return(rc);
 }
 
@@ -74,8 +89,36 @@ int crtl_write(int fd, const void *buf, size_t count) {
    int rc;
    do {
       errno = 0;
-      rc    = write(fd, buf, count);
+      uint64_t start = crtl_stats_clock();
+      rc = write(fd, buf, count);
+      crtl_stats_time(CRTL_STAT_OP_WRITE, start);
    } while(rc < 0 && errno == EINTR);
+   crtl_io_stats(rc, count);
+   return(rc);
+}
+
+// Perform pread while ignoring signals
+int crtl_pread(int fd, void *buf, size_t count, off_t offset) {
+   int rc;
+   do {
+      errno = 0;
+      uint64_t start = crtl_stats_clock();
+      rc = pread(fd, buf, count, offset);
+      crtl_stats_time(CRTL_STAT_OP_READ, start);
+   } while(rc < 0 && errno == EINTR);
+   return(rc);
+}
+
+// Perform pwrite while ignoring signals
+int crtl_pwrite(int fd, const void *buf, size_t count, off_t offset) {
+   int rc;
+   do {
+      errno = 0;
+      uint64_t start = crtl_stats_clock();
+      rc = pwrite(fd, buf, count, offset);
+      crtl_stats_time(CRTL_STAT_OP_WRITE, start);
+   } while(rc < 0 && errno == EINTR);
+   crtl_io_stats(rc, count);
    return(rc);
 }
 
@@ -84,8 +127,11 @@ int crtl_fallocate(int fd, int mode, off_t offset, off_t len) {
    int rc;
    do {
       errno = 0;
-      rc    = fallocate(fd, mode, offset, len);
+      uint64_t start = crtl_stats_clock();
+      rc = fallocate(fd, mode, offset, len);
+      crtl_stats_time(CRTL_STAT_OP_FALLOCATE, start);
    } while(rc < 0 && errno == EINTR);
+   crtl_io_stats(rc, 0);
    return(rc);
 }
 
@@ -98,3 +144,49 @@ off_t crtl_seek(int fd, off_t offset, int whence) {
    } while(rc < 0 && errno == EINTR);
    return(rc);
 }
+
+// Perform splice while ignoring signals
+int crtl_splice(int fd_in, int fd_out, loff_t *off_out, size_t len, unsigned int flags) {
+   ssize_t rc;
+   do {
+      errno = 0;
+      uint64_t start = crtl_stats_clock();
+      rc = splice(fd_in, NULL, fd_out, off_out, len, flags);
+      crtl_stats_time(CRTL_STAT_OP_WRITE, start);
+   } while(rc < 0 && errno == EINTR);
+   crtl_io_stats(rc, 0);
+   return(rc);
+}
+
+// Duplicate data from one pipe into another without consuming it, while ignoring signals
+int crtl_tee(int fd_in, int fd_out, size_t len) {
+   ssize_t rc;
+   do {
+      errno = 0;
+      rc    = tee(fd_in, fd_out, len, 0);
+   } while(rc < 0 && errno == EINTR);
+   if(rc < 0) {
+      crtl_stats_add(CRTL_STAT_ERRORS, 1);
+   }
+   return(rc);
+}
+
+// Perform ioctl while ignoring signals
+int crtl_ioctl(int fd, unsigned long request, void *arg) {
+   int rc;
+   do {
+      errno = 0;
+      rc    = ioctl(fd, request, arg);
+   } while(rc < 0 && errno == EINTR);
+   return(rc);
+}
+
+// Perform poll while ignoring signals
+int crtl_poll(struct pollfd *fds, nfds_t nfds, int timeout) {
+   int rc;
+   do {
+      errno = 0;
+      rc    = poll(fds, nfds, timeout);
+   } while(rc < 0 && errno == EINTR);
+   return(rc);
+}
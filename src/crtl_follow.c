@@ -0,0 +1,337 @@
+/**
+ * Copyright 2018 Comcast Cable Communications Management, LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Following a collapse storage file.  A collapse moves the data that is left to the start of the file, so file offsets
+// don't identify data for long.  Instead the writer, when asked to, publishes the base, the number of bytes collapsed
+// over the life of the file, which makes base + file offset a logical offset that never changes.  The base is kept in the
+// user.curtail.offset extended attribute, or a <file>.offset sidecar on filesystems without extended attributes, as
+// "<base> <pending>", and is carried over when the file is opened again.  Before a collapse the writer publishes its
+// length as pending, and the new base with no pending length afterwards.  A follower reads the value before and after
+// each read of the file and only keeps the data when both are the same and nothing was pending, like a seqlock.  It
+// sleeps in inotify between changes and opens the file again when it is replaced.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <sys/inotify.h>
+#include "curtail.h"
+#include "crtl_private.h"
+
+#define CRTL_OFFSET_XATTR  "user.curtail.offset"
+#define CRTL_OFFSET_SUFFIX ".offset"
+#define CRTL_OFFSET_MAX    (64)
+#define CRTL_FOLLOW_BUFFER (64 * 1024)
+#define CRTL_FOLLOW_EVENTS (4096)
+#define CRTL_FOLLOW_RETRY  (100) // Milliseconds between attempts to open a missing file
+
+struct crtl_offsets_s {
+   uint64_t base;       // Base when the file was opened
+   int      fd_sidecar; // Holds the value when the filesystem has no user extended attributes (-1 if not used)
+};
+
+typedef struct {
+   const char *filename;
+   int         fd_file;
+   int         fd_sidecar;
+   int         fd_inotify;
+   uint64_t    position;   // Logical offset of the next byte to write
+   char        buffer[CRTL_FOLLOW_BUFFER];
+} crtl_follow_t;
+
+// Parse "<base> <pending>".  A missing value means nothing was ever collapsed.
+static bool crtl_offsets_parse(const char *value, int length, uint64_t *base, uint64_t *pending) {
+   char text[CRTL_OFFSET_MAX];
+   if(length <= 0) {
+      *base    = 0;
+      *pending = 0;
+      return(true);
+   }
+   if(length >= (int)sizeof(text)) {
+      return(false);
+   }
+   memcpy(text, value, length);
+   text[length] = '\0';
+   return(2 == sscanf(text, "%" SCNu64 " %" SCNu64, base, pending));
+}
+
+// Read the published value from the sidecar when there is one, otherwise from the attribute of the file
+static bool crtl_offsets_read(int fd_file, int fd_sidecar, uint64_t *base, uint64_t *pending) {
+   char value[CRTL_OFFSET_MAX];
+   int  length;
+   if(fd_sidecar >= 0) {
+      length = crtl_pread(fd_sidecar, value, sizeof(value), 0);
+   } else {
+      length = fgetxattr(fd_file, CRTL_OFFSET_XATTR, value, sizeof(value));
+      if(length < 0 && (errno == ENODATA || errno == ENOTSUP)) {
+         length = 0;
+      }
+   }
+   if(length < 0) {
+      int errsv = errno;
+      LOG_ERROR("unable to read %s <%s>", CRTL_OFFSET_XATTR, strerror(errsv));
+      return(false);
+   }
+   if(!crtl_offsets_parse(value, length, base, pending)) {
+      LOG_ERROR("invalid %s value", CRTL_OFFSET_XATTR);
+      return(false);
+   }
+   return(true);
+}
+
+// Publish the base of a collapse storage file and the length of a collapse about to start (0 for none).  The sidecar
+// holds fixed width values so that it can be overwritten in place.
+int crtl_offsets_publish(crtl_offsets_t *offsets, int fd, uint64_t collapsed, uint64_t pending) {
+   char value[CRTL_OFFSET_MAX];
+   if(offsets->fd_sidecar >= 0) {
+      int length = snprintf(value, sizeof(value), "%020" PRIu64 " %020" PRIu64 "\n", offsets->base + collapsed, pending);
+      if(length != crtl_pwrite(offsets->fd_sidecar, value, length, 0)) {
+         int errsv = errno;
+         LOG_ERROR("unable to write offset sidecar <%s>", strerror(errsv));
+         return(-1);
+      }
+      return(0);
+   }
+   int length = snprintf(value, sizeof(value), "%" PRIu64 " %" PRIu64, offsets->base + collapsed, pending);
+   if(0 != fsetxattr(fd, CRTL_OFFSET_XATTR, value, length, 0)) {
+      int errsv = errno;
+      LOG_ERROR("unable to set %s <%s>", CRTL_OFFSET_XATTR, strerror(errsv));
+      return(-1);
+   }
+   return(0);
+}
+
+// Start publishing the base of a collapse storage file, continuing from the value left by the last writer
+crtl_offsets_t *crtl_offsets_open(const char *filename, int fd) {
+   crtl_offsets_t *offsets = calloc(1, sizeof(crtl_offsets_t));
+   if(offsets == NULL) {
+      return(NULL);
+   }
+   offsets->fd_sidecar = -1;
+   uint64_t pending = 0;
+   char     value[CRTL_OFFSET_MAX];
+   int      length = fgetxattr(fd, CRTL_OFFSET_XATTR, value, sizeof(value));
+   if(length < 0 && errno == ENODATA) {
+      length = 0;
+   }
+   if(length < 0) {
+      // Fall back to a sidecar file when the filesystem has no user extended attributes
+      int errsv = errno;
+      if(errsv != ENOTSUP && errsv != EPERM) {
+         LOG_ERROR("unable to read %s <%s>", CRTL_OFFSET_XATTR, strerror(errsv));
+         crtl_offsets_close(offsets);
+         return(NULL);
+      }
+      char path[PATH_MAX];
+      snprintf(path, sizeof(path), "%s" CRTL_OFFSET_SUFFIX, filename);
+      offsets->fd_sidecar = crtl_open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+      if(offsets->fd_sidecar < 0) {
+         errsv = errno;
+         LOG_ERROR("unable to open <%s> <%s>", path, strerror(errsv));
+         crtl_offsets_close(offsets);
+         return(NULL);
+      }
+      length = crtl_pread(offsets->fd_sidecar, value, sizeof(value), 0);
+      LOG_INFO("publishing offsets in <%s>", path);
+   }
+   if(!crtl_offsets_parse(value, length, &offsets->base, &pending)) {
+      LOG_WARN("invalid %s value, starting from 0", CRTL_OFFSET_XATTR);
+      offsets->base = 0;
+   } else if(pending != 0) { // Whether that collapse happened is not known
+      LOG_WARN("last writer stopped during a collapse of %" PRIu64 " bytes, followers may see data again", pending);
+   }
+   if(0 > crtl_offsets_publish(offsets, fd, 0, 0)) {
+      crtl_offsets_close(offsets);
+      return(NULL);
+   }
+   return(offsets);
+}
+
+void crtl_offsets_close(crtl_offsets_t *offsets) {
+   if(offsets == NULL) {
+      return;
+   }
+   crtl_file_close(&offsets->fd_sidecar);
+   free(offsets);
+}
+
+static void crtl_follow_close(crtl_follow_t *follow) {
+   crtl_file_close(&follow->fd_file);
+   crtl_file_close(&follow->fd_sidecar);
+}
+
+// Open the file, waiting for it to appear, and watch it and its sidecar
+static int crtl_follow_open(crtl_follow_t *follow) {
+   for(bool logged = false;; logged = true) {
+      follow->fd_file = crtl_open(follow->filename, O_RDONLY | O_CLOEXEC, 0);
+      if(follow->fd_file >= 0) {
+         break;
+      }
+      int errsv = errno;
+      if(errsv != ENOENT) {
+         LOG_ERROR("unable to open <%s> <%s>", follow->filename, strerror(errsv));
+         return(-1);
+      }
+      if(!logged) {
+         LOG_INFO("waiting for <%s>", follow->filename);
+      }
+      struct timespec delay = { .tv_sec = 0, .tv_nsec = CRTL_FOLLOW_RETRY * 1000000L };
+      nanosleep(&delay, NULL);
+   }
+   if(crtl_storage_detect(follow->fd_file) || crtl_compress_detect(follow->fd_file)) {
+      LOG_ERROR("only uncompressed collapse storage files can be followed, use --cat");
+      crtl_follow_close(follow);
+      return(-1);
+   }
+   uint32_t mask = IN_MODIFY | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF;
+   if(0 > inotify_add_watch(follow->fd_inotify, follow->filename, mask)) {
+      int errsv = errno;
+      LOG_ERROR("unable to watch <%s> <%s>", follow->filename, strerror(errsv));
+      crtl_follow_close(follow);
+      return(-1);
+   }
+   char path[PATH_MAX];
+   snprintf(path, sizeof(path), "%s" CRTL_OFFSET_SUFFIX, follow->filename);
+   follow->fd_sidecar = crtl_open(path, O_RDONLY | O_CLOEXEC, 0);
+   if(follow->fd_sidecar >= 0 && 0 > inotify_add_watch(follow->fd_inotify, path, IN_MODIFY)) {
+      int errsv = errno;
+      LOG_ERROR("unable to watch <%s> <%s>", path, strerror(errsv));
+      crtl_follow_close(follow);
+      return(-1);
+   }
+   // Start with the data in the file
+   uint64_t pending = 0;
+   if(!crtl_offsets_read(follow->fd_file, follow->fd_sidecar, &follow->position, &pending)) {
+      crtl_follow_close(follow);
+      return(-1);
+   }
+   LOG_INFO("following <%s> from offset %" PRIu64, follow->filename, follow->position);
+   return(0);
+}
+
+// Write out the data past the position.  Returns 0 once there is no more, or a collapse is in progress, or -1.
+static int crtl_follow_drain(crtl_follow_t *follow, int fd) {
+   for(;;) {
+      uint64_t base, pending, base_after, pending_after;
+      if(!crtl_offsets_read(follow->fd_file, follow->fd_sidecar, &base, &pending)) {
+         return(-1);
+      }
+      if(pending != 0) { // The data is moving, wait for the new base
+         return(0);
+      }
+      if(follow->position < base) {
+         LOG_WARN("%" PRIu64 " bytes were collapsed before they were read", base - follow->position);
+         follow->position = base;
+      }
+      struct stat statbuf;
+      if(crtl_fstat(follow->fd_file, &statbuf) != 0) {
+         int errsv = errno;
+         LOG_ERROR("unable to stat <%s> <%s>", follow->filename, strerror(errsv));
+         return(-1);
+      }
+      if(follow->position >= base + statbuf.st_size) {
+         return(0);
+      }
+      uint64_t length = base + statbuf.st_size - follow->position;
+      if(length > sizeof(follow->buffer)) {
+         length = sizeof(follow->buffer);
+      }
+      int size = crtl_pread(follow->fd_file, follow->buffer, length, follow->position - base);
+      if(size < 0) {
+         int errsv = errno;
+         LOG_ERROR("error reading <%s> <%s>", follow->filename, strerror(errsv));
+         return(-1);
+      }
+      if(!crtl_offsets_read(follow->fd_file, follow->fd_sidecar, &base_after, &pending_after)) {
+         return(-1);
+      }
+      if(base_after != base || pending_after != 0) { // Collapsed while reading, read again at the new offset
+         continue;
+      }
+      if(size == 0) {
+         return(0);
+      }
+      if(size != crtl_write(fd, follow->buffer, size)) {
+         return(-1);
+      }
+      follow->position += size;
+   }
+}
+
+// Write the contents of a collapse storage file to fd, then whatever is appended to it, until an error
+int crtl_follow_run(const char *filename, int fd) {
+   crtl_follow_t *follow = calloc(1, sizeof(crtl_follow_t));
+   if(follow == NULL) {
+      LOG_ERROR("unable to allocate follower");
+      return(-1);
+   }
+   follow->filename   = filename;
+   follow->fd_file    = -1;
+   follow->fd_sidecar = -1;
+   follow->fd_inotify = inotify_init1(IN_CLOEXEC);
+   if(follow->fd_inotify < 0) {
+      int errsv = errno;
+      LOG_ERROR("unable to initialize inotify <%s>", strerror(errsv));
+      free(follow);
+      return(-1);
+   }
+
+   int rc = crtl_follow_open(follow);
+   char events[CRTL_FOLLOW_EVENTS] __attribute__((aligned(__alignof__(struct inotify_event))));
+   while(rc == 0) {
+      rc = crtl_follow_drain(follow, fd);
+      if(rc < 0) {
+         break;
+      }
+      int length = crtl_read(follow->fd_inotify, events, sizeof(events));
+      if(length <= 0) {
+         int errsv = errno;
+         LOG_ERROR("error reading inotify events <%s>", strerror(errsv));
+         rc = -1;
+         break;
+      }
+      bool replaced = false;
+      for(int offset = 0; offset < length;) {
+         const struct inotify_event *event = (const struct inotify_event *)(events + offset);
+         replaced = replaced || (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED));
+         offset  += sizeof(struct inotify_event) + event->len;
+      }
+      if(replaced) { // Write out what is left and move on to the new file
+         rc = crtl_follow_drain(follow, fd);
+         crtl_follow_close(follow);
+         crtl_close(follow->fd_inotify);
+         follow->fd_inotify = inotify_init1(IN_CLOEXEC);
+         if(rc == 0) {
+            rc = (follow->fd_inotify >= 0) ? crtl_follow_open(follow) : -1;
+         }
+      }
+   }
+   crtl_follow_close(follow);
+   crtl_file_close(&follow->fd_inotify);
+   free(follow);
+   return(rc);
+}
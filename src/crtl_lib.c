@@ -29,25 +29,31 @@
 #include <fcntl.h>
 #include <semaphore.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include "curtail.h"
 #include "crtl_private.h"
 
 #define CRTL_SIGNAL_QTY (7)
+#define CRTL_THREAD_DRAIN_MS (10)
+#define CRTL_PIPE_SIZE_MAX   (1024 * 1024)
+#define CRTL_PIPE_PROBE_NS   (1000000)     // Shortest time between checks of how much is waiting in the pipe
+#define CRTL_DIRECT_LINE_MAX (1024 * 1024) // Longest partial line a direct stream holds before writing it out
+#define CRTL_DIRECT_SIZE_MAX (1U << 30)    // Largest piece of a direct write handed to the output at once
 
+// Events are bits in the pending set, posted with a write to the eventfd
 typedef enum {
-   CRTL_EVENT_TERMINATE = 0,
-   CRTL_EVENT_SIG_QUIT  = 1,
-   CRTL_EVENT_SIG_TERM  = 2,
-   CRTL_EVENT_SIG_INT   = 3,
-   CRTL_EVENT_INVALID   = 4
+   CRTL_EVENT_TERMINATE   = 0,
+   CRTL_EVENT_SIG_QUIT    = 1,
+   CRTL_EVENT_SIG_TERM    = 2,
+   CRTL_EVENT_SIG_INT     = 3,
+   CRTL_EVENT_THREAD_DATA = 4,
+   CRTL_EVENT_INVALID     = 5
 } crtl_event_type_t;
 
-typedef struct {
-   crtl_event_type_t type;
-   sem_t *           semaphore;
-} crtl_event_t;
-
 typedef struct {
    bool   waiting;
    sem_t *semaphore;
@@ -55,6 +61,20 @@ typedef struct {
    int    fd_event;
 } crtl_thread_params_t;
 
+typedef struct {
+   int      fd;
+   uint32_t capacity;     // Current capacity of the stdout pipe
+   uint32_t capacity_max; // Largest capacity it is grown to
+   uint64_t probe_time;   // When the pipe was last checked for waiting data, from crtl_stats_clock
+} crtl_pipe_t;
+
+typedef struct {
+   char * data;
+   size_t size;
+   size_t capacity;
+   size_t limit;    // Held data is written as a line once it reaches this size
+} crtl_direct_cookie_t;
+
 typedef struct {
    int              signum;
    bool             installed;
@@ -65,31 +85,50 @@ typedef struct {
    crtl_log_level_t level;
    bool             initialized;
    bool             interactive;
+   bool             threaded;
    crtl_signals_t   signals[CRTL_SIGNAL_QTY];
-   uint64_t         out_file_size_max;
-   uint64_t         out_file_size_cur;
+   crtl_signals_t   signal_stats;
+   crtl_engine_t    engine;
+   uint32_t         ring_size;
+   bool             drop;
+   uint64_t         drop_rate;
+   bool             thread_buffers;
+   uint32_t         pipe_size_max;
+   bool             crash_capture;
+   crtl_watcher_t * watcher;       // Writes out the ring and the pipe if this process dies (NULL without crash capture)
+   crtl_output_t    output;
+   pthread_mutex_t  output_lock;
    pthread_t        main_thread;
    sem_t            semaphore;
-   int              fd_output;
    int              fd_input_rd;
    int              fd_input_wr;
-   int              fd_event;
+   int              fd_event;      // eventfd that wakes the processing thread
+   atomic_uint      events;        // Pending events, a bit per crtl_event_type_t
+   sem_t *          terminate_ack; // Posted by the processing thread once it has terminated
    int              fd_stdout;
    int              fd_stderr;
-   uint32_t         logical_block_size;
    char             buffer[4096];
 } crtl_global_t;
 
 static crtl_global_t g_crtl = { .level              = CRTL_LEVEL_ERROR,
                                 .initialized        = false,
                                 .interactive        = false,
-                                .fd_output          = -1,
+                                .threaded           = false,
+                                .output_lock        = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP,
+                                .engine             = CRTL_ENGINE_AUTO,
+                                .ring_size          = 0,
+                                .drop               = false,
+                                .drop_rate          = 0,
+                                .thread_buffers     = false,
                                 .fd_event           = -1,
                                 .fd_stdout          = -1,
                                 .fd_stderr          = -1,
-                                .logical_block_size = DEFAULT_SECTOR_SIZE,
-                                .out_file_size_max  = LOGR_LOG_SIZE_MAX_DEFAULT,
-                                .out_file_size_cur  = 0
+                                .output             = { .fd         = -1,
+                                                        .block_size = DEFAULT_SECTOR_SIZE,
+                                                        .size_max   = LOGR_LOG_SIZE_MAX_DEFAULT,
+                                                        .size_low   = 0,
+                                                        .size_cur   = 0,
+                                                        .lock       = NULL }
                               };
 
 static bool  crtl_signals_register(void);
@@ -97,16 +136,20 @@ static void  crtl_signals_unregister(void);
 static void  crtl_signal_handler(int signal);
 static void  crtl_abort(void);
 static void *crtl_main_thread(void *param);
-
-#if 0
-static void crtl_write_raw(const char *data, uint32_t size);
-#endif
+static void  crtl_thread_wakeup(void);
+static void  crtl_event_post(crtl_event_type_t type);
+static ssize_t crtl_direct_cookie_write(void *cookie, const char *buf, size_t size);
+static int     crtl_direct_cookie_close(void *cookie);
 
 bool crtl_log_enabled(crtl_log_level_t level) {
    return(g_crtl.level <= level);
 }
 
 bool crtl_init(const char *filename, uint64_t size_max, crtl_log_level_t level, bool include_stderr) {
+   return(crtl_init_ex(filename, size_max, level, include_stderr, NULL));
+}
+
+bool crtl_init_ex(const char *filename, uint64_t size_max, crtl_log_level_t level, bool include_stderr, const crtl_params_t *params_in) {
    if(g_crtl.initialized) {
       LOG_WARN("already initialized");
       errno = 0;
@@ -128,50 +171,121 @@ bool crtl_init(const char *filename, uint64_t size_max, crtl_log_level_t level,
       return(false);
    }
 
-   if(!crtl_file_open(filename, &g_crtl.fd_output, &g_crtl.logical_block_size, &g_crtl.out_file_size_cur)) {
+   // The limits and storage must be known when the file is opened
+   g_crtl.output.size_max  = size_max;
+   g_crtl.output.size_low  = (params_in != NULL) ? params_in->size_low  : 0;
+   g_crtl.output.storage   = (params_in != NULL) ? params_in->storage   : CRTL_STORAGE_AUTO;
+   g_crtl.output.msync_ms  = (params_in != NULL) ? params_in->msync_ms  : 0;
+   g_crtl.output.line_head = (params_in != NULL) ? params_in->line_head : false;
+   g_crtl.output.compress  = (params_in != NULL) ? params_in->compress  : false;
+   g_crtl.output.compress_threads = (params_in != NULL) ? params_in->compress_threads : 0;
+   g_crtl.output.sync       = (params_in != NULL) ? params_in->sync       : CRTL_SYNC_NONE;
+   g_crtl.output.sync_bytes = (params_in != NULL) ? params_in->sync_bytes : 0;
+   g_crtl.output.sync_ms    = (params_in != NULL) ? params_in->sync_ms    : 0;
+   g_crtl.output.cache      = (params_in != NULL) ? params_in->cache      : CRTL_CACHE_DEFAULT;
+   g_crtl.output.timestamp  = (params_in != NULL) ? params_in->timestamp  : false;
+   g_crtl.output.prealloc   = (params_in != NULL) ? params_in->prealloc   : false;
+   g_crtl.output.segment_count = (params_in != NULL) ? params_in->segments : 0;
+   g_crtl.output.publish    = (params_in != NULL) ? params_in->publish_offsets : false;
+   g_crtl.output.stats_extents = true;
+   g_crtl.engine           = (params_in != NULL) ? params_in->engine    : CRTL_ENGINE_AUTO;
+   g_crtl.ring_size        = (params_in != NULL) ? params_in->ring_size : 0;
+   if(g_crtl.ring_size > 0 && g_crtl.ring_size < CRTL_RING_SIZE_MIN) {
+      LOG_WARN("ring size must be at least %u bytes", CRTL_RING_SIZE_MIN);
+      g_crtl.ring_size = CRTL_RING_SIZE_MIN;
+   }
+   g_crtl.pipe_size_max = (params_in != NULL && params_in->pipe_size_max > 0) ? params_in->pipe_size_max : CRTL_PIPE_SIZE_MAX;
+   g_crtl.drop      = (params_in != NULL) ? params_in->drop      : false;
+   g_crtl.drop_rate = (params_in != NULL) ? params_in->drop_rate : 0;
+   if(g_crtl.drop && g_crtl.ring_size == 0) { // Drop mode queues input in the ring
+      g_crtl.ring_size = CRTL_RING_SIZE_DROP;
+   }
+   g_crtl.crash_capture = (params_in != NULL) ? params_in->crash_capture : false;
+   if(g_crtl.crash_capture && g_crtl.output.compress) { // Input leaves the ring once it is in a frame, not the file
+      LOG_WARN("crash capture not used with compression, which queues data outside the ring");
+      g_crtl.crash_capture = false;
+   }
+   if(g_crtl.crash_capture && g_crtl.ring_size == 0) { // The watcher finds unwritten input in the ring
+      g_crtl.ring_size = CRTL_RING_SIZE_CRASH;
+   }
+   crtl_file_limits(&g_crtl.output);
+
+   if(!crtl_file_open(filename, &g_crtl.output)) {
       LOG_ERROR("unable to open output file");
       crtl_signals_unregister();
       return(false);
    }
-
-   g_crtl.out_file_size_max = size_max;
    
-   if(g_crtl.out_file_size_max % DEFAULT_SECTOR_SIZE) {
-      LOG_WARN("file size should be an integer multiple of the block size (%u bytes)", DEFAULT_SECTOR_SIZE);
-      g_crtl.out_file_size_max -= g_crtl.out_file_size_max % DEFAULT_SECTOR_SIZE;
-   }
-   if(g_crtl.out_file_size_max < 2 * DEFAULT_SECTOR_SIZE) {
-      LOG_WARN("file size must be greater than 2x block size (%u bytes)", DEFAULT_SECTOR_SIZE);
-      g_crtl.out_file_size_max = 2 * DEFAULT_SECTOR_SIZE;
+   if(params_in != NULL && params_in->stats_file != NULL && !crtl_stats_file_start(params_in->stats_file, params_in->stats_ms)) {
+      LOG_WARN("statistics file not written");
    }
-   
+
    LOG_INFO("output file <%s>", filename);
-   LOG_INFO("logical block size %u bytes", g_crtl.logical_block_size);
-   LOG_INFO("current file size %" PRIu64 " bytes", g_crtl.out_file_size_cur);
-   LOG_INFO("maximum file size %" PRIu64 " bytes", g_crtl.out_file_size_max);
+   LOG_INFO("logical block size %u bytes", g_crtl.output.block_size);
+   LOG_INFO("current file size %" PRIu64 " bytes", g_crtl.output.size_cur);
+   LOG_INFO("maximum file size %" PRIu64 " bytes", g_crtl.output.size_max);
+   LOG_INFO("low watermark %" PRIu64 " bytes", g_crtl.output.size_low);
+   LOG_INFO("storage <%s>", crtl_storage_str(g_crtl.output.storage));
+   LOG_INFO("I/O engine <%s>", crtl_engine_str(g_crtl.engine));
+   LOG_INFO("ring size %u bytes", g_crtl.ring_size);
+
+   // The output is shared by the processing thread and direct writers
+   g_crtl.output.lock = &g_crtl.output_lock;
+
+   if(params_in != NULL && params_in->direct_only) { // Only crtl_direct_write is used, leave stdout alone
+      LOG_INFO("direct writes only");
+      if(g_crtl.crash_capture) {
+         LOG_WARN("crash capture not used with direct writes only, which are written before they return");
+      }
+      g_crtl.threaded    = false;
+      g_crtl.initialized = true;
+      return(true);
+   }
+
+   g_crtl.thread_buffers = false;
+   if(params_in != NULL && params_in->thread_buffer_size > 0) {
+      uint32_t size = params_in->thread_buffer_size;
+      if(size < CRTL_RING_SIZE_MIN) {
+         LOG_WARN("thread buffer size must be at least %u bytes", CRTL_RING_SIZE_MIN);
+         size = CRTL_RING_SIZE_MIN;
+      }
+      g_crtl.thread_buffers = crtl_thread_buffers_init(size, params_in->thread_order, crtl_thread_wakeup);
+      LOG_INFO("thread buffer size %u bytes%s", size, params_in->thread_order ? ", ordered" : "");
+   }
 
    // Initialize semaphore
    sem_init(&g_crtl.semaphore, 0, 0);
 
    int pipefd_input[2];
-   int pipefd_event[2];
    if(pipe(pipefd_input) == -1) {
       crtl_signals_unregister();
       return(false);
    }
-   if(pipe(pipefd_event) == -1) {
+   g_crtl.fd_event = eventfd(0, EFD_CLOEXEC);
+   if(g_crtl.fd_event < 0) {
+      close(pipefd_input[0]);
       close(pipefd_input[1]);
       crtl_signals_unregister();
       return(false);
    }
-   g_crtl.fd_event    = pipefd_event[1];
+   atomic_store(&g_crtl.events, 0);
    g_crtl.fd_input_rd = pipefd_input[0];
    g_crtl.fd_input_wr = pipefd_input[1];
 
+   // Forked before stdout is redirected, so the watcher keeps no write end of the pipe.  The syncer and statistics file
+   // threads may already run, but only this thread is copied and the watcher opens the output again on its own.
+   g_crtl.watcher = NULL;
+   if(g_crtl.crash_capture) {
+      g_crtl.watcher = crtl_watch_start(filename, &g_crtl.output, pipefd_input[0], pipefd_input[1], g_crtl.ring_size);
+      if(g_crtl.watcher == NULL) {
+         LOG_WARN("crash capture not available");
+      }
+   }
+
    crtl_thread_params_t params;
    params.semaphore = &g_crtl.semaphore;
    params.fd_input  = pipefd_input[0];
-   params.fd_event  = pipefd_event[0];
+   params.fd_event  = g_crtl.fd_event;
 
    // Save old stdout fd
    g_crtl.fd_stdout = dup(STDOUT_FILENO);
@@ -192,10 +306,48 @@ bool crtl_init(const char *filename, uint64_t size_max, crtl_log_level_t level,
    // Block until initialization is complete
    sem_wait(&g_crtl.semaphore);
 
+   g_crtl.threaded    = true;
    g_crtl.initialized = true;
    return(true);
 }
 
+// Grow the stdout pipe when a burst filled most of it, so that the application doesn't block on the next one.
+// observed is a number of bytes known to have been waiting in the pipe at once.
+static void crtl_pipe_adapt(crtl_pipe_t *pipe, uint32_t observed) {
+   if(pipe->capacity >= pipe->capacity_max || observed < pipe->capacity / 4 * 3) {
+      return;
+   }
+   uint32_t capacity = pipe->capacity * 2;
+   if(capacity > pipe->capacity_max) {
+      capacity = pipe->capacity_max;
+   }
+   int rc = fcntl(pipe->fd, F_SETPIPE_SZ, capacity);
+   if(rc < 0) { // Beyond /proc/sys/fs/pipe-max-size or the user's pipe quota, stop trying
+      int errsv = errno;
+      LOG_WARN("unable to grow input pipe to %u bytes <%s>", capacity, strerror(errsv));
+      pipe->capacity_max = pipe->capacity;
+      return;
+   }
+   LOG_INFO("input pipe grown to %d bytes", rc);
+   pipe->capacity = rc;
+}
+
+// After a read of size bytes, check how much more is waiting, at most once per CRTL_PIPE_PROBE_NS
+static void crtl_pipe_probe(crtl_pipe_t *pipe, uint32_t size) {
+   if(pipe->capacity >= pipe->capacity_max) {
+      return;
+   }
+   uint64_t now = crtl_stats_clock();
+   if(now - pipe->probe_time < CRTL_PIPE_PROBE_NS) {
+      return;
+   }
+   pipe->probe_time = now;
+   int available = 0;
+   if(0 == crtl_ioctl(pipe->fd, FIONREAD, &available) && available > 0) {
+      crtl_pipe_adapt(pipe, size + available);
+   }
+}
+
 void *crtl_main_thread(void *param) {
    // Make a copy of input parameters
    crtl_thread_params_t params = *((crtl_thread_params_t *)param);
@@ -204,64 +356,122 @@ void *crtl_main_thread(void *param) {
       sem_post(params.semaphore);
    }
 
-   bool running = true;
-   do { // Read from fd's and write to file
-      int nfds = params.fd_input;
-      if(params.fd_event > nfds) {
-         nfds = params.fd_event;
+   bool running    = true;
+   bool use_splice = (g_crtl.engine == CRTL_ENGINE_AUTO || g_crtl.engine == CRTL_ENGINE_SPLICE);
+   bool use_ring   = false;
+
+   crtl_ring_writer_t writer;
+   if(g_crtl.ring_size > 0) { // Reads and writes are decoupled by a ring, the engine is not used
+      crtl_ring_shared_t *shared = (g_crtl.watcher != NULL) ? crtl_watch_ring(g_crtl.watcher) : NULL;
+      use_ring   = crtl_ring_writer_start(&writer, &g_crtl.output, g_crtl.ring_size, shared);
+      use_splice = false;
+      if(!use_ring) {
+         LOG_ERROR("unable to start writer thread, writing from this thread");
+      } else if(g_crtl.drop && !crtl_ring_writer_drop(&writer, g_crtl.drop_rate)) {
+         LOG_WARN("unable to enable drop mode, blocking the input when the ring is full");
       }
-      nfds++;
-
-      fd_set rfds;
-      FD_ZERO(&rfds);
-      FD_SET(params.fd_input, &rfds);
-      FD_SET(params.fd_event, &rfds);
-
-      int src = select(nfds, &rfds, NULL, NULL, NULL);
-
-      if(src < 0) { // error occurred
-         LOG_ERROR("select failed, rc=%d", src);
+   } else if(g_crtl.engine == CRTL_ENGINE_URING && !g_crtl.thread_buffers) { // Returns when an event is pending or io_uring is unavailable
+      if(0 >= crtl_uring_run(params.fd_input, params.fd_event, &g_crtl.output)) {
+         running = false;
+      }
+   }
+   crtl_pipe_t pipe = { .fd = params.fd_input, .capacity = 0, .capacity_max = g_crtl.pipe_size_max, .probe_time = 0 };
+   int capacity = fcntl(params.fd_input, F_GETPIPE_SZ);
+   pipe.capacity = (capacity > 0) ? capacity : pipe.capacity_max;
+
+   int fd_epoll = running ? epoll_create1(EPOLL_CLOEXEC) : -1;
+   struct epoll_event input = { .events = EPOLLIN, .data.fd = params.fd_input };
+   struct epoll_event event = { .events = EPOLLIN, .data.fd = params.fd_event };
+   if(running && (fd_epoll < 0 || 0 > epoll_ctl(fd_epoll, EPOLL_CTL_ADD, params.fd_input, &input) || 0 > epoll_ctl(fd_epoll, EPOLL_CTL_ADD, params.fd_event, &event))) {
+      int errsv = errno;
+      LOG_ERROR("unable to set up event loop <%s>", strerror(errsv));
+      running = false;
+   }
+   while(running) { // Read from fd's and write to file
+      // Thread buffers are drained periodically as well as when one of them fills up
+      struct epoll_event events[2];
+      int count = epoll_wait(fd_epoll, events, 2, g_crtl.thread_buffers ? CRTL_THREAD_DRAIN_MS : -1);
+      if(count < 0) {
+         int errsv = errno;
+         if(errsv == EINTR) {
+            continue;
+         }
+         LOG_ERROR("epoll_wait failed <%s>", strerror(errsv));
          break;
       }
-      if(FD_ISSET(params.fd_event, &rfds)) {
-         crtl_event_t event;
-         int rc = crtl_read(params.fd_event, &event, sizeof(event));
-         if(rc <= 0 || rc != sizeof(event)) {
+      bool input_ready = false;
+      bool event_ready = false;
+      for(int index = 0; index < count; index++) {
+         input_ready = input_ready || events[index].data.fd == params.fd_input;
+         event_ready = event_ready || events[index].data.fd == params.fd_event;
+      }
+
+      if(g_crtl.thread_buffers && 0 > crtl_thread_buffers_drain(&g_crtl.output)) {
+         running = false;
+      }
+      if(event_ready) {
+         uint64_t value;
+         if(sizeof(value) != crtl_read(params.fd_event, &value, sizeof(value))) {
             LOG_ERROR("event receive failed");
             running = false;
             break;
          }
-         switch(event.type) {
-            case CRTL_EVENT_TERMINATE: {
-               if(event.semaphore != NULL) {
-                  sem_post(event.semaphore);
-               }
-               running = false;
-               break;
-            }
-            case CRTL_EVENT_SIG_QUIT: {
-               // In case of sigquit, need to attempt one last read to flush all data to the file before exiting
-               running = false;
-               break;
-            }
-            default: {
-               running = false;
+         uint32_t pending = atomic_exchange(&g_crtl.events, 0);
+         if(pending & (1u << CRTL_EVENT_TERMINATE)) {
+            if(g_crtl.terminate_ack != NULL) {
+               sem_post(g_crtl.terminate_ack);
             }
+            running = false;
          }
+         if(pending & (1u << CRTL_EVENT_SIG_QUIT)) {
+            // In case of sigquit, need to attempt one last read to flush all data to the file before exiting
+            running = false;
+         }
+         // Thread data needs nothing more, the buffers were drained above
       }
-      if(FD_ISSET(params.fd_input, &rfds)) {
+      if(input_ready && use_ring) { // Hand the data to the writer thread
+         int rc = crtl_ring_writer_read(&writer, params.fd_input);
+         if(rc <= 0) {
+            running = false;
+         } else { // The read takes all there is, up to the room in the ring
+            crtl_pipe_adapt(&pipe, rc);
+         }
+      } else if(input_ready && use_splice) { // Move data straight from the pipe into the output file
+         int rc = crtl_process_splice(params.fd_input, &g_crtl.output);
+         if(rc < 0 && errno == EINVAL) {
+            LOG_INFO("splice not supported by output file, using copy");
+            use_splice = false;
+         } else if(rc <= 0) {
+            running = false;
+         } else { // The splice moves all there is, up to the limits of the output
+            crtl_pipe_adapt(&pipe, rc);
+         }
+      } else if(input_ready) {
          int rc = crtl_read(params.fd_input, g_crtl.buffer, sizeof(g_crtl.buffer));
          if(rc <= 0) {
             running = false;
          } else {
-            rc = crtl_process_input(g_crtl.fd_output, &g_crtl.out_file_size_cur, g_crtl.out_file_size_max, g_crtl.logical_block_size, g_crtl.buffer, rc);
+            if(rc == sizeof(g_crtl.buffer)) { // Filled the buffer, there may be a lot more waiting
+               crtl_pipe_probe(&pipe, rc);
+            }
+            rc = crtl_process_input(&g_crtl.output, g_crtl.buffer, rc);
 
             if(rc < 0) {
                running = false;
             }
          }
       }
-   } while(running);
+   }
+   if(fd_epoll >= 0) {
+      crtl_close(fd_epoll);
+   }
+
+   if(use_ring) { // Write out what is left in the ring
+      crtl_ring_writer_stop(&writer);
+   }
+   if(g_crtl.thread_buffers) { // Write out records queued since the last drain
+      crtl_thread_buffers_drain(&g_crtl.output);
+   }
 
    // Restore stdout and stderr
    if(g_crtl.fd_stdout >= 0) {
@@ -282,22 +492,184 @@ int crtl_fsync(void) {
    
    if(g_crtl.interactive) {
       return(fsync(STDOUT_FILENO));
-   } else {
-      return(fsync(g_crtl.fd_output));
    }
+   if(g_crtl.output.compressor != NULL && 0 != crtl_compress_flush(g_crtl.output.compressor)) {
+      return(-1);
+   }
+   return(crtl_storage_sync(&g_crtl.output));
+}
+
+// Write straight to the output file from the calling thread, bypassing the stdout pipe and processing thread.  Like
+// write, returns the number of bytes written, which is less than len if an error stopped it part way, or -1.
+ssize_t crtl_direct_write(const void *buf, size_t len) {
+   if(!g_crtl.initialized) {
+      errno = EINVAL;
+      return(-1);
+   }
+   if(g_crtl.interactive) {
+      return(crtl_write(STDOUT_FILENO, buf, len));
+   }
+   // Keep each write within what a single collapse can make room for.  The lock is held across all of the pieces so
+   // that other writers can't land in between them.
+   const char *data    = buf;
+   size_t      written = 0;
+   crtl_output_lock(&g_crtl.output);
+   while(written < len) {
+      size_t size = len - written;
+      if(size > g_crtl.output.size_max / 2) {
+         size = g_crtl.output.size_max / 2;
+      }
+      if(size > CRTL_DIRECT_SIZE_MAX) {
+         size = CRTL_DIRECT_SIZE_MAX;
+      }
+      int rc = crtl_process_input(&g_crtl.output, data + written, size);
+      if(rc < 0) {
+         crtl_output_unlock(&g_crtl.output);
+         return(written > 0 ? (ssize_t)written : -1);
+      }
+      written += rc;
+      if((size_t)rc < size) { // Short write
+         break;
+      }
+   }
+   crtl_output_unlock(&g_crtl.output);
+   return(written);
+}
+
+// Wake the processing thread with an event.  Events posted before it wakes are handled together.  Signal safe.
+void crtl_event_post(crtl_event_type_t type) {
+   atomic_fetch_or(&g_crtl.events, 1u << type);
+   uint64_t value = 1;
+   crtl_write(g_crtl.fd_event, &value, sizeof(value));
+}
+
+// Called by a producer thread when its buffer is half full, at most once per drain
+void crtl_thread_wakeup(void) {
+   crtl_event_post(CRTL_EVENT_THREAD_DATA);
+}
+
+int crtl_thread_write(const void *buf, size_t len) {
+   if(!g_crtl.initialized) {
+      errno = EINVAL;
+      return(-1);
+   }
+   if(!g_crtl.thread_buffers) {
+      return(crtl_direct_write(buf, len));
+   }
+   return(crtl_thread_buffer_write(buf, len));
+}
+
+// Streams only pass whole lines to crtl_direct_write so that lines from different streams never interleave.  The
+// trailing partial line is held in the cookie until it is completed, grows to the cookie's limit or the stream is
+// closed.
+static bool crtl_direct_cookie_append(crtl_direct_cookie_t *partial, const char *buf, size_t size) {
+   if(partial->size + size > partial->capacity) {
+      size_t capacity = 2 * (partial->size + size);
+      char  *data     = realloc(partial->data, capacity);
+      if(data == NULL) {
+         return(false);
+      }
+      partial->data     = data;
+      partial->capacity = capacity;
+   }
+   memcpy(partial->data + partial->size, buf, size);
+   partial->size += size;
+   return(true);
+}
+
+// Write the held data followed by size bytes of buf in one piece.  Returns how many bytes of buf were written.  What
+// was written of the held data is dropped from it, the rest of buf stays with the caller.
+static size_t crtl_direct_cookie_emit(crtl_direct_cookie_t *partial, const char *buf, size_t size) {
+   size_t held = partial->size;
+   if(held == 0) {
+      ssize_t rc = crtl_direct_write(buf, size);
+      return(rc > 0 ? (size_t)rc : 0);
+   }
+   if(!crtl_direct_cookie_append(partial, buf, size)) {
+      return(0);
+   }
+   ssize_t rc = crtl_direct_write(partial->data, partial->size);
+   partial->size = held;
+   if(rc <= 0) {
+      return(0);
+   }
+   if((size_t)rc < held) {
+      memmove(partial->data, partial->data + rc, held - rc);
+      partial->size = held - rc;
+      return(0);
+   }
+   partial->size = 0;
+   return(rc - held);
+}
+
+ssize_t crtl_direct_cookie_write(void *cookie, const char *buf, size_t size) {
+   crtl_direct_cookie_t *partial = cookie;
+   const char *end   = memrchr(buf, '\n', size);
+   size_t      whole = (end != NULL) ? (size_t)(end - buf) + 1 : 0;
+   if(whole == 0 && partial->size + size >= partial->limit) { // Output that never ends a line is written in pieces
+      whole = size;
+   }
+   if(whole > 0) { // Write out all complete lines
+      size_t written = crtl_direct_cookie_emit(partial, buf, whole);
+      if(written < whole) {
+         return(written);
+      }
+   }
+   if(!crtl_direct_cookie_append(partial, buf + whole, size - whole)) {
+      return(whole);
+   }
+   return(size);
+}
+
+int crtl_direct_cookie_close(void *cookie) {
+   crtl_direct_cookie_t *partial = cookie;
+   int rc = 0;
+   if(partial->size > 0 && partial->size != (size_t)crtl_direct_write(partial->data, partial->size)) {
+      rc = EOF;
+   }
+   free(partial->data);
+   free(partial);
+   return(rc);
+}
+
+// Stream whose writes go to crtl_direct_write through a buffer of buffer_size bytes (0 for the stdio default)
+FILE *crtl_direct_open(size_t buffer_size) {
+   if(!g_crtl.initialized) {
+      errno = EINVAL;
+      return(NULL);
+   }
+   crtl_direct_cookie_t *partial = calloc(1, sizeof(crtl_direct_cookie_t));
+   if(partial == NULL) {
+      return(NULL);
+   }
+   partial->limit = (g_crtl.output.size_max / 2 < CRTL_DIRECT_LINE_MAX) ? g_crtl.output.size_max / 2 : CRTL_DIRECT_LINE_MAX;
+   cookie_io_functions_t functions = { .read = NULL, .write = crtl_direct_cookie_write, .seek = NULL, .close = crtl_direct_cookie_close };
+   FILE *stream = fopencookie(partial, "w", functions);
+   if(stream == NULL) {
+      free(partial);
+      return(NULL);
+   }
+   if(buffer_size > 0) {
+      setvbuf(stream, NULL, _IOFBF, buffer_size);
+   }
+   return(stream);
 }
 
 void crtl_term(void) {
-   if(g_crtl.initialized) {
+   if(g_crtl.initialized && !g_crtl.threaded) { // No processing thread to stop
+      crtl_fsync();
+      crtl_storage_close(&g_crtl.output);
+      crtl_stats_file_stop();
+      crtl_signals_unregister();
+      g_crtl.initialized = false;
+   } else if(g_crtl.initialized) {
       // Terminate processing thread
-      sem_t        semaphore;
-      crtl_event_t event;
-      event.type      = CRTL_EVENT_TERMINATE;
-      event.semaphore = &semaphore;
+      sem_t semaphore;
       // Initialize semaphore
       sem_init(&semaphore, 0, 0);
+      g_crtl.terminate_ack = &semaphore;
 
-      crtl_write(g_crtl.fd_event, &event, sizeof(event));
+      crtl_event_post(CRTL_EVENT_TERMINATE);
 
       // Wait for acknowledgement
       int rc = -1;
@@ -317,8 +689,9 @@ void crtl_term(void) {
          } while(1);
       }
 
-      if(rc != 0) { // no response received
+      if(rc != 0) { // no response received, leave what is still in the ring to the watcher
          LOG_INFO("Do NOT wait for thread to exit");
+         g_crtl.watcher = NULL;
       } else {
          // Wait for thread to exit
          LOG_INFO("Waiting for thread to exit");
@@ -330,8 +703,16 @@ void crtl_term(void) {
          }
       }
 
+      g_crtl.terminate_ack = NULL;
+      if(g_crtl.thread_buffers) {
+         crtl_thread_buffers_term();
+         g_crtl.thread_buffers = false;
+      }
       crtl_fsync();
-      crtl_file_close(&g_crtl.fd_output);
+      crtl_storage_close(&g_crtl.output);
+      crtl_watch_stop(g_crtl.watcher); // Everything is written
+      g_crtl.watcher = NULL;
+      crtl_stats_file_stop();
       if(g_crtl.fd_event >= 0) {
          crtl_close(g_crtl.fd_event);
          g_crtl.fd_event = -1;
@@ -365,6 +746,17 @@ bool crtl_signals_register(void) {
       }
       g_crtl.signals[index].installed = true;
    }
+
+   // Dump statistics on SIGUSR1 unless the program handles it
+   struct sigaction current;
+   if(0 == sigaction(SIGUSR1, NULL, &current) && !(current.sa_flags & SA_SIGINFO) && current.sa_handler == SIG_DFL) {
+      struct sigaction act;
+      memset(&act, 0, sizeof(act));
+      act.sa_handler = crtl_signal_handler;
+      act.sa_flags   = SA_RESTART;
+      g_crtl.signal_stats.signum    = SIGUSR1;
+      g_crtl.signal_stats.installed = (0 == sigaction(SIGUSR1, &act, &g_crtl.signal_stats.act));
+   }
    return(true);
 }
 
@@ -375,6 +767,10 @@ void crtl_signals_unregister(void) {
          g_crtl.signals[index].installed = false;
       }
    }
+   if(g_crtl.signal_stats.installed) {
+      sigaction(SIGUSR1, &g_crtl.signal_stats.act, NULL);
+      g_crtl.signal_stats.installed = false;
+   }
 }
 
 void crtl_signal_handler(int signal) {
@@ -421,39 +817,47 @@ void crtl_signal_handler(int signal) {
          raise(signal);
          break;
       }
+      case SIGUSR1: { // stderr may be captured, dump to the original one
+         crtl_stats_dump(g_crtl.fd_stderr >= 0 ? g_crtl.fd_stderr : STDERR_FILENO);
+         break;
+      }
       default: {
          break;
       }
    }
 }
 
-#if 0
-void crtl_write_raw(const char *data, uint32_t size) {
-   crtl_process_input(g_crtl.fd_output, &g_crtl.out_file_size_cur, g_crtl.out_file_size_max, g_crtl.logical_block_size, data, size);
-   crtl_fsync();
-}
-#endif
-
 // This function allows the program to flush data to disk when the program crashes
 // IMPORTANT: must be signal safe
 void crtl_abort(void) {
-   if(!g_crtl.interactive) {
+   // The crashing thread may hold the output lock
+   g_crtl.output.lock = NULL;
+
+   if(!g_crtl.interactive && g_crtl.threaded) {
       if(0 == ftrylockfile(stdout)) { // lock obtained. proceed to flush stdout
          fflush_unlocked(stdout);
          funlockfile(stdout);
       }
 
-      // Set input to non-blocking
-      int flags = fcntl(g_crtl.fd_input_rd, F_GETFL, 0);
-      fcntl(g_crtl.fd_input_rd, F_SETFL, flags | O_NONBLOCK);
+      // With crash capture the watcher writes out the ring and all of the pipe once this process is gone
+      if(g_crtl.watcher == NULL) {
+         // Set input to non-blocking
+         int flags = fcntl(g_crtl.fd_input_rd, F_GETFL, 0);
+         fcntl(g_crtl.fd_input_rd, F_SETFL, flags | O_NONBLOCK);
 
-      // Attempt one more read from input fd in case there is unprocessed data
-      int rc = crtl_read(g_crtl.fd_input_rd, g_crtl.buffer, sizeof(g_crtl.buffer));
-      if(rc > 0) { // Process the data
-         crtl_process_input(g_crtl.fd_output, &g_crtl.out_file_size_cur, g_crtl.out_file_size_max, g_crtl.logical_block_size, g_crtl.buffer, rc);
+         // Attempt one more read from input fd in case there is unprocessed data
+         int rc = crtl_read(g_crtl.fd_input_rd, g_crtl.buffer, sizeof(g_crtl.buffer));
+         if(rc > 0 && g_crtl.output.compressor == NULL && g_crtl.output.stamp == NULL) { // Compression and timestamps wait on locks
+            crtl_process_input(&g_crtl.output, g_crtl.buffer, rc);
+         }
       }
    }
 
-   // Flush the data to the file
-   crtl_fsync();
+   // Flush the data to the file.  Frames that are still being compressed are lost as waiting for the workers is not
+   // signal safe.
+   if(g_crtl.interactive) {
+      fsync(STDOUT_FILENO);
+   } else if(g_crtl.initialized) {
+      crtl_storage_sync(&g_crtl.output);
+   }
 }
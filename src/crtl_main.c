@@ -27,6 +27,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <signal.h>
+#include <pthread.h>
 #include <linux/limits.h>
 #include <linux/fs.h>
 #include <fcntl.h>
@@ -46,7 +47,12 @@ static bool    crtl_cmdline_args(int argc, char *argv[]);
 static error_t crtl_parse_opt(int key, char *arg, struct argp_state *state);
 static bool    crtl_main_init(void);
 static void    crtl_main(void);
+static void    crtl_main_ring(void);
+static void    crtl_main_fanin(void);
 static void    crtl_main_term(void);
+static bool    crtl_main_tee_open(const crtl_output_t *defaults);
+static bool    crtl_main_match_open(const crtl_output_t *defaults);
+static bool    crtl_main_output_open(char *spec, const crtl_output_t *defaults, crtl_output_t *output);
 static void    crtl_signals_register(void);
 static void    crtl_signal_handler(int signal);
 
@@ -54,10 +60,29 @@ typedef struct {
    crtl_log_level_t level;
    bool             sig_quit;
    char *           out_file_path;
-   uint64_t         out_file_size_max;
-   uint64_t         out_file_size_cur;
-   int              fd_output;
-   uint32_t         logical_block_size;
+   char **          args;
+   uint32_t         arg_count;
+   bool             daemon;
+   char *           daemon_socket;
+   char *           attach_socket;
+   bool             cat;
+   bool             follow;
+   crtl_engine_t    engine;
+   uint32_t         ring_size;
+   bool             drop;
+   uint64_t         drop_rate;
+   crtl_output_t *  tees;            // Outputs that get a copy of everything, given as extra arguments
+   uint32_t         tee_count;
+   char **          inputs;
+   uint32_t         input_count;
+   bool             tag;
+   char **          patterns;        // Lines containing any of these are also written to match_file
+   uint32_t         pattern_count;
+   char *           match_file;
+   crtl_output_t    match_output;
+   char *           stats_file;
+   uint32_t         stats_ms;
+   crtl_output_t    output;
    char             buffer[4096];
 } crtl_global_t;
 
@@ -66,12 +91,41 @@ const char *argp_program_bug_address = "<david_wolaver@cable.comcast.com>";
 
 static char doc[] = "curtail -- a program that reads stdin and writes to a fixed size file";
 
-static char args_doc[] = "<output file>";
+static char args_doc[] = "<output file> [<output file>:<size>...]\n"
+                         "--cat <output file>\n"
+                         "--follow <output file>\n"
+                         "--daemon[=<socket>] [<input fifo>:<output file>[:<size>]...]";
 
 static struct argp_option options[] = {
   {"verbose",  'v', 0,      0,  "Produce verbose output" },
   {"quiet",    'q', 0,      0,  "Don't produce any output" },
   {"size",     's', "size", 0,  "Maximum size of the output file (ie. 8192, 64K, 10M, 1G, etc)" },
+  {"low",      'l', "size", 0,  "Size the output file is reduced to once the maximum size is reached (default: only what is needed)" },
+  {"engine",   'e', "name", 0,  "I/O engine: auto, copy, splice or uring (default: auto)" },
+  {"ring",     'r', "size", 0,  "Read stdin on its own thread into a ring buffer of this size so that slow disk writes don't block the input" },
+  {"drop",     'k', "rate", OPTION_ARG_OPTIONAL, "Never block the input: when the ring is full (16M unless --ring is given), or input exceeds the rate in bytes per second, whole lines are dropped and a marker with the number of bytes lost is written" },
+  {"input",    'n', "source", 0, "Also read whole lines from this source, a FIFO or an inherited descriptor given as fd:<number>.  May be repeated" },
+  {"tag",      'g', 0,      0,  "With --input, prefix each line with the name of its source in brackets" },
+  {"match",    'x', "text", 0,  "Also write lines that contain this text to the --match-output file.  May be repeated" },
+  {"match-output", 'o', "file[:size]", 0, "Capped file that gets the lines matching --match, with the same settings as the output file unless a size is given" },
+  {"daemon",   'd', "socket", OPTION_ARG_OPTIONAL, "Service many inputs from one process.  Inputs are FIFOs given as arguments and pipes attached through the socket" },
+  {"attach",   'a', "socket", 0, "Hand stdin to the daemon listening on the socket and exit" },
+  {"storage",  'm', "name", 0,  "Output storage: auto, collapse, ring, mmap or segment (default: auto, a ring file on filesystems without collapse support)" },
+  {"segments", 'w', "count", 0, "Number of files segment storage splits the maximum size across, named <output file>.<n> (default: 4)" },
+  {"msync",    'y', "ms",   0,  "Interval between writebacks of mmap storage in milliseconds (default: 1000)" },
+  {"line-head", 'L', 0,     0,  "Track where the first complete line starts after old data is discarded.  Ring files start at that line, other files publish its offset in the user.curtail.head attribute (or <output file>.head)" },
+  {"cat",      'c', 0,      0,  "Write the contents of the output file to stdout in order and exit" },
+  {"follow",   'F', 0,      0,  "Write the contents of the output file to stdout, then keep writing what is appended to it across collapses and file replacement (collapse storage written with --publish only)" },
+  {"publish",  'b', 0,      0,  "Publish the bytes collapsed over the life of the output file in the user.curtail.offset attribute (or <output file>.offset) so that it can be followed (collapse storage only)" },
+  {"compress", 'z', "threads", OPTION_ARG_OPTIONAL, "Write zlib compressed frames using a pool of threads (default: 2).  Read the file back with --cat" },
+  {"sync",     'f', "mode", 0,  "Durability policy: none, fsync (group commit from a background thread) or range (streamed write-back with sync_file_range) (default: none)" },
+  {"sync-bytes", 'B', "size", 0, "Bytes written that trigger a sync (default: time only for fsync, 1M for range)" },
+  {"sync-interval", 'I', "ms", 0, "Longest time between syncs of written data in milliseconds (default: 1000)" },
+  {"timestamp", 't', 0,     0,  "Prefix each line with the local time it is written, to the millisecond" },
+  {"prealloc", 'u', 0,      0,  "Reserve the disk space the output file can grow to beyond its end, topped up by an eighth of the maximum size whenever the reserved space drops below it, so the file stays in a few large extents (collapse storage only)" },
+  {"cache",    'p', "mode", 0,  "Page cache use of the output file: default, dontneed (drop written pages every 1M) or direct (O_DIRECT block aligned writes, collapse storage only) (default: default)" },
+  {"stats-file", 'S', "path", 0, "Periodically replace this file with the counters and latency histograms in the Prometheus text format.  They are also dumped to stderr on SIGUSR1" },
+  {"stats-interval", 'i', "ms", 0, "Interval between updates of the stats file in milliseconds (default: 1000)" },
   { 0 }
 };
 
@@ -80,10 +134,32 @@ static struct argp argp = { options, crtl_parse_opt, args_doc, doc };
 static crtl_global_t g_crtl = { .level              = CRTL_LEVEL_INFO,
                                 .sig_quit           = false,
                                 .out_file_path      = "",
-                                .fd_output          = -1,
-                                .logical_block_size = DEFAULT_SECTOR_SIZE,
-                                .out_file_size_max  = LOGR_LOG_SIZE_MAX_DEFAULT,
-                                .out_file_size_cur  = 0
+                                .args               = NULL,
+                                .arg_count          = 0,
+                                .daemon             = false,
+                                .daemon_socket      = NULL,
+                                .attach_socket      = NULL,
+                                .cat                = false,
+                                .follow             = false,
+                                .engine             = CRTL_ENGINE_AUTO,
+                                .ring_size          = 0,
+                                .drop               = false,
+                                .drop_rate          = 0,
+                                .tees               = NULL,
+                                .tee_count          = 0,
+                                .inputs             = NULL,
+                                .input_count        = 0,
+                                .tag                = false,
+                                .patterns           = NULL,
+                                .pattern_count      = 0,
+                                .match_file         = NULL,
+                                .stats_file         = NULL,
+                                .stats_ms           = 0,
+                                .output             = { .fd         = -1,
+                                                        .block_size = DEFAULT_SECTOR_SIZE,
+                                                        .size_max   = LOGR_LOG_SIZE_MAX_DEFAULT,
+                                                        .size_low   = 0,
+                                                        .size_cur   = 0 }
                               };
 
 bool crtl_log_enabled(crtl_log_level_t level) {
@@ -101,14 +177,39 @@ int main(int argc, char *argv[]) {
 
    LOG_DEBUG("Starting process ver %s", LOGR_VERSION);
 
+   if(g_crtl.cat) {
+      return(crtl_storage_cat(g_crtl.out_file_path, STDOUT_FILENO));
+   }
+
+   if(g_crtl.follow) { // Runs until interrupted
+      return(crtl_follow_run(g_crtl.out_file_path, STDOUT_FILENO));
+   }
+
+   if(g_crtl.attach_socket != NULL) { // Another process takes over stdin
+      return(crtl_daemon_attach(g_crtl.attach_socket, g_crtl.out_file_path, &g_crtl.output));
+   }
+
    crtl_signals_register();
+   if(g_crtl.stats_file != NULL && !crtl_stats_file_start(g_crtl.stats_file, g_crtl.stats_ms)) {
+      LOG_WARN("statistics file not written");
+   }
 
+   if(g_crtl.daemon) {
+      int rc = crtl_daemon_run(g_crtl.daemon_socket, g_crtl.args, g_crtl.arg_count, &g_crtl.output, g_crtl.engine, &g_crtl.sig_quit);
+      crtl_stats_file_stop();
+      LOG_DEBUG("return");
+      return(rc);
+   }
+
+   int rc = -1;
    if(crtl_main_init()) {
       crtl_main();
+      rc = 0;
    }
    crtl_main_term();
+   crtl_stats_file_stop();
    LOG_DEBUG("return");
-   return(0);
+   return(rc);
 }
 
 error_t crtl_parse_opt(int key, char *arg, struct argp_state *state) {
@@ -126,36 +227,195 @@ error_t crtl_parse_opt(int key, char *arg, struct argp_state *state) {
       }
       case 's': {
          LOG_DEBUG("size arg %s", arg);
-         size_t length = strlen(arg);
-         char last_char = arg[length - 1];
-         uint64_t multiplier = 0;
-         if(last_char == 'k' || last_char == 'K') {
-            multiplier = 1024;
-            arg[length - 1] = '\0';
-         } else if(last_char == 'm' || last_char == 'M') {
-            multiplier = 1024 * 1024;
-            arg[length - 1] = '\0';
-         } else if(last_char == 'g' || last_char == 'G') {
-            multiplier = 1024 * 1024 * 1024;
-            arg[length - 1] = '\0';
+         uint64_t size = crtl_parse_size(arg);
+         if(size > 0) {
+            arguments->output.size_max = size;
          }
-         
-         int size = atoi(arg);
+         break;
+      }
+      case 'l': {
+         LOG_DEBUG("low arg %s", arg);
+         uint64_t size = crtl_parse_size(arg);
          if(size > 0) {
-            arguments->out_file_size_max = size * multiplier;
+            arguments->output.size_low = size;
          }
          break;
       }
-      case ARGP_KEY_ARG: {
-         if(state->arg_num >= 1) { // Too many arguments.
-           argp_usage(state);
+      case 'e': {
+         if(!crtl_engine_parse(arg, &arguments->engine)) {
+            argp_error(state, "invalid engine <%s>", arg);
+         }
+         break;
+      }
+      case 'r': {
+         LOG_DEBUG("ring arg %s", arg);
+         uint64_t size = crtl_parse_size(arg);
+         if(size < CRTL_RING_SIZE_MIN || size > CRTL_RING_SIZE_MAX) {
+            argp_error(state, "ring size must be between %u and %u bytes", CRTL_RING_SIZE_MIN, CRTL_RING_SIZE_MAX);
+         }
+         arguments->ring_size = size;
+         break;
+      }
+      case 'd': {
+         arguments->daemon        = true;
+         arguments->daemon_socket = arg;
+         break;
+      }
+      case 'a': {
+         arguments->attach_socket = arg;
+         break;
+      }
+      case 'm': {
+         if(!crtl_storage_parse(arg, &arguments->output.storage)) {
+            argp_error(state, "invalid storage <%s>", arg);
          }
-         arguments->out_file_path = arg;
+         break;
+      }
+      case 'w': {
+         int count = atoi(arg);
+         if(count < 2) {
+            argp_error(state, "invalid segment count <%s>", arg);
+         }
+         arguments->output.segment_count = count;
+         break;
+      }
+      case 'y': {
+         int interval = atoi(arg);
+         if(interval <= 0) {
+            argp_error(state, "invalid msync interval <%s>", arg);
+         }
+         arguments->output.msync_ms = interval;
+         break;
+      }
+      case 'L': {
+         arguments->output.line_head = true;
+         break;
+      }
+      case 'c': {
+         arguments->cat = true;
+         break;
+      }
+      case 'F': {
+         arguments->follow = true;
+         break;
+      }
+      case 'b': {
+         arguments->output.publish = true;
+         break;
+      }
+      case 'u': {
+         arguments->output.prealloc = true;
+         break;
+      }
+      case 'f': {
+         if(!crtl_sync_parse(arg, &arguments->output.sync)) {
+            argp_error(state, "invalid sync mode <%s>", arg);
+         }
+         break;
+      }
+      case 'B': {
+         arguments->output.sync_bytes = crtl_parse_size(arg);
+         break;
+      }
+      case 'I': {
+         int interval = atoi(arg);
+         if(interval <= 0) {
+            argp_error(state, "invalid sync interval <%s>", arg);
+         }
+         arguments->output.sync_ms = interval;
+         break;
+      }
+      case 't': {
+         arguments->output.timestamp = true;
+         break;
+      }
+      case 'p': {
+         if(!crtl_cache_parse(arg, &arguments->output.cache)) {
+            argp_error(state, "invalid cache mode <%s>", arg);
+         }
+         break;
+      }
+      case 'S': {
+         arguments->stats_file = arg;
+         break;
+      }
+      case 'i': {
+         int interval = atoi(arg);
+         if(interval <= 0) {
+            argp_error(state, "invalid stats interval <%s>", arg);
+         }
+         arguments->stats_ms = interval;
+         break;
+      }
+      case 'n': {
+         arguments->inputs[arguments->input_count++] = arg;
+         break;
+      }
+      case 'g': {
+         arguments->tag = true;
+         break;
+      }
+      case 'x': {
+         arguments->patterns[arguments->pattern_count++] = arg;
+         break;
+      }
+      case 'o': {
+         arguments->match_file = arg;
+         break;
+      }
+      case 'k': {
+         arguments->drop = true;
+         if(arg != NULL) {
+            arguments->drop_rate = crtl_parse_size(arg);
+            if(arguments->drop_rate == 0) {
+               argp_error(state, "invalid drop rate <%s>", arg);
+            }
+         }
+         break;
+      }
+      case 'z': {
+         arguments->output.compress = true;
+         if(arg != NULL) {
+            int threads = atoi(arg);
+            if(threads <= 0) {
+               argp_error(state, "invalid compression thread count <%s>", arg);
+            }
+            arguments->output.compress_threads = threads;
+         }
+         break;
+      }
+      case ARGP_KEY_ARG: {
+         arguments->args[arguments->arg_count++] = arg;
          break;
       }
       case ARGP_KEY_END: {
-         if (state->arg_num < 1) { // Not enough arguments.
-           argp_usage (state);
+         if(arguments->tag && arguments->input_count == 0) {
+            argp_error(state, "tag requires at least one input");
+         }
+         if(arguments->daemon && arguments->input_count > 0) {
+            argp_error(state, "inputs are not merged in daemon mode");
+         }
+         if(arguments->input_count > 0 && (arguments->ring_size > 0 || arguments->drop)) { // Merged inputs are read without a ring
+            argp_error(state, "ring and drop are not used with inputs");
+         }
+         if((arguments->pattern_count > 0) != (arguments->match_file != NULL)) {
+            argp_error(state, "match and match-output must be given together");
+         }
+         if(arguments->daemon && arguments->match_file != NULL) {
+            argp_error(state, "lines are not matched in daemon mode");
+         }
+         if(arguments->daemon) { // Arguments are input streams
+            if(arguments->arg_count < 1 && arguments->daemon_socket == NULL) {
+               argp_error(state, "daemon requires a socket or at least one input");
+            }
+            break;
+         }
+         if(arguments->arg_count < 1 || (arguments->arg_count > 1 && (arguments->cat || arguments->follow || arguments->attach_socket != NULL))) { // Too many or not enough arguments.
+           argp_usage(state);
+         }
+         arguments->out_file_path = arguments->args[0];
+         if(arguments->drop && arguments->ring_size == 0) { // Drop mode queues input in the ring
+            arguments->ring_size = CRTL_RING_SIZE_DROP;
          }
          break;
       }
@@ -167,55 +427,192 @@ error_t crtl_parse_opt(int key, char *arg, struct argp_state *state) {
 }
 
 bool crtl_cmdline_args(int argc, char *argv[]) {
+   g_crtl.args   = calloc(argc, sizeof(char *));
+   g_crtl.inputs = calloc(argc, sizeof(char *));
+   g_crtl.patterns = calloc(argc, sizeof(char *));
+   if(g_crtl.args == NULL || g_crtl.inputs == NULL || g_crtl.patterns == NULL) {
+      return(false);
+   }
    argp_parse(&argp, argc, argv, 0, 0, &g_crtl);
    
    LOG_INFO("log level <%s>",  crtl_log_level_str(g_crtl.level));
-   LOG_INFO("output file size <%" PRIu64 ">", g_crtl.out_file_size_max);
-   LOG_INFO("output file path <%s>",   g_crtl.out_file_path);
-   
-   if(g_crtl.out_file_size_max % DEFAULT_SECTOR_SIZE) {
-      LOG_WARN("file size should be an integer multiple of the block size (%u bytes)", DEFAULT_SECTOR_SIZE);
-      g_crtl.out_file_size_max -= g_crtl.out_file_size_max % DEFAULT_SECTOR_SIZE;
+   crtl_file_limits(&g_crtl.output);
+
+   LOG_INFO("output file size <%" PRIu64 ">", g_crtl.output.size_max);
+   LOG_INFO("output file low watermark <%" PRIu64 ">", g_crtl.output.size_low);
+   if(!g_crtl.daemon) {
+      LOG_INFO("output file path <%s>",   g_crtl.out_file_path);
+   }
+   LOG_INFO("storage <%s>", crtl_storage_str(g_crtl.output.storage));
+   LOG_INFO("sync <%s>", crtl_sync_str(g_crtl.output.sync));
+   LOG_INFO("cache <%s>", crtl_cache_str(g_crtl.output.cache));
+   LOG_INFO("I/O engine <%s>", crtl_engine_str(g_crtl.engine));
+   if(g_crtl.ring_size > 0) {
+      LOG_INFO("ring size <%u>", g_crtl.ring_size);
+   }
+   if(g_crtl.drop) {
+      LOG_INFO("drop on overload, rate <%" PRIu64 ">", g_crtl.drop_rate);
+   }
+   for(uint32_t index = 0; index < g_crtl.input_count; index++) {
+      LOG_INFO("input <%s>", g_crtl.inputs[index]);
    }
-   if(g_crtl.out_file_size_max < 2 * DEFAULT_SECTOR_SIZE) {
-      LOG_WARN("file size must be greater than 2x block size (%u bytes)", DEFAULT_SECTOR_SIZE);
-      g_crtl.out_file_size_max = 2 * DEFAULT_SECTOR_SIZE;
+   for(uint32_t index = 0; index < g_crtl.pattern_count; index++) {
+      LOG_INFO("match <%s>", g_crtl.patterns[index]);
    }
 
    return(true);
 }
 
 bool crtl_main_init(void) {
-   if(isatty(STDIN_FILENO)) {
+   if(isatty(STDIN_FILENO) && g_crtl.input_count == 0) {
       LOG_ERROR("cannot run from a terminal.");
       return(false);
    }
    
-   if(!crtl_file_open(g_crtl.out_file_path, &g_crtl.fd_output, &g_crtl.logical_block_size, &g_crtl.out_file_size_cur)) {
+   crtl_output_t defaults = g_crtl.output;
+   g_crtl.output.stats_extents = true; // Not the tees or the match output
+   if(!crtl_file_open(g_crtl.out_file_path, &g_crtl.output)) {
       LOG_ERROR("unable to open output file");
       return(false);
    }
    
-   LOG_INFO("logical block size %u bytes", g_crtl.logical_block_size);
-   LOG_INFO("current file size %" PRIu64 " bytes", g_crtl.out_file_size_cur);
+   LOG_INFO("logical block size %u bytes", g_crtl.output.block_size);
+   LOG_INFO("current file size %" PRIu64 " bytes", g_crtl.output.size_cur);
+   LOG_INFO("using %s storage", crtl_storage_str(g_crtl.output.storage));
 
+   return(crtl_main_tee_open(&defaults) && crtl_main_match_open(&defaults));
+}
+
+// Open "<output file>[:<size>]" with the default settings unless a size is given
+bool crtl_main_output_open(char *spec, const crtl_output_t *defaults, crtl_output_t *output) {
+   *output = *defaults;
+   int rc = crtl_parse_spec_size(spec, &output->size_max);
+   if(rc < 0) {
+      return(false);
+   }
+   if(rc > 0) {
+      output->size_low = 0;
+   }
+   crtl_file_limits(output);
+   if(!crtl_file_open(spec, output)) {
+      LOG_ERROR("unable to open output file <%s>", spec);
+      return(false);
+   }
+   return(true);
+}
+
+// Open the outputs given as "<output file>[:<size>]" after the first one, with the same settings unless a size is
+// given, and chain them after the first output so that everything written to it is written to them too
+bool crtl_main_tee_open(const crtl_output_t *defaults) {
+   if(g_crtl.arg_count <= 1) {
+      return(true);
+   }
+   g_crtl.tees = calloc(g_crtl.arg_count - 1, sizeof(crtl_output_t));
+   if(g_crtl.tees == NULL) {
+      LOG_ERROR("unable to allocate outputs");
+      return(false);
+   }
+   crtl_output_t **link = &g_crtl.output.tee;
+   for(uint32_t index = 1; index < g_crtl.arg_count; index++) {
+      crtl_output_t *tee  = &g_crtl.tees[g_crtl.tee_count];
+      char *         spec = g_crtl.args[index];
+      if(!crtl_main_output_open(spec, defaults, tee)) {
+         return(false);
+      }
+      g_crtl.tee_count++;
+      // Holds what is duplicated for this output on the splice path, which copies instead if the pipe is missing
+      if(0 > pipe2(tee->tee_pipe, O_CLOEXEC)) {
+         int errsv = errno;
+         LOG_WARN("unable to create tee pipe <%s>", strerror(errsv));
+         tee->tee_pipe[0] = -1;
+         tee->tee_pipe[1] = -1;
+      }
+      *link = tee;
+      link  = &tee->tee;
+      LOG_INFO("tee output <%s> size %" PRIu64 " low %" PRIu64 " current %" PRIu64, spec, tee->size_max, tee->size_low, tee->size_cur);
+   }
+   return(true);
+}
+
+// Open the output for matching lines and route them to it from the first output
+bool crtl_main_match_open(const crtl_output_t *defaults) {
+   if(g_crtl.match_file == NULL) {
+      return(true);
+   }
+   if(!crtl_main_output_open(g_crtl.match_file, defaults, &g_crtl.match_output)) {
+      return(false);
+   }
+   g_crtl.output.matcher = crtl_match_open(g_crtl.patterns, g_crtl.pattern_count, &g_crtl.match_output);
+   if(g_crtl.output.matcher == NULL) {
+      crtl_storage_close(&g_crtl.match_output);
+      return(false);
+   }
+   LOG_INFO("match output <%s> size %" PRIu64 " low %" PRIu64 " current %" PRIu64, g_crtl.match_file, g_crtl.match_output.size_max, g_crtl.match_output.size_low, g_crtl.match_output.size_cur);
    return(true);
 }
 
 void crtl_main_term(void) {
-   LOG_DEBUG("fd %d", g_crtl.fd_output);
-   crtl_file_close(&g_crtl.fd_output);
+   LOG_DEBUG("fd %d", g_crtl.output.fd);
+   if(g_crtl.output.matcher != NULL) { // Matches the partial last line into the match output before it is closed
+      crtl_match_close(g_crtl.output.matcher);
+      g_crtl.output.matcher = NULL;
+      crtl_storage_close(&g_crtl.match_output);
+   }
+   crtl_storage_close(&g_crtl.output);
+   for(uint32_t index = 0; index < g_crtl.tee_count; index++) {
+      crtl_storage_close(&g_crtl.tees[index]);
+      crtl_file_close(&g_crtl.tees[index].tee_pipe[0]);
+      crtl_file_close(&g_crtl.tees[index].tee_pipe[1]);
+   }
+   free(g_crtl.tees);
+   g_crtl.tees = NULL;
+   g_crtl.output.tee = NULL;
 }
 
 void crtl_main(void) {
-   bool running = true;
+   if(g_crtl.input_count > 0) { // Lines from all inputs are merged, the engine and ring are not used
+      crtl_main_fanin();
+      return;
+   }
+   if(g_crtl.ring_size > 0) { // Reads and writes are decoupled by a ring, the engine is not used
+      crtl_main_ring();
+      return;
+   }
+
+   bool running    = true;
+   bool use_splice = false;
+   if(g_crtl.engine == CRTL_ENGINE_URING) {
+      int rc = crtl_uring_run(STDIN_FILENO, -1, &g_crtl.output);
+      if(rc <= 0) { // End of input or error
+         return;
+      }
+   } else if(g_crtl.engine == CRTL_ENGINE_AUTO || g_crtl.engine == CRTL_ENGINE_SPLICE) {
+      use_splice = crtl_fd_is_pipe(STDIN_FILENO);
+      if(!use_splice && g_crtl.engine == CRTL_ENGINE_SPLICE) {
+         LOG_WARN("splice requires the input to be a pipe, using copy");
+      }
+   }
+   LOG_DEBUG("using %s", use_splice ? "splice" : "copy");
    do { // Read stdin and write to file
       if(g_crtl.sig_quit) { // In case of sigquit, need to attempt one last read to flush all data to the file before exiting
          running = false;
       }
+      if(use_splice) { // Move data straight from the stdin pipe into the output file
+         int rc = crtl_process_splice(STDIN_FILENO, &g_crtl.output);
+         if(rc < 0 && errno == EINVAL) {
+            LOG_INFO("splice not supported by output file, using copy");
+            use_splice = false;
+         } else if(rc < 0) {
+            LOG_ERROR("%s: error processing stdin\n", __FUNCTION__);
+            running = false;
+         } else if(rc == 0) {
+            running = false;
+         }
+         continue;
+      }
       int rc = crtl_read(STDIN_FILENO, g_crtl.buffer, sizeof(g_crtl.buffer));
       if(rc > 0) {
-         if(0 > crtl_process_input(g_crtl.fd_output, &g_crtl.out_file_size_cur, g_crtl.out_file_size_max, g_crtl.logical_block_size, g_crtl.buffer, rc)) {
+         if(0 > crtl_process_input(&g_crtl.output, g_crtl.buffer, rc)) {
             LOG_ERROR("%s: error processing stdin\n", __FUNCTION__);
             running = false;
          }
@@ -229,6 +626,41 @@ void crtl_main(void) {
    } while(running);
 }
 
+// Drain stdin into a ring while a separate thread collapses and writes the output file
+void crtl_main_ring(void) {
+   crtl_ring_writer_t writer;
+   if(!crtl_ring_writer_start(&writer, &g_crtl.output, g_crtl.ring_size, NULL)) {
+      LOG_ERROR("unable to start writer thread");
+      return;
+   }
+   if(g_crtl.drop && !crtl_ring_writer_drop(&writer, g_crtl.drop_rate)) {
+      LOG_WARN("unable to enable drop mode, blocking the input when the ring is full");
+   }
+   bool running = true;
+   do {
+      if(g_crtl.sig_quit) { // In case of sigquit, need to attempt one last read to flush all data to the file before exiting
+         running = false;
+      }
+      int rc = crtl_ring_writer_read(&writer, STDIN_FILENO);
+      if(rc < 0) {
+         int errsv = errno;
+         LOG_ERROR("error reading from stdin <%s>", strerror(errsv));
+         running = false;
+      } else if(rc == 0) {
+         running = false;
+      }
+   } while(running);
+   crtl_ring_writer_stop(&writer);
+}
+
+// Merge stdin and the other inputs into the output file
+void crtl_main_fanin(void) {
+   bool use_stdin = !isatty(STDIN_FILENO);
+   if(0 > crtl_fanin_run(&g_crtl.output, use_stdin, g_crtl.inputs, g_crtl.input_count, g_crtl.tag, &g_crtl.sig_quit)) {
+      LOG_ERROR("error processing inputs");
+   }
+}
+
 void crtl_signals_register(void) {
    struct sigaction action;
    action.sa_handler = crtl_signal_handler;
@@ -251,6 +683,11 @@ void crtl_signals_register(void) {
       int errsv = errno;
       LOG_ERROR("Unable to register for SIGQUIT. <%s>", strerror(errsv));
    }
+   LOG_DEBUG("Registering SIGUSR1...");
+   if(sigaction(SIGUSR1, &action, NULL) != 0) {
+      int errsv = errno;
+      LOG_ERROR("Unable to register for SIGUSR1. <%s>", strerror(errsv));
+   }
 }
 
 void crtl_signal_handler(int signal) {
@@ -266,6 +703,10 @@ void crtl_signal_handler(int signal) {
          g_crtl.sig_quit = true;
          break;
       }
+      case SIGUSR1: {
+         crtl_stats_dump(STDERR_FILENO);
+         break;
+      }
       default:
          LOG_DEBUG("Received unhandled signal %d", signal);
          break;
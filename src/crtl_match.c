@@ -0,0 +1,287 @@
+/**
+ * Copyright 2018 Comcast Cable Communications Management, LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Line routing.  Lines that contain any of a set of literal patterns are also written to a second output.  Patterns
+// are found with a vectorized filter: each block of input is compared with the first and the last byte of every pattern
+// at once, and only positions where both match are checked with memcmp.  Once a line matches the rest of it is skipped.
+// The partial last line of each buffer is kept until the rest of it arrives.  Callers serialize calls.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include "curtail.h"
+#include "crtl_private.h"
+
+#define CRTL_MATCH_PATTERNS_MAX (16)
+#define CRTL_MATCH_BUFFER       (64 * 1024)
+
+typedef struct {
+   const char *text;
+   uint32_t    length;
+} crtl_pattern_t;
+
+struct crtl_matcher_s {
+   crtl_output_t *output;                            // Where matching lines go
+   crtl_pattern_t patterns[CRTL_MATCH_PATTERNS_MAX];
+   uint32_t       pattern_count;
+   uint32_t       length_max;                        // Longest pattern
+   uint32_t       capacity;                          // Largest write to the output
+   char *         carry;                             // Partial last line of the input
+   uint32_t       carry_size;
+   char *         batch;                             // Matching lines not yet written
+   uint32_t       batch_size;
+};
+
+typedef const char *(*crtl_match_fn_t)(const crtl_matcher_t *matcher, const char *data, const char *end);
+
+// Position of the earliest pattern in [data, end) or NULL
+static const char *crtl_match_generic(const crtl_matcher_t *matcher, const char *data, const char *end) {
+   const char *first = NULL;
+   for(uint32_t index = 0; index < matcher->pattern_count; index++) {
+      const crtl_pattern_t *pattern = &matcher->patterns[index];
+      // Only a match before the first one so far matters
+      const char *limit = end;
+      if(first != NULL && first + pattern->length - 1 < end) {
+         limit = first + pattern->length - 1;
+      }
+      const char *found = memmem(data, limit - data, pattern->text, pattern->length);
+      if(found != NULL) {
+         first = found;
+      }
+   }
+   return(first);
+}
+
+// Check the candidates in mask, a bit per position from data, and return the first real match
+static inline const char *crtl_match_verify(const crtl_matcher_t *matcher, const char *data, uint32_t mask) {
+   while(mask != 0) {
+      const char *position = data + __builtin_ctz(mask);
+      for(uint32_t index = 0; index < matcher->pattern_count; index++) {
+         const crtl_pattern_t *pattern = &matcher->patterns[index];
+         if(position[0] == pattern->text[0] && 0 == memcmp(position, pattern->text, pattern->length)) {
+            return(position);
+         }
+      }
+      mask &= mask - 1;
+   }
+   return(NULL);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+static const char *crtl_match_sse2(const crtl_matcher_t *matcher, const char *data, const char *end) {
+   // Loads reach length_max - 1 bytes past the block, so the remainder is left to the generic matcher
+   for(; end - data >= 16 + matcher->length_max; data += 16) {
+      uint32_t mask = 0;
+      for(uint32_t index = 0; index < matcher->pattern_count; index++) {
+         const crtl_pattern_t *pattern = &matcher->patterns[index];
+         __m128i first = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)data), _mm_set1_epi8(pattern->text[0]));
+         __m128i last  = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + pattern->length - 1)), _mm_set1_epi8(pattern->text[pattern->length - 1]));
+         mask |= _mm_movemask_epi8(_mm_and_si128(first, last));
+      }
+      const char *found = (mask != 0) ? crtl_match_verify(matcher, data, mask) : NULL;
+      if(found != NULL) {
+         return(found);
+      }
+   }
+   return(crtl_match_generic(matcher, data, end));
+}
+
+__attribute__((target("avx2")))
+static const char *crtl_match_avx2(const crtl_matcher_t *matcher, const char *data, const char *end) {
+   for(; end - data >= 32 + matcher->length_max; data += 32) {
+      uint32_t mask = 0;
+      for(uint32_t index = 0; index < matcher->pattern_count; index++) {
+         const crtl_pattern_t *pattern = &matcher->patterns[index];
+         __m256i first = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)data), _mm256_set1_epi8(pattern->text[0]));
+         __m256i last  = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(data + pattern->length - 1)), _mm256_set1_epi8(pattern->text[pattern->length - 1]));
+         mask |= _mm256_movemask_epi8(_mm256_and_si256(first, last));
+      }
+      const char *found = (mask != 0) ? crtl_match_verify(matcher, data, mask) : NULL;
+      if(found != NULL) {
+         return(found);
+      }
+   }
+   return(crtl_match_sse2(matcher, data, end));
+}
+#endif
+
+static crtl_match_fn_t g_match = crtl_match_generic;
+
+crtl_matcher_t *crtl_match_open(char **patterns, uint32_t pattern_count, crtl_output_t *output) {
+   if(pattern_count == 0 || pattern_count > CRTL_MATCH_PATTERNS_MAX) {
+      LOG_ERROR("between 1 and %u patterns can be matched", CRTL_MATCH_PATTERNS_MAX);
+      return(NULL);
+   }
+   crtl_matcher_t *matcher = calloc(1, sizeof(crtl_matcher_t));
+   if(matcher == NULL) {
+      LOG_ERROR("unable to allocate matcher");
+      return(NULL);
+   }
+   for(uint32_t index = 0; index < pattern_count; index++) {
+      crtl_pattern_t *pattern = &matcher->patterns[index];
+      pattern->text   = patterns[index];
+      pattern->length = strlen(patterns[index]);
+      if(pattern->length == 0 || NULL != memchr(pattern->text, '\n', pattern->length)) {
+         LOG_ERROR("invalid pattern <%s>", patterns[index]);
+         free(matcher);
+         return(NULL);
+      }
+      if(pattern->length > matcher->length_max) {
+         matcher->length_max = pattern->length;
+      }
+   }
+   matcher->pattern_count = pattern_count;
+   matcher->output        = output;
+   matcher->capacity      = CRTL_MATCH_BUFFER;
+   if(matcher->capacity > output->size_max / 2) { // Like the ring writer, never write more than half the file at once
+      matcher->capacity = output->size_max / 2;
+   }
+   matcher->carry = malloc(CRTL_MATCH_BUFFER);
+   matcher->batch = malloc(matcher->capacity);
+   if(matcher->carry == NULL || matcher->batch == NULL) {
+      LOG_ERROR("unable to allocate matcher");
+      crtl_match_close(matcher);
+      return(NULL);
+   }
+#if defined(__x86_64__) || defined(__i386__)
+   __builtin_cpu_init();
+   if(__builtin_cpu_supports("avx2")) {
+      g_match = crtl_match_avx2;
+   } else if(__builtin_cpu_supports("sse2")) {
+      g_match = crtl_match_sse2;
+   }
+#endif
+   return(matcher);
+}
+
+static int crtl_match_flush(crtl_matcher_t *matcher) {
+   int rc = 0;
+   if(matcher->batch_size > 0) {
+      rc = crtl_process_write(matcher->output, matcher->batch, matcher->batch_size);
+      matcher->batch_size = 0;
+   }
+   return(rc);
+}
+
+// Queue a matching line for the output
+static int crtl_match_emit(crtl_matcher_t *matcher, const char *line, uint32_t length) {
+   if(length > matcher->capacity - matcher->batch_size && 0 > crtl_match_flush(matcher)) {
+      return(-1);
+   }
+   if(length > matcher->capacity) { // Too long to batch
+      for(uint32_t written = 0; written < length; written += matcher->capacity) {
+         uint32_t size = (length - written < matcher->capacity) ? length - written : matcher->capacity;
+         if(0 > crtl_process_write(matcher->output, line + written, size)) {
+            return(-1);
+         }
+      }
+      return(0);
+   }
+   memcpy(matcher->batch + matcher->batch_size, line, length);
+   matcher->batch_size += length;
+   return(0);
+}
+
+// Emit the lines of [data, end) that match.  end is just past a newline or the end of a line split by the carry.
+static int crtl_match_lines(crtl_matcher_t *matcher, const char *data, const char *end) {
+   while(data < end) {
+      const char *found = g_match(matcher, data, end);
+      if(found == NULL) {
+         break;
+      }
+      const char *previous = memrchr(data, '\n', found - data);
+      const char *start    = (previous != NULL) ? previous + 1 : data;
+      const char *newline  = crtl_scan_newline(found, end);
+      const char *next    = (newline != NULL) ? newline + 1 : end;
+      if(0 > crtl_match_emit(matcher, start, next - start)) {
+         return(-1);
+      }
+      data = next;
+   }
+   return(0);
+}
+
+// Route the lines of data that match to the matcher's output.  Returns 0 or -1 if the output failed.
+int crtl_match_input(crtl_matcher_t *matcher, const char *buffer, uint32_t data_size) {
+   const char *end = buffer + data_size;
+   const char *ptr = buffer;
+   if(matcher->carry_size > 0) { // Complete the partial line from the last buffer
+      const char *newline = crtl_scan_newline(ptr, end);
+      const char *next    = (newline != NULL) ? newline + 1 : end;
+      while(ptr < next) {
+         uint32_t length = CRTL_MATCH_BUFFER - matcher->carry_size;
+         if(length > (uint32_t)(next - ptr)) {
+            length = next - ptr;
+         }
+         memcpy(matcher->carry + matcher->carry_size, ptr, length);
+         matcher->carry_size += length;
+         ptr                 += length;
+         if(newline == NULL && matcher->carry_size < CRTL_MATCH_BUFFER) {
+            return(0);
+         }
+         // The line is complete or as long as the carry holds, which is matched on its own
+         int rc = crtl_match_lines(matcher, matcher->carry, matcher->carry + matcher->carry_size);
+         matcher->carry_size = 0;
+         if(rc < 0) {
+            return(-1);
+         }
+      }
+   }
+   const char *last = memrchr(ptr, '\n', end - ptr);
+   const char *tail = (last != NULL) ? last + 1 : ptr;
+   if(0 > crtl_match_lines(matcher, ptr, tail)) {
+      return(-1);
+   }
+   while(tail < end) { // Keep the partial last line
+      uint32_t length = CRTL_MATCH_BUFFER - matcher->carry_size;
+      if(length > (uint32_t)(end - tail)) {
+         length = end - tail;
+      }
+      memcpy(matcher->carry + matcher->carry_size, tail, length);
+      matcher->carry_size += length;
+      tail                += length;
+      if(matcher->carry_size == CRTL_MATCH_BUFFER) {
+         int rc = crtl_match_lines(matcher, matcher->carry, matcher->carry + matcher->carry_size);
+         matcher->carry_size = 0;
+         if(rc < 0) {
+            return(-1);
+         }
+      }
+   }
+   return(crtl_match_flush(matcher));
+}
+
+// Match what is left of the input and free the matcher
+void crtl_match_close(crtl_matcher_t *matcher) {
+   if(matcher == NULL) {
+      return;
+   }
+   if(matcher->carry != NULL && matcher->batch != NULL && matcher->carry_size > 0) {
+      crtl_match_lines(matcher, matcher->carry, matcher->carry + matcher->carry_size);
+      crtl_match_flush(matcher);
+   }
+   free(matcher->carry);
+   free(matcher->batch);
+   free(matcher);
+}
@@ -23,6 +23,10 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <semaphore.h>
+#include <pthread.h>
 #include <sys/stat.h>
 
 #ifndef DEFAULT_SECTOR_SIZE
@@ -31,13 +35,156 @@
 
 #define LOGR_LOG_SIZE_MAX_DEFAULT (4 * DEFAULT_SECTOR_SIZE)
 
+// Largest amount of data moved by a single splice from the input pipe
+#define CRTL_SPLICE_SIZE_MAX (1024 * 1024)
+
+// Limits of the ring between the input reader and output writer threads
+#define CRTL_RING_SIZE_MIN (4096)
+#define CRTL_RING_SIZE_MAX (1024 * 1024 * 1024)
+
+// Ring size used by drop mode when none is given
+#define CRTL_RING_SIZE_DROP (16 * 1024 * 1024)
+
+// Ring size used by crash capture when none is given
+#define CRTL_RING_SIZE_CRASH (1024 * 1024)
+
+// Longest "[curtail: N bytes dropped]" marker
+#define CRTL_DROPPED_MARKER_MAX (64)
+
 #ifdef __cplusplus
 extern "C"
 {
 #endif
 
+typedef struct crtl_lines_s crtl_lines_t;
+typedef struct crtl_compress_s crtl_compress_t;
+typedef struct crtl_syncer_s crtl_syncer_t;
+typedef struct crtl_stamp_s crtl_stamp_t;
+typedef struct crtl_matcher_s crtl_matcher_t;
+typedef struct crtl_offsets_s crtl_offsets_t;
+typedef struct crtl_segments_s crtl_segments_t;
+typedef struct crtl_watcher_s crtl_watcher_t;
+typedef struct crtl_output_s crtl_output_t;
+
+struct crtl_output_s {
+   int              fd;
+   uint32_t         block_size;    // Granularity of collapse operations
+   uint64_t         size_cur;
+   uint64_t         size_max;      // High watermark, the file never grows beyond this
+   uint64_t         size_low;      // Low watermark, the size the file is collapsed to once the high watermark is reached
+   pthread_mutex_t *lock;          // Serializes writers when the output is shared between threads (NULL if not shared)
+   crtl_storage_t   storage;
+   uint32_t         ring_offset;   // Ring file only: start of the data area
+   uint64_t         ring_capacity; // Ring file only: size of the data area
+   uint64_t         ring_head;     // Ring file only: logical offset of the oldest byte
+   uint64_t         ring_tail;     // Ring file only: logical offset of the end of the data
+   char *           map;           // Mmap storage only: the whole file
+   uint32_t         msync_ms;      // Mmap storage only: interval between asynchronous msyncs
+   uint64_t         msync_time;    // Mmap storage only: time of the last msync in milliseconds
+   uint32_t         segment_count; // Segment storage only: number of segment files of a new index (0 for 4)
+   crtl_segments_t *segments;      // Segment storage only: the index, fd is the segment being written
+   bool             line_head;     // Keep track of where the first complete line starts
+   uint64_t         collapsed;     // Collapse storage only: bytes removed from the start since the file was opened
+   crtl_lines_t *   lines;         // Line starts when line_head is set
+   bool             publish;       // Collapse storage only: publish the bytes collapsed over the life of the file
+   crtl_offsets_t * offsets;       // Publishes the bytes collapsed for followers when publish is set
+   bool             compress;      // Collapse storage only: write compressed frames
+   uint32_t         compress_threads;
+   crtl_compress_t *compressor;    // Frame compression when compress is set
+   crtl_sync_t      sync;          // Durability policy
+   uint64_t         sync_bytes;
+   uint32_t         sync_ms;
+   crtl_syncer_t *  syncer;        // Background sync thread when sync is set
+   crtl_cache_t     cache;         // Page cache footprint control
+   bool             prealloc;      // Collapse storage only: keep the space up to size_max reserved beyond the end of the file
+   uint64_t         prealloc_end;  // Prealloc only: end of the reserved space
+   bool             stats_extents; // Keep the extent count in the statistics, which hold a single count for the main output
+   char *           staging;       // Direct I/O only: block aligned buffer, starts with the partial final block
+   uint32_t         staging_size;
+   uint64_t         cache_pending; // Dontneed only: bytes written since the last advice
+   bool             timestamp;     // Prefix each line with the time it is written
+   crtl_stamp_t *   stamp;         // Line timestamps when timestamp is set
+   crtl_output_t *  tee;           // Next output that gets a copy of everything written to this one (NULL for none)
+   int              tee_pipe[2];   // Tee target only: holds data duplicated from the input pipe until it is spliced
+   crtl_matcher_t * matcher;       // Lines that match are also written to the matcher's output (NULL for none)
+};
+
+// Ring and mmap storage share the ring file format
+#define CRTL_STORAGE_IS_RING(output) ((output)->storage == CRTL_STORAGE_RING || (output)->storage == CRTL_STORAGE_MMAP)
+
+// Ring data and counters in shared memory, where another process can find what the consumer has not released
+typedef struct {
+   _Atomic uint64_t head;
+   _Atomic uint64_t tail;
+   char             data[];
+} crtl_ring_shared_t;
+
+typedef struct {
+   char *               data;
+   uint32_t             size;
+   _Atomic uint64_t     head;             // Total bytes committed by the producer
+   _Atomic uint64_t     tail;             // Total bytes released by the consumer
+   crtl_ring_shared_t * shared;           // The counters are mirrored here when the data is shared (NULL if not)
+   atomic_bool          producer_waiting;
+   atomic_bool          consumer_waiting;
+   atomic_bool          closed;
+   sem_t                space;
+   sem_t                data_ready;
+} crtl_ring_t;
+
+typedef struct {
+   crtl_ring_t    ring;
+   crtl_output_t *output;
+   pthread_t      thread;
+   atomic_bool    failed;
+   bool           drop;        // Overload mode: drop whole lines instead of blocking the input when the ring is full
+   uint64_t       drop_rate;   // Drop mode only: token bucket rate in bytes per second (0 for unlimited)
+   uint64_t       drop_tokens;
+   uint64_t       drop_clock;  // Drop mode only: time of the last token refill (crtl_stats_clock)
+   uint64_t       dropped;     // Drop mode only: bytes dropped since the last marker
+   char *         carry;       // Drop mode only: input not yet queued, ends with a partial line
+   uint32_t       carry_size;
+} crtl_ring_writer_t;
+
+typedef enum {
+   CRTL_STAT_BYTES_IN        = 0,
+   CRTL_STAT_BYTES_WRITTEN   = 1,
+   CRTL_STAT_BYTES_COLLAPSED = 2,
+   CRTL_STAT_COLLAPSES       = 3,
+   CRTL_STAT_SHORT_WRITES    = 4,
+   CRTL_STAT_ERRORS          = 5,
+   CRTL_STAT_BYTES_DROPPED   = 6,
+   CRTL_STAT_QTY
+} crtl_stat_t;
+
+typedef enum {
+   CRTL_STAT_OP_READ      = 0,
+   CRTL_STAT_OP_WRITE     = 1,
+   CRTL_STAT_OP_FALLOCATE = 2,
+   CRTL_STAT_OP_SYNC      = 3,
+   CRTL_STAT_OP_QTY
+} crtl_stat_op_t;
+
+// Values that are set rather than added to
+typedef enum {
+   CRTL_GAUGE_EXTENTS = 0,
+   CRTL_GAUGE_QTY
+} crtl_gauge_t;
+
+void     crtl_stats_add(crtl_stat_t stat, uint64_t value);
+void     crtl_stats_set(crtl_gauge_t gauge, uint64_t value);
+uint64_t crtl_stats_clock(void);
+void     crtl_stats_time(crtl_stat_op_t op, uint64_t start);
+int      crtl_stats_dump(int fd);
+bool     crtl_stats_file_start(const char *path, uint32_t interval_ms);
+void     crtl_stats_file_stop(void);
+
 bool        crtl_log_enabled(crtl_log_level_t level);
 const char *crtl_log_level_str(crtl_log_level_t level);
+uint64_t    crtl_parse_size(char *arg);
+int         crtl_parse_spec_size(char *spec, uint64_t *size);
+const char *crtl_engine_str(crtl_engine_t engine);
+bool        crtl_engine_parse(const char *str, crtl_engine_t *engine);
 
 #define LOG_DEBUG(FORMAT, ...); do {if(crtl_log_enabled(CRTL_LEVEL_DEBUG)) { fprintf(stderr, "%s: " FORMAT "\n", __FUNCTION__, ##__VA_ARGS__);}} while(0)
 #define LOG_INFO(FORMAT, ...);  do {if(crtl_log_enabled(CRTL_LEVEL_INFO))  { fprintf(stderr, "%s: " FORMAT "\n", __FUNCTION__, ##__VA_ARGS__);}} while(0)
@@ -51,10 +198,127 @@ int   crtl_read(int fd, void *buf, size_t count);
 int   crtl_fallocate(int fd, int mode, off_t offset, off_t len);
 off_t crtl_seek(int fd, off_t offset, int whence);
 int   crtl_write(int fd, const void *buf, size_t count);
+int   crtl_pread(int fd, void *buf, size_t count, off_t offset);
+int   crtl_pwrite(int fd, const void *buf, size_t count, off_t offset);
+int   crtl_splice(int fd_in, int fd_out, loff_t *off_out, size_t len, unsigned int flags);
+int   crtl_tee(int fd_in, int fd_out, size_t len);
+int   crtl_ioctl(int fd, unsigned long request, void *arg);
+int   crtl_poll(struct pollfd *fds, nfds_t nfds, int timeout);
 
-bool  crtl_file_open(const char *filename, int *fd, uint32_t *block_size, uint64_t *file_size);
+bool  crtl_file_open(const char *filename, crtl_output_t *output);
 void  crtl_file_close(int *fd);
-int   crtl_process_input(int fd, uint64_t *file_size_cur, uint64_t file_size_max, uint32_t logical_block_size, const char *buffer, uint32_t data_size);
+void  crtl_file_limits(crtl_output_t *output);
+void  crtl_file_written(crtl_output_t *output, const char *buffer, uint32_t size);
+int   crtl_file_append(crtl_output_t *output, const char *buffer, uint32_t data_size);
+void  crtl_file_collapsing(crtl_output_t *output, uint64_t length);
+void  crtl_file_collapsed(crtl_output_t *output, uint64_t length);
+void  crtl_output_written(crtl_output_t *output, uint64_t size);
+uint64_t crtl_file_collapse_length(const crtl_output_t *output, uint32_t data_size);
+bool  crtl_fd_is_pipe(int fd);
+void  crtl_output_lock(crtl_output_t *output);
+void  crtl_output_unlock(crtl_output_t *output);
+void  crtl_output_settings(crtl_output_t *output, const crtl_output_t *settings);
+int   crtl_process_input(crtl_output_t *output, const char *buffer, uint32_t data_size);
+int   crtl_process_write(crtl_output_t *output, const char *buffer, uint32_t data_size);
+int   crtl_process_output(crtl_output_t *output, const char *buffer, uint32_t data_size);
+int   crtl_process_splice(int fd_input, crtl_output_t *output);
+int   crtl_process_dropped(crtl_output_t *output, uint64_t size);
+uint32_t crtl_dropped_marker(char *marker, size_t marker_size, uint64_t size);
+
+const char *crtl_storage_str(crtl_storage_t storage);
+bool  crtl_storage_parse(const char *str, crtl_storage_t *storage);
+bool  crtl_storage_open(const char *filename, crtl_output_t *output);
+int   crtl_storage_reserve(crtl_output_t *output, uint32_t *data_size, off_t *offset);
+int   crtl_storage_commit(crtl_output_t *output, uint32_t data_size);
+int   crtl_storage_write(crtl_output_t *output, const char *buffer, uint32_t data_size);
+int   crtl_storage_sync(crtl_output_t *output);
+void  crtl_storage_close(crtl_output_t *output);
+int   crtl_storage_cat(const char *filename, int fd);
+bool  crtl_storage_detect(int fd);
+
+bool  crtl_segment_open(const char *filename, crtl_output_t *output);
+int   crtl_segment_write(crtl_output_t *output, const char *buffer, uint32_t data_size);
+int   crtl_segment_sync(crtl_segments_t *segments);
+void  crtl_segment_close(crtl_output_t *output);
+bool  crtl_segment_detect(int fd);
+int   crtl_segment_cat(const char *filename, int fd_index, int fd);
+
+void          crtl_scan_init(void);
+const char *  crtl_scan_newline(const char *data, const char *end);
+crtl_lines_t *crtl_lines_open(const char *filename, int fd, uint64_t size_max, uint32_t granularity);
+void          crtl_lines_close(crtl_lines_t *lines);
+void          crtl_lines_add(crtl_lines_t *lines, uint64_t position, const char *data, uint32_t size);
+uint64_t      crtl_lines_first(const crtl_lines_t *lines, uint64_t position, uint64_t end);
+int           crtl_lines_publish(crtl_lines_t *lines, int fd, uint64_t offset);
+
+const char *   crtl_sync_str(crtl_sync_t sync);
+bool           crtl_sync_parse(const char *str, crtl_sync_t *sync);
+crtl_syncer_t *crtl_sync_open(crtl_output_t *output);
+void           crtl_sync_close(crtl_syncer_t *syncer);
+void           crtl_sync_written(crtl_syncer_t *syncer, uint64_t size);
+
+crtl_stamp_t *crtl_stamp_open(void);
+void          crtl_stamp_close(crtl_stamp_t *stamp);
+int           crtl_stamp_input(crtl_stamp_t *stamp, crtl_output_t *output, const char *buffer, uint32_t data_size);
+
+crtl_matcher_t *crtl_match_open(char **patterns, uint32_t pattern_count, crtl_output_t *output);
+void            crtl_match_close(crtl_matcher_t *matcher);
+int             crtl_match_input(crtl_matcher_t *matcher, const char *buffer, uint32_t data_size);
+
+crtl_offsets_t *crtl_offsets_open(const char *filename, int fd);
+void            crtl_offsets_close(crtl_offsets_t *offsets);
+int             crtl_offsets_publish(crtl_offsets_t *offsets, int fd, uint64_t collapsed, uint64_t pending);
+int             crtl_follow_run(const char *filename, int fd);
+
+const char *crtl_cache_str(crtl_cache_t cache);
+bool        crtl_cache_parse(const char *str, crtl_cache_t *cache);
+bool        crtl_cache_open(crtl_output_t *output);
+void        crtl_cache_close(crtl_output_t *output);
+int         crtl_cache_write(crtl_output_t *output, const char *buffer, uint32_t data_size);
+void        crtl_cache_written(crtl_output_t *output, uint64_t size);
+
+crtl_compress_t *crtl_compress_open(crtl_output_t *output, uint32_t thread_count);
+void             crtl_compress_close(crtl_compress_t *compress);
+bool             crtl_compress_detect(int fd);
+int              crtl_compress_input(crtl_compress_t *compress, const char *buffer, uint32_t data_size);
+int              crtl_compress_flush(crtl_compress_t *compress);
+uint64_t         crtl_compress_collapse_length(const crtl_compress_t *compress, uint64_t length, uint64_t size_cur);
+void             crtl_compress_collapsed(crtl_compress_t *compress, uint64_t length);
+int              crtl_compress_cat(int fd_file, int fd);
+
+int   crtl_uring_run(int fd_input, int fd_event, crtl_output_t *output);
+
+int   crtl_fanin_run(crtl_output_t *output, bool use_stdin, char **specs, uint32_t spec_count, bool tag, const bool *quit);
+
+int   crtl_daemon_run(const char *socket_path, char **specs, uint32_t spec_count, const crtl_output_t *defaults, crtl_engine_t engine, const bool *quit);
+int   crtl_daemon_attach(const char *socket_path, const char *filename, const crtl_output_t *limits);
+
+bool        crtl_ring_init(crtl_ring_t *ring, uint32_t size, crtl_ring_shared_t *shared);
+void        crtl_ring_free(crtl_ring_t *ring);
+char *      crtl_ring_write_ptr(crtl_ring_t *ring, uint32_t *length, bool block);
+void        crtl_ring_commit(crtl_ring_t *ring, uint32_t length);
+uint32_t    crtl_ring_write(crtl_ring_t *ring, const char *data, uint32_t size, bool block);
+bool        crtl_ring_put(crtl_ring_t *ring, const void *part1, uint32_t size1, const void *part2, uint32_t size2);
+bool        crtl_ring_peek(crtl_ring_t *ring, void *data, uint32_t size);
+const char *crtl_ring_read_ptr(crtl_ring_t *ring, uint32_t *length);
+void        crtl_ring_release(crtl_ring_t *ring, uint32_t length);
+uint32_t    crtl_ring_used(crtl_ring_t *ring);
+void        crtl_ring_close(crtl_ring_t *ring);
+void *      crtl_ring_writer(void *param);
+bool        crtl_ring_writer_start(crtl_ring_writer_t *writer, crtl_output_t *output, uint32_t size, crtl_ring_shared_t *shared);
+bool        crtl_ring_writer_drop(crtl_ring_writer_t *writer, uint64_t rate);
+void        crtl_ring_writer_stop(crtl_ring_writer_t *writer);
+int         crtl_ring_writer_read(crtl_ring_writer_t *writer, int fd);
+
+crtl_watcher_t *    crtl_watch_start(const char *filename, const crtl_output_t *limits, int fd_input, int fd_input_wr, uint32_t size);
+crtl_ring_shared_t *crtl_watch_ring(crtl_watcher_t *watcher);
+void                crtl_watch_stop(crtl_watcher_t *watcher);
+
+bool  crtl_thread_buffers_init(uint32_t size, bool ordered, void (*wakeup)(void));
+void  crtl_thread_buffers_term(void);
+bool  crtl_thread_buffers_active(void);
+int   crtl_thread_buffer_write(const void *buf, size_t len);
+int   crtl_thread_buffers_drain(crtl_output_t *output);
 
 #ifdef __cplusplus
 }
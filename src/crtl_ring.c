@@ -0,0 +1,384 @@
+/**
+ * Copyright 2018 Comcast Cable Communications Management, LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Single producer, single consumer byte ring.  The producer and consumer only share the head and tail counters so
+// neither side takes a lock to move data.  A side only sleeps on its semaphore when the ring is full (producer) or
+// empty (consumer) and the other side posts the semaphore only if it sees the sleeper's waiting flag.
+//
+// In drop mode the reader thread never waits for the writer, so a slow disk never blocks the program writing to the
+// input.  Input is queued whole lines at a time; lines that don't fit in the ring, or exceed the token bucket rate, are
+// dropped and counted, and a single marker with the count is queued ahead of the next lines that fit.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <pthread.h>
+#include "curtail.h"
+#include "crtl_private.h"
+
+// Largest amount read from the input at a time in drop mode, longer lines are split
+#define CRTL_RING_DROP_READ (64 * 1024)
+
+// Set up a ring of size bytes, in shared->data when shared is not NULL
+bool crtl_ring_init(crtl_ring_t *ring, uint32_t size, crtl_ring_shared_t *shared) {
+   memset(ring, 0, sizeof(*ring));
+   ring->data = (shared != NULL) ? shared->data : malloc(size);
+   if(ring->data == NULL) {
+      LOG_ERROR("unable to allocate %u byte ring", size);
+      return(false);
+   }
+   memset(ring->data, 0, size); // Fault in the pages up front
+   ring->size   = size;
+   ring->shared = shared;
+   if(shared != NULL) {
+      atomic_store(&shared->head, 0);
+      atomic_store(&shared->tail, 0);
+   }
+   atomic_init(&ring->head, 0);
+   atomic_init(&ring->tail, 0);
+   atomic_init(&ring->producer_waiting, false);
+   atomic_init(&ring->consumer_waiting, false);
+   atomic_init(&ring->closed, false);
+   sem_init(&ring->space, 0, 0);
+   sem_init(&ring->data_ready, 0, 0);
+   return(true);
+}
+
+void crtl_ring_free(crtl_ring_t *ring) {
+   if(ring->data != NULL) {
+      sem_destroy(&ring->space);
+      sem_destroy(&ring->data_ready);
+      if(ring->shared == NULL) {
+         free(ring->data);
+      }
+      ring->data = NULL;
+   }
+}
+
+static void crtl_ring_sem_wait(sem_t *sem) {
+   while(sem_wait(sem) != 0 && errno == EINTR) {
+   }
+}
+
+// Contiguous free space available to the producer.  Blocks until there is space unless the ring is closed.
+char *crtl_ring_write_ptr(crtl_ring_t *ring, uint32_t *length, bool block) {
+   uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+   do {
+      uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+      uint32_t free_size = ring->size - (uint32_t)(head - tail);
+      if(free_size > 0 || !block || atomic_load(&ring->closed)) {
+         uint32_t offset = head % ring->size;
+         if(free_size > ring->size - offset) {
+            free_size = ring->size - offset;
+         }
+         *length = free_size;
+         return(ring->data + offset);
+      }
+      // Ring is full, sleep until the consumer releases space
+      atomic_store(&ring->producer_waiting, true);
+      if((uint32_t)(head - atomic_load(&ring->tail)) < ring->size || atomic_load(&ring->closed)) {
+         atomic_store(&ring->producer_waiting, false);
+         continue;
+      }
+      crtl_ring_sem_wait(&ring->space);
+   } while(1);
+}
+
+void crtl_ring_commit(crtl_ring_t *ring, uint32_t length) {
+   uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+   atomic_store(&ring->head, head + length);
+   if(ring->shared != NULL) {
+      atomic_store(&ring->shared->head, head + length);
+   }
+   if(atomic_exchange(&ring->consumer_waiting, false)) {
+      sem_post(&ring->data_ready);
+   }
+}
+
+// Copy data into the ring, blocking until all of it fits unless the ring is closed.  Returns the number of bytes copied.
+uint32_t crtl_ring_write(crtl_ring_t *ring, const char *data, uint32_t size, bool block) {
+   uint32_t written = 0;
+   while(written < size) {
+      uint32_t length;
+      char *ptr = crtl_ring_write_ptr(ring, &length, block);
+      if(length == 0) {
+         break;
+      }
+      if(length > size - written) {
+         length = size - written;
+      }
+      memcpy(ptr, data + written, length);
+      crtl_ring_commit(ring, length);
+      written += length;
+   }
+   return(written);
+}
+
+static void crtl_ring_copy_in(crtl_ring_t *ring, uint64_t position, const void *data, uint32_t size) {
+   uint32_t offset = position % ring->size;
+   uint32_t first  = ring->size - offset;
+   if(first > size) {
+      first = size;
+   }
+   memcpy(ring->data + offset, data, first);
+   memcpy(ring->data, (const char *)data + first, size - first);
+}
+
+// Copy a record made of two parts into the ring and publish it all at once so the consumer never sees part of it.
+// Never blocks, returns false if the record does not fit.
+bool crtl_ring_put(crtl_ring_t *ring, const void *part1, uint32_t size1, const void *part2, uint32_t size2) {
+   uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+   uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+   if((uint64_t)size1 + size2 > ring->size - (uint32_t)(head - tail)) {
+      return(false);
+   }
+   crtl_ring_copy_in(ring, head, part1, size1);
+   crtl_ring_copy_in(ring, head + size1, part2, size2);
+   crtl_ring_commit(ring, size1 + size2);
+   return(true);
+}
+
+// Copy the first size bytes available to the consumer without releasing them.  Never blocks, returns false if less
+// than size bytes are available.
+bool crtl_ring_peek(crtl_ring_t *ring, void *data, uint32_t size) {
+   uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+   uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+   if((uint32_t)(head - tail) < size) {
+      return(false);
+   }
+   uint32_t offset = tail % ring->size;
+   uint32_t first  = ring->size - offset;
+   if(first > size) {
+      first = size;
+   }
+   memcpy(data, ring->data + offset, first);
+   memcpy((char *)data + first, ring->data, size - first);
+   return(true);
+}
+
+// Contiguous data available to the consumer.  Blocks until data is available.  Returns NULL once the ring is closed
+// and empty.
+const char *crtl_ring_read_ptr(crtl_ring_t *ring, uint32_t *length) {
+   uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+   do {
+      uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+      uint32_t used = (uint32_t)(head - tail);
+      if(used > 0) {
+         uint32_t offset = tail % ring->size;
+         if(used > ring->size - offset) {
+            used = ring->size - offset;
+         }
+         *length = used;
+         return(ring->data + offset);
+      }
+      if(atomic_load(&ring->closed)) {
+         *length = 0;
+         return(NULL);
+      }
+      // Ring is empty, sleep until the producer commits data
+      atomic_store(&ring->consumer_waiting, true);
+      if(atomic_load(&ring->head) != tail || atomic_load(&ring->closed)) {
+         atomic_store(&ring->consumer_waiting, false);
+         continue;
+      }
+      crtl_ring_sem_wait(&ring->data_ready);
+   } while(1);
+}
+
+void crtl_ring_release(crtl_ring_t *ring, uint32_t length) {
+   uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+   atomic_store(&ring->tail, tail + length);
+   if(ring->shared != NULL) {
+      atomic_store(&ring->shared->tail, tail + length);
+   }
+   if(atomic_exchange(&ring->producer_waiting, false)) {
+      sem_post(&ring->space);
+   }
+}
+
+uint32_t crtl_ring_used(crtl_ring_t *ring) {
+   return((uint32_t)(atomic_load(&ring->head) - atomic_load(&ring->tail)));
+}
+
+// Wake both sides.  The consumer drains what is left and then sees the end of the ring.
+void crtl_ring_close(crtl_ring_t *ring) {
+   atomic_store(&ring->closed, true);
+   sem_post(&ring->data_ready);
+   sem_post(&ring->space);
+}
+
+// Writer thread.  Takes data from the ring and performs the collapse and write so that disk latency never stalls the
+// thread draining the input.
+void *crtl_ring_writer(void *param) {
+   crtl_ring_writer_t *writer = param;
+   uint32_t length;
+   const char *data;
+   while(NULL != (data = crtl_ring_read_ptr(&writer->ring, &length))) {
+      if(length > writer->output->size_max / 2) {
+         length = writer->output->size_max / 2;
+      }
+      if(!atomic_load(&writer->failed)) {
+         if(0 > crtl_process_input(writer->output, data, length)) {
+            LOG_ERROR("error processing input, stopping");
+            atomic_store(&writer->failed, true);
+            crtl_ring_close(&writer->ring);
+         }
+      }
+      crtl_ring_release(&writer->ring, length);
+   }
+   return(NULL);
+}
+
+bool crtl_ring_writer_start(crtl_ring_writer_t *writer, crtl_output_t *output, uint32_t size, crtl_ring_shared_t *shared) {
+   if(!crtl_ring_init(&writer->ring, size, shared)) {
+      return(false);
+   }
+   writer->output     = output;
+   writer->drop       = false;
+   writer->carry      = NULL;
+   writer->carry_size = 0;
+   atomic_init(&writer->failed, false);
+   if(0 != pthread_create(&writer->thread, NULL, crtl_ring_writer, writer)) {
+      LOG_ERROR("unable to create writer thread");
+      crtl_ring_free(&writer->ring);
+      return(false);
+   }
+   LOG_DEBUG("writer thread started with a %u byte ring", size);
+   return(true);
+}
+
+// Switch the reader to drop mode, limited to rate bytes per second when rate is not 0
+bool crtl_ring_writer_drop(crtl_ring_writer_t *writer, uint64_t rate) {
+   writer->carry = malloc(CRTL_RING_DROP_READ);
+   if(writer->carry == NULL) {
+      LOG_ERROR("unable to allocate drop buffer");
+      return(false);
+   }
+   writer->drop        = true;
+   writer->drop_rate   = rate;
+   writer->drop_tokens = rate;
+   writer->drop_clock  = crtl_stats_clock();
+   writer->dropped     = 0;
+   writer->carry_size  = 0;
+   LOG_DEBUG("dropping input on overload, rate %" PRIu64 " bytes per second", rate);
+   return(true);
+}
+
+// Let the writer drain the ring and wait for it to exit
+void crtl_ring_writer_stop(crtl_ring_writer_t *writer) {
+   if(writer->drop) { // The input has ended, so the rest can wait for room
+      char marker[CRTL_DROPPED_MARKER_MAX];
+      if(writer->dropped > 0) {
+         crtl_ring_write(&writer->ring, marker, crtl_dropped_marker(marker, sizeof(marker), writer->dropped), true);
+      }
+      crtl_ring_write(&writer->ring, writer->carry, writer->carry_size, true);
+      free(writer->carry);
+      writer->carry = NULL;
+   }
+   crtl_ring_close(&writer->ring);
+   pthread_join(writer->thread, NULL);
+   crtl_ring_free(&writer->ring);
+}
+
+// Queue the whole lines in data that fit in the ring and the token bucket, and drop the rest
+static void crtl_ring_writer_queue(crtl_ring_writer_t *writer, const char *data, uint32_t size) {
+   uint64_t space = writer->ring.size - crtl_ring_used(&writer->ring);
+   if(writer->drop_rate > 0) {
+      uint64_t now     = crtl_stats_clock();
+      uint64_t elapsed = now - writer->drop_clock;
+      if(elapsed > 1000000000) { // The bucket holds one second
+         elapsed = 1000000000;
+      }
+      writer->drop_tokens += elapsed * writer->drop_rate / 1000000000;
+      if(writer->drop_tokens > writer->drop_rate) {
+         writer->drop_tokens = writer->drop_rate;
+      }
+      writer->drop_clock = now;
+      if(space > writer->drop_tokens) {
+         space = writer->drop_tokens;
+      }
+   }
+   char     marker[CRTL_DROPPED_MARKER_MAX];
+   uint32_t marker_size = (writer->dropped > 0) ? crtl_dropped_marker(marker, sizeof(marker), writer->dropped) : 0;
+   uint32_t length      = 0;
+   if(space >= marker_size + size) {
+      length = size;
+   } else if(space > marker_size) { // As many whole lines as fit
+      const char *end = memrchr(data, '\n', space - marker_size);
+      length = (end != NULL) ? end - data + 1 : 0;
+   }
+   if(length > 0 && crtl_ring_put(&writer->ring, marker, marker_size, data, length)) {
+      writer->dropped = 0;
+      if(writer->drop_rate > 0) {
+         writer->drop_tokens -= marker_size + length;
+      }
+   } else {
+      length = 0;
+   }
+   if(length < size) {
+      writer->dropped += size - length;
+      crtl_stats_add(CRTL_STAT_BYTES_DROPPED, size - length);
+   }
+}
+
+// Drop mode read.  Never blocks on the ring, only on the input.
+static int crtl_ring_writer_read_drop(crtl_ring_writer_t *writer, int fd) {
+   int rc = crtl_read(fd, writer->carry + writer->carry_size, CRTL_RING_DROP_READ - writer->carry_size);
+   if(rc <= 0) {
+      return(rc);
+   }
+   writer->carry_size += rc;
+   const char *end      = memrchr(writer->carry, '\n', writer->carry_size);
+   uint32_t    complete = (end != NULL) ? end - writer->carry + 1 : 0;
+   if(complete == 0 && writer->carry_size == CRTL_RING_DROP_READ) { // Split a line longer than the buffer
+      complete = writer->carry_size;
+   }
+   if(complete > 0) {
+      crtl_ring_writer_queue(writer, writer->carry, complete);
+      writer->carry_size -= complete;
+      memmove(writer->carry, writer->carry + complete, writer->carry_size);
+   }
+   return(rc);
+}
+
+// Read from fd straight into the ring.  Blocks while the ring is full, except in drop mode.  Returns the number of bytes read, 0 at end of
+// input or -1 on error (including a failure of the writer thread).
+int crtl_ring_writer_read(crtl_ring_writer_t *writer, int fd) {
+   if(writer->drop) {
+      if(atomic_load(&writer->failed)) {
+         errno = EIO;
+         return(-1);
+      }
+      return(crtl_ring_writer_read_drop(writer, fd));
+   }
+   uint32_t length;
+   char *ptr = crtl_ring_write_ptr(&writer->ring, &length, true);
+   if(length == 0 || atomic_load(&writer->failed)) {
+      errno = EIO;
+      return(-1);
+   }
+   int rc = crtl_read(fd, ptr, length);
+   if(rc > 0) {
+      crtl_ring_commit(&writer->ring, rc);
+   }
+   return(rc);
+}
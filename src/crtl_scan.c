@@ -0,0 +1,232 @@
+/**
+ * Copyright 2018 Comcast Cable Communications Management, LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Line tracking.  Old data is discarded a whole block at a time, which leaves a partial line at the start of the file.
+// As data is written, the first line start in every block is recorded, found with a vectorized newline scan that
+// skips the rest of the block once a line start is known.  After a collapse, the offset of the first complete line is
+// published in the user.curtail.head extended attribute of the output file, or in a <file>.head sidecar on filesystems
+// without extended attributes.  Positions are absolute: the number of bytes written to the output since it was
+// created (ring files) or opened (collapse storage).
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/xattr.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include "curtail.h"
+#include "crtl_private.h"
+
+#define CRTL_LINE_NONE        UINT32_MAX
+#define CRTL_LINE_HEAD_XATTR  "user.curtail.head"
+#define CRTL_LINE_HEAD_SUFFIX ".head"
+
+struct crtl_lines_s {
+   uint32_t *starts;      // Offset of the first line start in each block, indexed by block number modulo count
+   uint64_t  count;
+   uint32_t  granularity;
+   uint64_t  block_next;  // First block not yet tracked
+   int       fd_head;     // Sidecar file when extended attributes are not supported (-1 if not used)
+};
+
+typedef const char *(*crtl_scan_fn_t)(const char *data, const char *end);
+
+static const char *crtl_scan_generic(const char *data, const char *end) {
+   return(memchr(data, '\n', end - data));
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+static const char *crtl_scan_sse2(const char *data, const char *end) {
+   const __m128i newline = _mm_set1_epi8('\n');
+   for(; end - data >= 16; data += 16) {
+      int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)data), newline));
+      if(mask != 0) {
+         return(data + __builtin_ctz(mask));
+      }
+   }
+   return(crtl_scan_generic(data, end));
+}
+
+__attribute__((target("avx2")))
+static const char *crtl_scan_avx2(const char *data, const char *end) {
+   const __m256i newline = _mm256_set1_epi8('\n');
+   for(; end - data >= 32; data += 32) {
+      uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)data), newline));
+      if(mask != 0) {
+         return(data + __builtin_ctz(mask));
+      }
+   }
+   return(crtl_scan_sse2(data, end));
+}
+#endif
+
+static crtl_scan_fn_t g_scan = crtl_scan_generic;
+
+// Pick the widest scanner the CPU supports.  Called before any thread scans.
+void crtl_scan_init(void) {
+#if defined(__x86_64__) || defined(__i386__)
+   __builtin_cpu_init();
+   if(__builtin_cpu_supports("avx2")) {
+      g_scan = crtl_scan_avx2;
+   } else if(__builtin_cpu_supports("sse2")) {
+      g_scan = crtl_scan_sse2;
+   }
+#endif
+}
+
+// Find the first newline in [data, end) or NULL
+const char *crtl_scan_newline(const char *data, const char *end) {
+   return(g_scan(data, end));
+}
+
+// Record the first line start of each block covered by data written at position
+void crtl_lines_add(crtl_lines_t *lines, uint64_t position, const char *data, uint32_t size) {
+   uint64_t granularity = lines->granularity;
+   uint64_t block_last  = (position + size) / granularity; // A newline at the last byte starts a line in the next block
+   if(lines->block_next + lines->count <= block_last) {
+      lines->block_next = block_last + 1 - lines->count;
+   }
+   for(; lines->block_next <= block_last; lines->block_next++) {
+      lines->starts[lines->block_next % lines->count] = CRTL_LINE_NONE;
+   }
+
+   const char *end = data + size;
+   const char *ptr = data;
+   while(ptr < end) {
+      // The line start after the newline at byte p is in block (p + 1) / granularity
+      uint64_t  block = (position + (ptr - data) + 1) / granularity;
+      uint32_t *start = &lines->starts[block % lines->count];
+      if(*start == CRTL_LINE_NONE) {
+         const char *found = crtl_scan_newline(ptr, end);
+         if(found == NULL) {
+            break;
+         }
+         uint64_t line = position + (found - data) + 1;
+         block = line / granularity;
+         start = &lines->starts[block % lines->count];
+         if(*start == CRTL_LINE_NONE) {
+            *start = line % granularity;
+         }
+      }
+      // Skip to the last byte of this block, which is the first byte whose newline would start a line in the next one
+      uint64_t next = (block + 1) * granularity - 1;
+      if(next <= position + (ptr - data)) {
+         next = position + (ptr - data) + 1;
+      }
+      if(next - position >= size) {
+         break;
+      }
+      ptr = data + (next - position);
+   }
+}
+
+// First line start at or after position and before end, or end if there is none.  Only the first line start of each
+// block is known, so a position that is not block aligned may skip the rest of its block.
+uint64_t crtl_lines_first(const crtl_lines_t *lines, uint64_t position, uint64_t end) {
+   uint64_t granularity = lines->granularity;
+   uint64_t block_first = lines->block_next > lines->count ? lines->block_next - lines->count : 0;
+   uint64_t block       = position / granularity;
+   if(block < block_first) {
+      block = block_first;
+   }
+   for(; block < lines->block_next && block * granularity < end; block++) {
+      uint32_t start = lines->starts[block % lines->count];
+      if(start != CRTL_LINE_NONE && block * granularity + start >= position) {
+         uint64_t line = block * granularity + start;
+         return(line < end ? line : end);
+      }
+   }
+   return(end);
+}
+
+// Publish the offset of the first complete line in the file.  The sidecar holds a fixed width value so that it can
+// be overwritten in place.
+int crtl_lines_publish(crtl_lines_t *lines, int fd, uint64_t offset) {
+   char value[32];
+   if(lines->fd_head >= 0) {
+      int length = snprintf(value, sizeof(value), "%020" PRIu64 "\n", offset);
+      if(length != crtl_pwrite(lines->fd_head, value, length, 0)) {
+         int errsv = errno;
+         LOG_ERROR("unable to write head sidecar <%s>", strerror(errsv));
+         return(-1);
+      }
+      return(0);
+   }
+   int length = snprintf(value, sizeof(value), "%" PRIu64, offset);
+   if(0 != fsetxattr(fd, CRTL_LINE_HEAD_XATTR, value, length, 0)) {
+      int errsv = errno;
+      LOG_ERROR("unable to set %s <%s>", CRTL_LINE_HEAD_XATTR, strerror(errsv));
+      return(-1);
+   }
+   return(0);
+}
+
+// Start tracking lines of an output file
+crtl_lines_t *crtl_lines_open(const char *filename, int fd, uint64_t size_max, uint32_t granularity) {
+   crtl_scan_init();
+   crtl_lines_t *lines = calloc(1, sizeof(crtl_lines_t));
+   if(lines == NULL) {
+      return(NULL);
+   }
+   lines->granularity = granularity;
+   lines->count       = size_max / granularity + 2;
+   lines->starts      = malloc(lines->count * sizeof(uint32_t));
+   lines->fd_head     = -1;
+   if(lines->starts == NULL) {
+      LOG_ERROR("unable to allocate line tracking for %" PRIu64 " blocks", lines->count);
+      free(lines);
+      return(NULL);
+   }
+
+   // Fall back to a sidecar file when the filesystem has no user extended attributes
+   if(0 != fsetxattr(fd, CRTL_LINE_HEAD_XATTR, "0", 1, 0)) {
+      int errsv = errno;
+      if(errsv != ENOTSUP && errsv != EPERM) {
+         LOG_ERROR("unable to set %s <%s>", CRTL_LINE_HEAD_XATTR, strerror(errsv));
+         crtl_lines_close(lines);
+         return(NULL);
+      }
+      char path[PATH_MAX];
+      snprintf(path, sizeof(path), "%s" CRTL_LINE_HEAD_SUFFIX, filename);
+      lines->fd_head = crtl_open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+      if(lines->fd_head < 0) {
+         errsv = errno;
+         LOG_ERROR("unable to open <%s> <%s>", path, strerror(errsv));
+         crtl_lines_close(lines);
+         return(NULL);
+      }
+      LOG_INFO("publishing line head in <%s>", path);
+   }
+   return(lines);
+}
+
+void crtl_lines_close(crtl_lines_t *lines) {
+   if(lines == NULL) {
+      return;
+   }
+   crtl_file_close(&lines->fd_head);
+   free(lines->starts);
+   free(lines);
+}
@@ -0,0 +1,347 @@
+/**
+ * Copyright 2018 Comcast Cable Communications Management, LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Segment storage.  The cap is split across count files of segment_size bytes named <output file>.<n>, and the output
+// file itself is a small index holding the logical offsets of the oldest byte (head) and the end of the data (tail).
+// Logical offset n is stored in segment n / segment_size at n % segment_size, so segments only ever fill up from the
+// start and the head is always at the start of one.  Once every segment is in use, the oldest one is retired by moving
+// the head past it and renaming it to the next segment, which is then written again from the start.  Retiring data is
+// a rename whatever the size of the segments, no filesystem support beyond that is needed and the disk space of a
+// segment is reused rather than freed and allocated again.  Finished segments are never written to again until they
+// are recycled, so they can be copied away (or removed) one at a time.
+//
+// The index is mapped and the tail is stored after the data it covers, a single aligned 64-bit store, so readers and
+// a restarted writer never see data that was not written.  The segment being written can hold stale data from before
+// it was recycled past the tail, which is cut off when the output is closed.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "curtail.h"
+#include "crtl_private.h"
+
+#define CRTL_SEGMENT_FILE_MAGIC   "CRTLSEGS"
+#define CRTL_SEGMENT_FILE_VERSION (1)
+#define CRTL_SEGMENT_COUNT        (4)
+
+typedef struct {
+   char     magic[8];
+   uint32_t version;
+   uint32_t count;        // Number of segment files
+   uint64_t segment_size;
+   uint64_t head;
+   uint64_t tail;
+} crtl_segment_index_t;
+
+struct crtl_segments_s {
+   int                   fd_index;
+   crtl_segment_index_t *index;                 // The index file, mapped
+   uint64_t              current;               // Segment open on the output's fd
+   char                  path[PATH_MAX];        // Output file name, segment files add .<n>
+};
+
+// Returns 1 if the index was read, 0 if the file is not a segment index or -1 on error
+static int crtl_segment_index_read(int fd, crtl_segment_index_t *index) {
+   int rc = crtl_pread(fd, index, sizeof(*index), 0);
+   if(rc < 0) {
+      int errsv = errno;
+      LOG_ERROR("unable to read segment index <%s>", strerror(errsv));
+      return(-1);
+   }
+   if(rc != sizeof(*index) || 0 != memcmp(index->magic, CRTL_SEGMENT_FILE_MAGIC, sizeof(index->magic))) {
+      return(0);
+   }
+   if(index->version != CRTL_SEGMENT_FILE_VERSION || index->count < 2 || index->segment_size == 0 || index->tail < index->head ||
+      index->head % index->segment_size != 0 || index->tail - index->head > index->count * index->segment_size) {
+      LOG_ERROR("invalid segment index");
+      errno = EINVAL;
+      return(-1);
+   }
+   return(1);
+}
+
+// Check whether a file is a segment index
+bool crtl_segment_detect(int fd) {
+   crtl_segment_index_t index;
+   return(1 == crtl_segment_index_read(fd, &index));
+}
+
+static void crtl_segment_path(const char *filename, uint64_t segment, char *path, size_t size) {
+   snprintf(path, size, "%s.%" PRIu64, filename, segment);
+}
+
+// Segment that holds the last byte written, or the first segment of an empty output
+static uint64_t crtl_segment_last(const crtl_segment_index_t *index) {
+   return((index->tail > 0) ? (index->tail - 1) / index->segment_size : 0);
+}
+
+static int crtl_segment_file_open(crtl_segments_t *segments, uint64_t segment) {
+   char path[PATH_MAX + 32];
+   crtl_segment_path(segments->path, segment, path, sizeof(path));
+   int fd = crtl_open(path, O_WRONLY | O_CREAT, 0644);
+   if(fd < 0) {
+      int errsv = errno;
+      LOG_ERROR("unable to open segment file <%s> <%s>", path, strerror(errsv));
+      errno = errsv;
+   }
+   return(fd);
+}
+
+// Load or create the index in output->fd and open the last segment in its place.  The segment count and size of an
+// existing index can't change.
+bool crtl_segment_open(const char *filename, crtl_output_t *output) {
+   if(strlen(filename) >= sizeof(((crtl_segments_t *)NULL)->path)) {
+      LOG_ERROR("output file name is too long");
+      return(false);
+   }
+   crtl_segment_index_t index;
+   int rc = crtl_segment_index_read(output->fd, &index);
+   if(rc < 0) {
+      return(false);
+   }
+   if(rc == 0 && output->size_cur > 0) {
+      LOG_ERROR("output file exists and is not a segment index");
+      return(false);
+   }
+   if(rc == 1) {
+      if(index.count * index.segment_size != output->size_max) {
+         LOG_WARN("keeping existing %u segments of %" PRIu64 " bytes", index.count, index.segment_size);
+      }
+   } else {
+      uint32_t count = (output->segment_count > 0) ? output->segment_count : CRTL_SEGMENT_COUNT;
+      if(count < 2) {
+         LOG_WARN("at least 2 segments are needed");
+         count = 2;
+      }
+      if(count > output->size_max / DEFAULT_SECTOR_SIZE) {
+         count = output->size_max / DEFAULT_SECTOR_SIZE;
+         LOG_WARN("segments must be at least %u bytes, using %u segments", DEFAULT_SECTOR_SIZE, count);
+      }
+      memset(&index, 0, sizeof(index));
+      memcpy(index.magic, CRTL_SEGMENT_FILE_MAGIC, sizeof(index.magic));
+      index.version      = CRTL_SEGMENT_FILE_VERSION;
+      index.count        = count;
+      index.segment_size = output->size_max / count;
+      index.segment_size -= index.segment_size % DEFAULT_SECTOR_SIZE;
+      if(sizeof(index) != crtl_pwrite(output->fd, &index, sizeof(index), 0)) {
+         int errsv = errno;
+         LOG_ERROR("unable to write segment index <%s>", strerror(errsv));
+         return(false);
+      }
+   }
+   if(output->line_head) {
+      LOG_WARN("line tracking not available with segment storage");
+      output->line_head = false;
+   }
+
+   crtl_segments_t *segments = calloc(1, sizeof(crtl_segments_t));
+   if(segments == NULL) {
+      LOG_ERROR("unable to allocate segments");
+      return(false);
+   }
+   strcpy(segments->path, filename);
+   segments->fd_index = -1;
+   segments->index    = mmap(NULL, sizeof(crtl_segment_index_t), PROT_READ | PROT_WRITE, MAP_SHARED, output->fd, 0);
+   if(segments->index == MAP_FAILED) {
+      int errsv = errno;
+      LOG_ERROR("unable to map segment index <%s>", strerror(errsv));
+      free(segments);
+      return(false);
+   }
+   segments->current = crtl_segment_last(&index);
+   int fd_segment = crtl_segment_file_open(segments, segments->current);
+   if(fd_segment < 0) {
+      munmap(segments->index, sizeof(crtl_segment_index_t));
+      free(segments);
+      return(false);
+   }
+   segments->fd_index = output->fd;
+   output->fd         = fd_segment;
+   output->segments   = segments;
+   output->size_max   = index.count * index.segment_size;
+   if(output->size_low > output->size_max) {
+      output->size_low = output->size_max;
+   }
+   output->size_cur   = index.tail - index.head;
+   LOG_DEBUG("%u segments of %" PRIu64 " bytes head %" PRIu64 " tail %" PRIu64, index.count, index.segment_size, index.head, index.tail);
+   return(true);
+}
+
+// Switch the output's fd to the next segment, recycling the oldest one when all of them are in use.  The new file
+// takes over the fd number with dup2 so that the sync thread never sees it closed.
+static int crtl_segment_roll(crtl_output_t *output) {
+   crtl_segments_t *     segments = output->segments;
+   crtl_segment_index_t *index    = segments->index;
+   uint64_t              next     = segments->current + 1;
+   if(next - index->head / index->segment_size >= index->count) {
+      uint64_t oldest = index->head / index->segment_size;
+      index->head += index->segment_size; // Readers stop looking at the segment before it is renamed
+      // The rename may reach the disk before the mapping is written back, after a crash the index must not still
+      // list the segment under its old name
+      if(0 > crtl_segment_sync(segments)) {
+         int errsv = errno;
+         LOG_ERROR("unable to sync segment index <%s>", strerror(errsv));
+         index->head -= index->segment_size;
+         return(-1);
+      }
+      output->size_cur = index->tail - index->head;
+      crtl_stats_add(CRTL_STAT_BYTES_COLLAPSED, index->segment_size);
+      char path_old[PATH_MAX + 32];
+      char path_new[PATH_MAX + 32];
+      crtl_segment_path(segments->path, oldest, path_old, sizeof(path_old));
+      crtl_segment_path(segments->path, next, path_new, sizeof(path_new));
+      if(0 > rename(path_old, path_new) && errno != ENOENT) { // A segment that was moved away is simply created again
+         int errsv = errno;
+         LOG_ERROR("unable to recycle segment file <%s> <%s>", path_old, strerror(errsv));
+         return(-1);
+      }
+      LOG_DEBUG("segment %" PRIu64 " recycled as %" PRIu64, oldest, next);
+   }
+   int fd_segment = crtl_segment_file_open(segments, next);
+   if(fd_segment < 0) {
+      return(-1);
+   }
+   if(output->sync != CRTL_SYNC_NONE && 0 > fdatasync(output->fd)) { // The sync thread only knows the current segment
+      int errsv = errno;
+      LOG_ERROR("unable to sync segment file <%s>", strerror(errsv));
+      crtl_file_close(&fd_segment);
+      return(-1);
+   }
+   if(output->cache == CRTL_CACHE_DONTNEED) {
+      posix_fadvise(output->fd, 0, 0, POSIX_FADV_DONTNEED);
+   }
+   if(0 > dup2(fd_segment, output->fd)) {
+      int errsv = errno;
+      LOG_ERROR("unable to switch segment files <%s>", strerror(errsv));
+      crtl_file_close(&fd_segment);
+      return(-1);
+   }
+   crtl_file_close(&fd_segment);
+   segments->current = next;
+   return(0);
+}
+
+// Append data at the tail, moving to the next segment whenever one fills up
+int crtl_segment_write(crtl_output_t *output, const char *buffer, uint32_t data_size) {
+   crtl_segments_t *     segments = output->segments;
+   crtl_segment_index_t *index    = segments->index;
+   uint32_t written = 0;
+   while(written < data_size) {
+      if(index->tail / index->segment_size != segments->current && 0 > crtl_segment_roll(output)) {
+         return(-1);
+      }
+      uint64_t position = index->tail % index->segment_size;
+      uint32_t length   = data_size - written;
+      if(length > index->segment_size - position) {
+         length = index->segment_size - position;
+      }
+      int rc = crtl_pwrite(output->fd, buffer + written, length, position);
+      if(rc < 0) {
+         int errsv = errno;
+         LOG_ERROR("error writing to segment file <%s>", strerror(errsv));
+         return(-1);
+      }
+      index->tail      += rc;
+      output->size_cur  = index->tail - index->head;
+      crtl_output_written(output, rc);
+      written += rc;
+   }
+   return(written);
+}
+
+// Flush the index to disk, after the data it covers
+int crtl_segment_sync(crtl_segments_t *segments) {
+   return(msync(segments->index, sizeof(crtl_segment_index_t), MS_SYNC));
+}
+
+// Cut stale data off the segment being written and close the index.  The output's fd is closed by the caller.
+void crtl_segment_close(crtl_output_t *output) {
+   crtl_segments_t *segments = output->segments;
+   if(segments == NULL) {
+      return;
+   }
+   crtl_segment_index_t *index = segments->index;
+   if(segments->current == crtl_segment_last(index)) {
+      off_t size = index->tail - segments->current * index->segment_size;
+      struct stat statbuf;
+      if(0 == crtl_fstat(output->fd, &statbuf) && statbuf.st_size > size && 0 > ftruncate(output->fd, size)) {
+         int errsv = errno;
+         LOG_WARN("unable to truncate segment file <%s>", strerror(errsv));
+      }
+   }
+   munmap(index, sizeof(crtl_segment_index_t));
+   crtl_file_close(&segments->fd_index);
+   free(segments);
+   output->segments = NULL;
+}
+
+// Write the segments listed in the index of fd_index to fd in order.  Segments that were removed are skipped.
+int crtl_segment_cat(const char *filename, int fd_index, int fd) {
+   crtl_segment_index_t index;
+   if(1 != crtl_segment_index_read(fd_index, &index)) {
+      return(-1);
+   }
+   char buffer[64 * 1024];
+   for(uint64_t position = index.head; position < index.tail;) {
+      uint64_t segment = position / index.segment_size;
+      uint64_t end     = (segment + 1) * index.segment_size;
+      if(end > index.tail) {
+         end = index.tail;
+      }
+      char path[PATH_MAX + 32];
+      crtl_segment_path(filename, segment, path, sizeof(path));
+      int fd_segment = crtl_open(path, O_RDONLY, 0);
+      if(fd_segment < 0) {
+         int errsv = errno;
+         LOG_WARN("skipping segment file <%s> <%s>", path, strerror(errsv));
+         position = end;
+         continue;
+      }
+      while(position < end) {
+         uint64_t length = end - position;
+         if(length > sizeof(buffer)) {
+            length = sizeof(buffer);
+         }
+         int size = crtl_pread(fd_segment, buffer, length, position % index.segment_size);
+         if(size < 0) {
+            int errsv = errno;
+            LOG_ERROR("error reading <%s> <%s>", path, strerror(errsv));
+            crtl_file_close(&fd_segment);
+            return(-1);
+         }
+         if(size == 0) { // Shorter than the index says, the rest was never written
+            break;
+         }
+         if(size != crtl_write(fd, buffer, size)) {
+            crtl_file_close(&fd_segment);
+            return(-1);
+         }
+         position += size;
+      }
+      crtl_file_close(&fd_segment);
+      position = end;
+   }
+   return(0);
+}
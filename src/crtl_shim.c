@@ -0,0 +1,217 @@
+/**
+ * Copyright 2018 Comcast Cable Communications Management, LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Syscall shim for curtail_bench, loaded with LD_PRELOAD into curtail or a libcurtail program.  It counts fallocate
+// calls and writes to regular files, and emulates FALLOC_FL_COLLAPSE_RANGE by moving the data down and truncating on
+// filesystems that don't support it (tmpfs, overlayfs), so the collapse storage can be benchmarked without root or a
+// loop mounted image.  The counts are written to the file named by CRTL_SHIM_STATS when the process exits.  Calls
+// issued through io_uring bypass the shim and are not counted.
+
+// Both the plain and the 64 bit offset entry points are wrapped, so don't let the headers rename them
+#undef _FILE_OFFSET_BITS
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <linux/falloc.h>
+
+#define CRTL_SHIM_FD_MAX  (1024)
+#define CRTL_SHIM_MOVE    (64 * 1024)
+
+typedef enum {
+   CRTL_SHIM_FD_UNKNOWN = 0,
+   CRTL_SHIM_FD_FILE    = 1, // Regular file, writes are counted
+   CRTL_SHIM_FD_OTHER   = 2
+} crtl_shim_fd_t;
+
+static ssize_t (*real_write)(int, const void *, size_t);
+static ssize_t (*real_pwrite)(int, const void *, size_t, off_t);
+static ssize_t (*real_pwrite64)(int, const void *, size_t, off64_t);
+static ssize_t (*real_pread64)(int, void *, size_t, off64_t);
+static ssize_t (*real_writev)(int, const struct iovec *, int);
+static ssize_t (*real_splice)(int, loff_t *, int, loff_t *, size_t, unsigned int);
+static int     (*real_fallocate)(int, int, off_t, off_t);
+static int     (*real_fallocate64)(int, int, off64_t, off64_t);
+static int     (*real_close)(int);
+static int     (*real_dup2)(int, int);
+static int     (*real_dup3)(int, int, int);
+
+static atomic_uint_fast64_t g_fallocate_count;
+static atomic_uint_fast64_t g_collapse_emulated;
+static atomic_uint_fast64_t g_write_count;
+static atomic_uint_fast64_t g_write_bytes;
+static _Atomic uint8_t      g_fd_kind[CRTL_SHIM_FD_MAX];
+
+__attribute__((constructor))
+static void crtl_shim_init(void) {
+   real_write     = dlsym(RTLD_NEXT, "write");
+   real_pwrite    = dlsym(RTLD_NEXT, "pwrite");
+   real_pwrite64  = dlsym(RTLD_NEXT, "pwrite64");
+   real_pread64   = dlsym(RTLD_NEXT, "pread64");
+   real_writev    = dlsym(RTLD_NEXT, "writev");
+   real_splice    = dlsym(RTLD_NEXT, "splice");
+   real_fallocate = dlsym(RTLD_NEXT, "fallocate");
+   real_fallocate64 = dlsym(RTLD_NEXT, "fallocate64");
+   real_close     = dlsym(RTLD_NEXT, "close");
+   real_dup2      = dlsym(RTLD_NEXT, "dup2");
+   real_dup3      = dlsym(RTLD_NEXT, "dup3");
+}
+
+__attribute__((destructor))
+static void crtl_shim_term(void) {
+   const char *path = getenv("CRTL_SHIM_STATS");
+   if(path == NULL) {
+      return;
+   }
+   FILE *file = fopen(path, "w");
+   if(file == NULL) {
+      return;
+   }
+   fprintf(file, "fallocate %" PRIu64 "\n", (uint64_t)atomic_load(&g_fallocate_count));
+   fprintf(file, "emulated %" PRIu64 "\n", (uint64_t)atomic_load(&g_collapse_emulated));
+   fprintf(file, "write %" PRIu64 "\n", (uint64_t)atomic_load(&g_write_count));
+   fprintf(file, "write_bytes %" PRIu64 "\n", (uint64_t)atomic_load(&g_write_bytes));
+   fclose(file);
+}
+
+// Classify a descriptor once and remember it until it is closed or replaced
+static bool crtl_shim_is_file(int fd) {
+   if(fd < 0 || fd >= CRTL_SHIM_FD_MAX) {
+      return(false);
+   }
+   uint8_t kind = atomic_load_explicit(&g_fd_kind[fd], memory_order_relaxed);
+   if(kind == CRTL_SHIM_FD_UNKNOWN) {
+      struct stat statbuf;
+      kind = (0 == fstat(fd, &statbuf) && S_ISREG(statbuf.st_mode)) ? CRTL_SHIM_FD_FILE : CRTL_SHIM_FD_OTHER;
+      atomic_store_explicit(&g_fd_kind[fd], kind, memory_order_relaxed);
+   }
+   return(kind == CRTL_SHIM_FD_FILE);
+}
+
+static void crtl_shim_forget(int fd) {
+   if(fd >= 0 && fd < CRTL_SHIM_FD_MAX) {
+      atomic_store_explicit(&g_fd_kind[fd], CRTL_SHIM_FD_UNKNOWN, memory_order_relaxed);
+   }
+}
+
+static void crtl_shim_written(int fd, ssize_t rc) {
+   if(rc >= 0 && crtl_shim_is_file(fd)) {
+      atomic_fetch_add_explicit(&g_write_count, 1, memory_order_relaxed);
+      atomic_fetch_add_explicit(&g_write_bytes, rc, memory_order_relaxed);
+   }
+}
+
+// Remove [offset, offset + len) from the file the slow way, with the same alignment rules as the kernel
+static int crtl_shim_collapse(int fd, off64_t offset, off64_t len) {
+   struct stat64 statbuf;
+   if(0 != fstat64(fd, &statbuf)) {
+      return(-1);
+   }
+   if(len <= 0 || offset % statbuf.st_blksize != 0 || len % statbuf.st_blksize != 0 || offset + len >= statbuf.st_size) {
+      errno = EINVAL;
+      return(-1);
+   }
+   char    buffer[CRTL_SHIM_MOVE];
+   off64_t from = offset + len;
+   while(from < statbuf.st_size) {
+      ssize_t rc = real_pread64(fd, buffer, sizeof(buffer), from);
+      if(rc <= 0) {
+         return(-1);
+      }
+      if(rc != real_pwrite64(fd, buffer, rc, from - len)) {
+         return(-1);
+      }
+      from += rc;
+   }
+   atomic_fetch_add_explicit(&g_collapse_emulated, 1, memory_order_relaxed);
+   return(ftruncate64(fd, statbuf.st_size - len));
+}
+
+int fallocate(int fd, int mode, off_t offset, off_t len) {
+   atomic_fetch_add_explicit(&g_fallocate_count, 1, memory_order_relaxed);
+   int rc = real_fallocate(fd, mode, offset, len);
+   if(rc != 0 && errno == EOPNOTSUPP && mode == FALLOC_FL_COLLAPSE_RANGE) {
+      rc = crtl_shim_collapse(fd, offset, len);
+   }
+   return(rc);
+}
+
+int fallocate64(int fd, int mode, off64_t offset, off64_t len) {
+   atomic_fetch_add_explicit(&g_fallocate_count, 1, memory_order_relaxed);
+   int rc = real_fallocate64(fd, mode, offset, len);
+   if(rc != 0 && errno == EOPNOTSUPP && mode == FALLOC_FL_COLLAPSE_RANGE) {
+      rc = crtl_shim_collapse(fd, offset, len);
+   }
+   return(rc);
+}
+
+ssize_t write(int fd, const void *buf, size_t count) {
+   ssize_t rc = real_write(fd, buf, count);
+   crtl_shim_written(fd, rc);
+   return(rc);
+}
+
+ssize_t pwrite(int fd, const void *buf, size_t count, off_t offset) {
+   ssize_t rc = real_pwrite(fd, buf, count, offset);
+   crtl_shim_written(fd, rc);
+   return(rc);
+}
+
+ssize_t pwrite64(int fd, const void *buf, size_t count, off64_t offset) {
+   ssize_t rc = real_pwrite64(fd, buf, count, offset);
+   crtl_shim_written(fd, rc);
+   return(rc);
+}
+
+ssize_t writev(int fd, const struct iovec *iov, int iovcnt) {
+   ssize_t rc = real_writev(fd, iov, iovcnt);
+   crtl_shim_written(fd, rc);
+   return(rc);
+}
+
+ssize_t splice(int fd_in, loff_t *off_in, int fd_out, loff_t *off_out, size_t len, unsigned int flags) {
+   ssize_t rc = real_splice(fd_in, off_in, fd_out, off_out, len, flags);
+   crtl_shim_written(fd_out, rc);
+   return(rc);
+}
+
+int close(int fd) {
+   crtl_shim_forget(fd);
+   return(real_close(fd));
+}
+
+int dup2(int oldfd, int newfd) {
+   crtl_shim_forget(newfd);
+   return(real_dup2(oldfd, newfd));
+}
+
+int dup3(int oldfd, int newfd, int flags) {
+   crtl_shim_forget(newfd);
+   return(real_dup3(oldfd, newfd, flags));
+}
@@ -0,0 +1,143 @@
+/**
+ * Copyright 2018 Comcast Cable Communications Management, LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Line timestamps.  Every line written to the output is prefixed with the local time it was written, ie.
+// "2024-01-31T12:34:56.789+0000 ".  The time comes from CLOCK_REALTIME_COARSE, which is read from the vDSO without a
+// system call and has a resolution of a few milliseconds.  The prefix is formatted with strftime once per second and
+// only the milliseconds are patched in between, so a line costs a newline scan and a memcpy.  The clock is read once per
+// input buffer, so all lines that arrive together share a timestamp.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "curtail.h"
+#include "crtl_private.h"
+
+#define CRTL_STAMP_PREFIX_MAX (64)
+#define CRTL_STAMP_BUFFER     (64 * 1024)
+
+struct crtl_stamp_s {
+   pthread_mutex_t mutex;         // Serializes writers, as a line may span input buffers
+   bool            line_start;    // The next byte of input starts a line
+   time_t          second;        // Second the prefix was formatted for
+   char            prefix[CRTL_STAMP_PREFIX_MAX];
+   uint32_t        prefix_size;
+   uint32_t        millis;        // Offset of the milliseconds in the prefix
+   char            buffer[CRTL_STAMP_BUFFER];
+};
+
+crtl_stamp_t *crtl_stamp_open(void) {
+   crtl_scan_init();
+   crtl_stamp_t *stamp = calloc(1, sizeof(crtl_stamp_t));
+   if(stamp == NULL) {
+      LOG_ERROR("unable to allocate timestamp buffer");
+      return(NULL);
+   }
+   pthread_mutex_init(&stamp->mutex, NULL);
+   stamp->line_start = true;
+   stamp->second     = -1;
+   return(stamp);
+}
+
+void crtl_stamp_close(crtl_stamp_t *stamp) {
+   if(stamp == NULL) {
+      return;
+   }
+   pthread_mutex_destroy(&stamp->mutex);
+   free(stamp);
+}
+
+// Bring the prefix up to date
+static void crtl_stamp_clock(crtl_stamp_t *stamp) {
+   struct timespec now;
+   clock_gettime(CLOCK_REALTIME_COARSE, &now);
+   if(now.tv_sec != stamp->second) {
+      struct tm tm;
+      localtime_r(&now.tv_sec, &tm);
+      stamp->prefix_size = strftime(stamp->prefix, sizeof(stamp->prefix), "%Y-%m-%dT%H:%M:%S.000%z ", &tm);
+      stamp->millis      = strchr(stamp->prefix, '.') - stamp->prefix + 1;
+      stamp->second      = now.tv_sec;
+   }
+   uint32_t millis = now.tv_nsec / 1000000;
+   char *   digits = stamp->prefix + stamp->millis;
+   digits[0] = '0' + millis / 100;
+   digits[1] = '0' + millis / 10 % 10;
+   digits[2] = '0' + millis % 10;
+}
+
+// Write the stamped buffer out.  False unless all of it was written.
+static bool crtl_stamp_flush(crtl_stamp_t *stamp, crtl_output_t *output, uint32_t used) {
+   return((int)used == crtl_process_output(output, stamp->buffer, used));
+}
+
+// Prefix each line of the data with the time and write it to the output.  Returns the number of bytes of data that
+// were written along with their prefixes, or -1 when none were.
+int crtl_stamp_input(crtl_stamp_t *stamp, crtl_output_t *output, const char *buffer, uint32_t data_size) {
+   uint32_t capacity = CRTL_STAMP_BUFFER;
+   if(capacity > output->size_max / 2) { // Like the ring writer, never write more than half the file at once
+      capacity = output->size_max / 2;
+   }
+   // The output lock is recursive and taken first, in the same order as crtl_direct_write
+   crtl_output_lock(output);
+   pthread_mutex_lock(&stamp->mutex);
+   crtl_stamp_clock(stamp);
+   const char *ptr     = buffer;
+   const char *end     = buffer + data_size;
+   const char *written = buffer; // Data up to here is in the output
+   uint32_t    used    = 0;
+   bool        ok      = true;
+   while(ptr < end && ok) {
+      if(stamp->line_start) {
+         if(used + stamp->prefix_size > capacity) {
+            ok      = crtl_stamp_flush(stamp, output, used);
+            written = ok ? ptr : written;
+            used    = 0;
+            continue;
+         }
+         memcpy(stamp->buffer + used, stamp->prefix, stamp->prefix_size);
+         used += stamp->prefix_size;
+         stamp->line_start = false;
+      }
+      const char *newline = crtl_scan_newline(ptr, end);
+      uint32_t    length  = ((newline != NULL) ? newline + 1 : end) - ptr;
+      if(length > capacity - used) {
+         length = capacity - used;
+      } else if(newline != NULL) {
+         stamp->line_start = true;
+      }
+      memcpy(stamp->buffer + used, ptr, length);
+      used += length;
+      ptr  += length;
+      if(used == capacity) {
+         ok      = crtl_stamp_flush(stamp, output, used);
+         written = ok ? ptr : written;
+         used    = 0;
+      }
+   }
+   if(used > 0 && ok && crtl_stamp_flush(stamp, output, used)) {
+      written = ptr;
+   }
+   pthread_mutex_unlock(&stamp->mutex);
+   crtl_output_unlock(output);
+   return((written == buffer && data_size > 0) ? -1 : (int)(written - buffer));
+}
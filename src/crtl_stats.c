@@ -0,0 +1,278 @@
+/**
+ * Copyright 2018 Comcast Cable Communications Management, LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Runtime statistics.  Counters and latency histograms are process wide relaxed atomics updated by the I/O wrappers
+// and the output code, cheap enough to leave on.  They are read with crtl_get_stats, dumped to stderr on SIGUSR1 and
+// optionally written to a file in the Prometheus text format by a background thread.  The text is formatted without
+// stdio so that the dump can run in a signal handler.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <linux/limits.h>
+#include "curtail.h"
+#include "crtl_private.h"
+
+#define CRTL_STATS_TEXT_SIZE (8192)
+
+typedef struct {
+   atomic_uint_fast64_t count;
+   atomic_uint_fast64_t sum_us;
+   atomic_uint_fast64_t buckets[CRTL_STATS_BUCKETS];
+} crtl_stats_histogram_atomic_t;
+
+typedef struct {
+   atomic_uint_fast64_t          counters[CRTL_STAT_QTY];
+   atomic_uint_fast64_t          gauges[CRTL_GAUGE_QTY];
+   crtl_stats_histogram_atomic_t ops[CRTL_STAT_OP_QTY];
+} crtl_stats_atomic_t;
+
+typedef struct {
+   pthread_t       thread;
+   bool            running;
+   pthread_mutex_t mutex;
+   pthread_cond_t  cond;
+   bool            stop;
+   char            path[PATH_MAX];
+   char            path_tmp[PATH_MAX];
+   uint32_t        interval_ms;
+} crtl_stats_file_t;
+
+static crtl_stats_atomic_t g_stats;
+static crtl_stats_file_t   g_stats_file = { .mutex = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+static const char *g_counter_names[CRTL_STAT_QTY] = { "curtail_bytes_in_total", "curtail_bytes_written_total",
+                                                      "curtail_bytes_collapsed_total", "curtail_collapses_total",
+                                                      "curtail_short_writes_total", "curtail_errors_total",
+                                                      "curtail_bytes_dropped_total" };
+static const char *g_gauge_names[CRTL_GAUGE_QTY] = { "curtail_output_extents" };
+static const char *g_op_names[CRTL_STAT_OP_QTY]   = { "curtail_read_latency_us", "curtail_write_latency_us",
+                                                      "curtail_fallocate_latency_us", "curtail_sync_latency_us" };
+
+void crtl_stats_add(crtl_stat_t stat, uint64_t value) {
+   atomic_fetch_add_explicit(&g_stats.counters[stat], value, memory_order_relaxed);
+}
+
+void crtl_stats_set(crtl_gauge_t gauge, uint64_t value) {
+   atomic_store_explicit(&g_stats.gauges[gauge], value, memory_order_relaxed);
+}
+
+uint64_t crtl_stats_clock(void) {
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return((uint64_t)now.tv_sec * 1000000000 + now.tv_nsec);
+}
+
+// Record an operation that started at start (from crtl_stats_clock).  Bucket n counts operations that took less than
+// 2^n microseconds, and at least 2^(n-1) for n > 0.
+void crtl_stats_time(crtl_stat_op_t op, uint64_t start) {
+   uint64_t elapsed_us = (crtl_stats_clock() - start) / 1000;
+   uint32_t bucket     = (elapsed_us == 0) ? 0 : 64 - __builtin_clzll(elapsed_us);
+   if(bucket >= CRTL_STATS_BUCKETS) {
+      bucket = CRTL_STATS_BUCKETS - 1;
+   }
+   crtl_stats_histogram_atomic_t *histogram = &g_stats.ops[op];
+   atomic_fetch_add_explicit(&histogram->count, 1, memory_order_relaxed);
+   atomic_fetch_add_explicit(&histogram->sum_us, elapsed_us, memory_order_relaxed);
+   atomic_fetch_add_explicit(&histogram->buckets[bucket], 1, memory_order_relaxed);
+}
+
+static void crtl_stats_histogram_get(crtl_stats_histogram_t *histogram, crtl_stats_histogram_atomic_t *source) {
+   histogram->count  = atomic_load_explicit(&source->count, memory_order_relaxed);
+   histogram->sum_us = atomic_load_explicit(&source->sum_us, memory_order_relaxed);
+   for(uint32_t bucket = 0; bucket < CRTL_STATS_BUCKETS; bucket++) {
+      histogram->buckets[bucket] = atomic_load_explicit(&source->buckets[bucket], memory_order_relaxed);
+   }
+}
+
+// Copy the current statistics.  Each value is read atomically but the set is not a single snapshot.
+int crtl_get_stats(crtl_stats_t *stats) {
+   if(stats == NULL) {
+      errno = EINVAL;
+      return(-1);
+   }
+   stats->bytes_in        = atomic_load_explicit(&g_stats.counters[CRTL_STAT_BYTES_IN], memory_order_relaxed);
+   stats->bytes_written   = atomic_load_explicit(&g_stats.counters[CRTL_STAT_BYTES_WRITTEN], memory_order_relaxed);
+   stats->bytes_collapsed = atomic_load_explicit(&g_stats.counters[CRTL_STAT_BYTES_COLLAPSED], memory_order_relaxed);
+   stats->collapses       = atomic_load_explicit(&g_stats.counters[CRTL_STAT_COLLAPSES], memory_order_relaxed);
+   stats->short_writes    = atomic_load_explicit(&g_stats.counters[CRTL_STAT_SHORT_WRITES], memory_order_relaxed);
+   stats->errors          = atomic_load_explicit(&g_stats.counters[CRTL_STAT_ERRORS], memory_order_relaxed);
+   stats->bytes_dropped   = atomic_load_explicit(&g_stats.counters[CRTL_STAT_BYTES_DROPPED], memory_order_relaxed);
+   stats->extents         = atomic_load_explicit(&g_stats.gauges[CRTL_GAUGE_EXTENTS], memory_order_relaxed);
+   crtl_stats_histogram_get(&stats->read, &g_stats.ops[CRTL_STAT_OP_READ]);
+   crtl_stats_histogram_get(&stats->write, &g_stats.ops[CRTL_STAT_OP_WRITE]);
+   crtl_stats_histogram_get(&stats->fallocate, &g_stats.ops[CRTL_STAT_OP_FALLOCATE]);
+   crtl_stats_histogram_get(&stats->sync, &g_stats.ops[CRTL_STAT_OP_SYNC]);
+   return(0);
+}
+
+// Signal safe text building
+typedef struct {
+   char * data;
+   size_t size;
+   size_t length;
+} crtl_stats_text_t;
+
+static void crtl_stats_text_str(crtl_stats_text_t *text, const char *str) {
+   for(; *str != '\0' && text->length < text->size; str++) {
+      text->data[text->length++] = *str;
+   }
+}
+
+static void crtl_stats_text_u64(crtl_stats_text_t *text, uint64_t value) {
+   char  digits[24];
+   char *ptr = digits + sizeof(digits);
+   *--ptr = '\0';
+   do {
+      *--ptr = '0' + value % 10;
+      value /= 10;
+   } while(value > 0);
+   crtl_stats_text_str(text, ptr);
+}
+
+static void crtl_stats_text_metric(crtl_stats_text_t *text, const char *name, const char *suffix, uint64_t value) {
+   crtl_stats_text_str(text, name);
+   crtl_stats_text_str(text, suffix);
+   crtl_stats_text_str(text, " ");
+   crtl_stats_text_u64(text, value);
+   crtl_stats_text_str(text, "\n");
+}
+
+// Format the statistics as Prometheus text.  Histogram buckets are cumulative and stop after the last one in use.
+static size_t crtl_stats_format(char *buffer, size_t size) {
+   crtl_stats_text_t text = { .data = buffer, .size = size, .length = 0 };
+   for(uint32_t stat = 0; stat < CRTL_STAT_QTY; stat++) {
+      crtl_stats_text_metric(&text, g_counter_names[stat], "", atomic_load_explicit(&g_stats.counters[stat], memory_order_relaxed));
+   }
+   for(uint32_t gauge = 0; gauge < CRTL_GAUGE_QTY; gauge++) {
+      crtl_stats_text_metric(&text, g_gauge_names[gauge], "", atomic_load_explicit(&g_stats.gauges[gauge], memory_order_relaxed));
+   }
+   for(uint32_t op = 0; op < CRTL_STAT_OP_QTY; op++) {
+      crtl_stats_histogram_t histogram;
+      crtl_stats_histogram_get(&histogram, &g_stats.ops[op]);
+      uint32_t last = 0;
+      for(uint32_t bucket = 0; bucket < CRTL_STATS_BUCKETS; bucket++) {
+         if(histogram.buckets[bucket] > 0) {
+            last = bucket;
+         }
+      }
+      uint64_t cumulative = 0;
+      for(uint32_t bucket = 0; bucket <= last && bucket < CRTL_STATS_BUCKETS - 1; bucket++) {
+         cumulative += histogram.buckets[bucket];
+         crtl_stats_text_str(&text, g_op_names[op]);
+         crtl_stats_text_str(&text, "_bucket{le=\"");
+         crtl_stats_text_u64(&text, (uint64_t)1 << bucket);
+         crtl_stats_text_str(&text, "\"} ");
+         crtl_stats_text_u64(&text, cumulative);
+         crtl_stats_text_str(&text, "\n");
+      }
+      crtl_stats_text_metric(&text, g_op_names[op], "_bucket{le=\"+Inf\"}", histogram.count);
+      crtl_stats_text_metric(&text, g_op_names[op], "_sum", histogram.sum_us);
+      crtl_stats_text_metric(&text, g_op_names[op], "_count", histogram.count);
+   }
+   return(text.length);
+}
+
+// Write the statistics to fd.  Signal safe.
+int crtl_stats_dump(int fd) {
+   char   buffer[CRTL_STATS_TEXT_SIZE];
+   size_t length = crtl_stats_format(buffer, sizeof(buffer));
+   int    rc;
+   do { // Not crtl_write, which would count this write
+      rc = write(fd, buffer, length);
+   } while(rc < 0 && errno == EINTR);
+   return(rc);
+}
+
+// Replace the stats file so that a scraper never sees a partial one
+static void crtl_stats_file_write(crtl_stats_file_t *file) {
+   int fd = crtl_open(file->path_tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+   if(fd < 0) {
+      int errsv = errno;
+      LOG_ERROR("unable to open stats file <%s> <%s>", file->path_tmp, strerror(errsv));
+      return;
+   }
+   int rc = crtl_stats_dump(fd);
+   crtl_file_close(&fd);
+   if(rc < 0 || 0 != rename(file->path_tmp, file->path)) {
+      int errsv = errno;
+      LOG_ERROR("unable to write stats file <%s> <%s>", file->path, strerror(errsv));
+   }
+}
+
+static void *crtl_stats_file_thread(void *param) {
+   crtl_stats_file_t *file = param;
+   pthread_mutex_lock(&file->mutex);
+   while(!file->stop) {
+      crtl_stats_file_write(file);
+      struct timespec deadline;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec  += file->interval_ms / 1000;
+      deadline.tv_nsec += (long)(file->interval_ms % 1000) * 1000000;
+      deadline.tv_sec  += deadline.tv_nsec / 1000000000;
+      deadline.tv_nsec %= 1000000000;
+      while(!file->stop && ETIMEDOUT != pthread_cond_timedwait(&file->cond, &file->mutex, &deadline));
+   }
+   crtl_stats_file_write(file); // Final values
+   pthread_mutex_unlock(&file->mutex);
+   return(NULL);
+}
+
+// Write the statistics to path every interval_ms (0 for 1 second)
+bool crtl_stats_file_start(const char *path, uint32_t interval_ms) {
+   crtl_stats_file_t *file = &g_stats_file;
+   if(file->running) {
+      return(true);
+   }
+   if(strlen(path) + sizeof(".tmp") > sizeof(file->path)) {
+      LOG_ERROR("stats file path too long");
+      return(false);
+   }
+   snprintf(file->path, sizeof(file->path), "%s", path);
+   snprintf(file->path_tmp, sizeof(file->path_tmp), "%s.tmp", path);
+   file->interval_ms = (interval_ms > 0) ? interval_ms : 1000;
+   file->stop        = false;
+   if(0 != pthread_create(&file->thread, NULL, crtl_stats_file_thread, file)) {
+      LOG_ERROR("unable to create stats thread");
+      return(false);
+   }
+   file->running = true;
+   return(true);
+}
+
+void crtl_stats_file_stop(void) {
+   crtl_stats_file_t *file = &g_stats_file;
+   if(!file->running) {
+      return;
+   }
+   pthread_mutex_lock(&file->mutex);
+   file->stop = true;
+   pthread_cond_signal(&file->cond);
+   pthread_mutex_unlock(&file->mutex);
+   pthread_join(file->thread, NULL);
+   file->running = false;
+}
@@ -0,0 +1,424 @@
+/**
+ * Copyright 2018 Comcast Cable Communications Management, LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Ring file storage.  Filesystems such as tmpfs, btrfs and overlayfs don't support FALLOC_FL_COLLAPSE_RANGE so the
+// output file is instead a fixed size circular buffer written with positioned writes.  The first block of the file is
+// a header holding the logical offsets of the oldest byte (head) and the end of the data (tail).  Logical offset n is
+// stored at data_offset + (n % capacity).  Data is always written before the header that makes it visible, and the
+// head is moved forward in the header before the data it covered is overwritten, so the header describes valid data
+// even if the process dies in between.
+//
+// Mmap storage uses the same file format but preallocates the whole file and maps it, so data and offsets are stored
+// with memcpy instead of a system call per write.  Dirty pages are written back with msync every msync_ms and on
+// crtl_fsync.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/vfs.h>
+#include <sys/mman.h>
+#include <linux/magic.h>
+#include "curtail.h"
+#include "crtl_private.h"
+
+#define CRTL_RING_FILE_MAGIC   "CRTLRING"
+#define CRTL_RING_FILE_VERSION (1)
+#define CRTL_MSYNC_MS_DEFAULT  (1000)
+
+typedef struct {
+   char     magic[8];
+   uint32_t version;
+   uint32_t data_offset;
+   uint64_t capacity;
+   uint64_t head;
+   uint64_t tail;
+} crtl_ring_file_header_t;
+
+const char *crtl_storage_str(crtl_storage_t storage) {
+   switch(storage) {
+      case CRTL_STORAGE_AUTO:     return("auto");
+      case CRTL_STORAGE_COLLAPSE: return("collapse");
+      case CRTL_STORAGE_RING:     return("ring");
+      case CRTL_STORAGE_MMAP:     return("mmap");
+      case CRTL_STORAGE_SEGMENT:  return("segment");
+   }
+   return("invalid");
+}
+
+bool crtl_storage_parse(const char *str, crtl_storage_t *storage) {
+   for(crtl_storage_t index = CRTL_STORAGE_AUTO; index <= CRTL_STORAGE_SEGMENT; index++) {
+      if(0 == strcmp(str, crtl_storage_str(index))) {
+         *storage = index;
+         return(true);
+      }
+   }
+   return(false);
+}
+
+// Returns 1 if the header was read, 0 if the file is not a ring file or -1 on error
+static int crtl_storage_header_read(int fd, crtl_ring_file_header_t *header) {
+   int rc = crtl_pread(fd, header, sizeof(*header), 0);
+   if(rc < 0) {
+      int errsv = errno;
+      LOG_ERROR("unable to read ring file header <%s>", strerror(errsv));
+      return(-1);
+   }
+   if(rc != sizeof(*header) || 0 != memcmp(header->magic, CRTL_RING_FILE_MAGIC, sizeof(header->magic))) {
+      return(0);
+   }
+   if(header->version != CRTL_RING_FILE_VERSION || header->capacity == 0 || header->tail < header->head || header->tail - header->head > header->capacity) {
+      LOG_ERROR("invalid ring file header");
+      errno = EINVAL;
+      return(-1);
+   }
+   return(1);
+}
+
+// Check whether a file is a ring file or a segment index
+bool crtl_storage_detect(int fd) {
+   crtl_ring_file_header_t header;
+   return(1 == crtl_storage_header_read(fd, &header) || crtl_segment_detect(fd));
+}
+
+static int crtl_storage_header_write(crtl_output_t *output) {
+   crtl_ring_file_header_t header;
+   memset(&header, 0, sizeof(header));
+   memcpy(header.magic, CRTL_RING_FILE_MAGIC, sizeof(header.magic));
+   header.version     = CRTL_RING_FILE_VERSION;
+   header.data_offset = output->ring_offset;
+   header.capacity    = output->ring_capacity;
+   header.head        = output->ring_head;
+   header.tail        = output->ring_tail;
+   if(sizeof(header) != crtl_pwrite(output->fd, &header, sizeof(header), 0)) {
+      int errsv = errno;
+      LOG_ERROR("unable to write ring file header <%s>", strerror(errsv));
+      return(-1);
+   }
+   return(0);
+}
+
+// Only the head and tail change once the file is set up, and they share one sector
+static int crtl_storage_offsets_write(crtl_output_t *output) {
+   if(output->map != NULL) {
+      crtl_ring_file_header_t *header = (crtl_ring_file_header_t *)output->map;
+      header->head = output->ring_head;
+      header->tail = output->ring_tail;
+      return(0);
+   }
+   uint64_t offsets[2] = { output->ring_head, output->ring_tail };
+   if(sizeof(offsets) != crtl_pwrite(output->fd, offsets, sizeof(offsets), offsetof(crtl_ring_file_header_t, head))) {
+      int errsv = errno;
+      LOG_ERROR("unable to write ring file offsets <%s>", strerror(errsv));
+      return(-1);
+   }
+   return(0);
+}
+
+static uint64_t crtl_storage_time_ms(void) {
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+   return((uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000);
+}
+
+// Allocate the whole file up front, since touching a mapped page past the end of the file raises SIGBUS
+static bool crtl_storage_map(crtl_output_t *output) {
+   uint64_t size = output->ring_offset + output->ring_capacity;
+   int rc = posix_fallocate(output->fd, 0, size);
+   if(rc == EOPNOTSUPP || rc == EINVAL) { // Sparse is good enough
+      struct stat statbuf;
+      if(0 == crtl_fstat(output->fd, &statbuf) && (uint64_t)statbuf.st_size < size) {
+         rc = ftruncate(output->fd, size) == 0 ? 0 : errno;
+      } else {
+         rc = 0;
+      }
+   }
+   if(rc != 0) {
+      LOG_ERROR("unable to allocate output file <%s>", strerror(rc));
+      return(false);
+   }
+   void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, output->fd, 0);
+   if(map == MAP_FAILED) {
+      int errsv = errno;
+      LOG_ERROR("unable to map output file <%s>", strerror(errsv));
+      return(false);
+   }
+   output->map = map;
+   if(output->msync_ms == 0) {
+      output->msync_ms = CRTL_MSYNC_MS_DEFAULT;
+   }
+   output->msync_time = crtl_storage_time_ms();
+   return(true);
+}
+
+static bool crtl_storage_can_collapse(int fd) {
+   struct statfs statfsbuf;
+   if(0 != fstatfs(fd, &statfsbuf)) {
+      return(true); // Let the first collapse report the problem
+   }
+   return(statfsbuf.f_type == EXT4_SUPER_MAGIC || statfsbuf.f_type == XFS_SUPER_MAGIC);
+}
+
+// Select the storage of a newly opened output and load or create the ring file header or segment index.  An existing
+// ring file or segment index is always used as one.  Automatic selection only picks a ring for empty files on
+// filesystems that can't collapse.
+bool crtl_storage_open(const char *filename, crtl_output_t *output) {
+   if(crtl_segment_detect(output->fd)) {
+      if(output->storage != CRTL_STORAGE_AUTO && output->storage != CRTL_STORAGE_SEGMENT) {
+         LOG_ERROR("output file is a segment index");
+         return(false);
+      }
+      output->storage = CRTL_STORAGE_SEGMENT;
+   }
+   if(output->storage == CRTL_STORAGE_SEGMENT) {
+      return(crtl_segment_open(filename, output));
+   }
+   crtl_ring_file_header_t header;
+   int rc = crtl_storage_header_read(output->fd, &header);
+   if(rc < 0) {
+      return(false);
+   }
+   if(rc == 0 && output->storage == CRTL_STORAGE_AUTO) {
+      output->storage = (output->size_cur == 0 && !crtl_storage_can_collapse(output->fd)) ? CRTL_STORAGE_RING : CRTL_STORAGE_COLLAPSE;
+   }
+   if(rc == 0 && output->storage == CRTL_STORAGE_COLLAPSE) {
+      return(true);
+   }
+   if(rc == 0 && output->size_cur > 0) {
+      LOG_ERROR("output file exists and is not a ring file");
+      return(false);
+   }
+   if(rc == 1 && output->storage == CRTL_STORAGE_COLLAPSE) {
+      LOG_ERROR("output file is a ring file");
+      return(false);
+   }
+
+   if(output->storage != CRTL_STORAGE_MMAP) {
+      output->storage = CRTL_STORAGE_RING;
+   }
+   if(rc == 1) { // Pick up where the last writer left off.  The capacity of an existing file can't change.
+      output->ring_offset   = header.data_offset;
+      output->ring_capacity = header.capacity;
+      output->ring_head     = header.head;
+      output->ring_tail     = header.tail;
+      if(output->ring_offset + output->ring_capacity != output->size_max) {
+         LOG_WARN("keeping existing ring file size of %" PRIu64 " bytes", output->ring_offset + output->ring_capacity);
+         output->size_max = output->ring_offset + output->ring_capacity;
+         if(output->size_low > output->size_max) {
+            output->size_low = output->size_max;
+         }
+      }
+   } else {
+      output->ring_offset   = DEFAULT_SECTOR_SIZE;
+      output->ring_capacity = output->size_max - DEFAULT_SECTOR_SIZE;
+      output->ring_head     = 0;
+      output->ring_tail     = 0;
+      if(0 > crtl_storage_header_write(output)) {
+         return(false);
+      }
+   }
+   if(output->storage == CRTL_STORAGE_MMAP && !crtl_storage_map(output)) {
+      return(false);
+   }
+   output->size_cur = output->ring_tail - output->ring_head;
+   LOG_DEBUG("ring file capacity %" PRIu64 " head %" PRIu64 " tail %" PRIu64, output->ring_capacity, output->ring_head, output->ring_tail);
+   return(true);
+}
+
+// Make room for up to *data_size bytes at the tail.  *data_size is reduced to what fits before the end of the file
+// wraps and *offset is set to where it is written.  Once the ring is full the head is moved forward to the low
+// watermark so that the header only has to be written ahead of the data once in a while.
+int crtl_storage_reserve(crtl_output_t *output, uint32_t *data_size, off_t *offset) {
+   uint64_t position   = output->ring_tail % output->ring_capacity;
+   uint64_t contiguous = output->ring_capacity - position;
+   if(*data_size > contiguous) {
+      *data_size = contiguous;
+   }
+   uint64_t used = output->ring_tail - output->ring_head;
+   if(used + *data_size > output->ring_capacity) {
+      uint64_t size_low = (output->size_low > output->ring_offset) ? output->size_low - output->ring_offset : 0;
+      uint64_t head     = output->ring_tail + *data_size - (size_low < *data_size ? *data_size : size_low);
+      if(head < output->ring_tail + *data_size - output->ring_capacity) {
+         head = output->ring_tail + *data_size - output->ring_capacity;
+      }
+      if(output->lines != NULL) { // Start the ring at a complete line when there is one
+         uint64_t line = crtl_lines_first(output->lines, head, output->ring_tail);
+         if(line < output->ring_tail) {
+            head = line;
+         }
+      }
+      LOG_DEBUG("ring file head moved from %" PRIu64 " to %" PRIu64, output->ring_head, head);
+      crtl_stats_add(CRTL_STAT_BYTES_COLLAPSED, head - output->ring_head);
+      output->ring_head = head;
+      output->size_cur  = output->ring_tail - output->ring_head;
+      if(0 > crtl_storage_offsets_write(output)) {
+         return(-1);
+      }
+   }
+   *offset = output->ring_offset + position;
+   return(0);
+}
+
+// Make data written at the tail visible
+int crtl_storage_commit(crtl_output_t *output, uint32_t data_size) {
+   output->ring_tail += data_size;
+   output->size_cur   = output->ring_tail - output->ring_head;
+   crtl_output_written(output, data_size);
+   if(0 > crtl_storage_offsets_write(output)) {
+      return(-1);
+   }
+   if(output->map != NULL) { // Start write back of the mapping once per interval without waiting for it
+      uint64_t now = crtl_storage_time_ms();
+      if(now - output->msync_time >= output->msync_ms) {
+         output->msync_time = now;
+         if(0 > msync(output->map, output->ring_offset + output->ring_capacity, MS_ASYNC)) {
+            int errsv = errno;
+            LOG_ERROR("unable to sync output file <%s>", strerror(errsv));
+            return(-1);
+         }
+      }
+   }
+   return(0);
+}
+
+// Flush the output file to disk
+int crtl_storage_sync(crtl_output_t *output) {
+   if(output->map != NULL && 0 > msync(output->map, output->ring_offset + output->ring_capacity, MS_SYNC)) {
+      return(-1);
+   }
+   if(0 > fsync(output->fd)) {
+      return(-1);
+   }
+   return((output->segments != NULL) ? crtl_segment_sync(output->segments) : 0);
+}
+
+void crtl_storage_close(crtl_output_t *output) {
+   crtl_compress_close(output->compressor); // Writes out the remaining frames
+   output->compressor = NULL;
+   crtl_sync_close(output->syncer);
+   output->syncer = NULL;
+   crtl_cache_close(output);
+   crtl_stamp_close(output->stamp);
+   output->stamp = NULL;
+   crtl_lines_close(output->lines);
+   output->lines = NULL;
+   crtl_offsets_close(output->offsets);
+   output->offsets = NULL;
+   if(output->map != NULL) {
+      munmap(output->map, output->ring_offset + output->ring_capacity);
+      output->map = NULL;
+   }
+   crtl_segment_close(output);
+   crtl_file_close(&output->fd);
+}
+
+int crtl_storage_write(crtl_output_t *output, const char *buffer, uint32_t data_size) {
+   uint32_t written = 0;
+   while(written < data_size) {
+      uint32_t length = data_size - written;
+      off_t    offset;
+      if(0 > crtl_storage_reserve(output, &length, &offset)) {
+         return(-1);
+      }
+      int rc = length;
+      if(output->map != NULL) {
+         memcpy(output->map + offset, buffer + written, length);
+      } else {
+         rc = crtl_pwrite(output->fd, buffer + written, length, offset);
+      }
+      if(rc < 0) {
+         int errsv = errno;
+         LOG_ERROR("error writing to output file <%s>", strerror(errsv));
+         return(-1);
+      }
+      if(output->lines != NULL) {
+         crtl_lines_add(output->lines, output->ring_tail, buffer + written, rc);
+      }
+      if(0 > crtl_storage_commit(output, rc)) {
+         return(-1);
+      }
+      written += rc;
+   }
+   return(written);
+}
+
+// Write the contents of a file to fd in order.  Ring files are unrolled from head to tail, the segments of a segment
+// index are joined, compressed files are decompressed and other files are copied.
+int crtl_storage_cat(const char *filename, int fd) {
+   int fd_file = crtl_open(filename, O_RDONLY, 0);
+   if(fd_file < 0) {
+      int errsv = errno;
+      LOG_ERROR("unable to open <%s> <%s>", filename, strerror(errsv));
+      return(-1);
+   }
+   if(crtl_compress_detect(fd_file)) {
+      int rc = crtl_compress_cat(fd_file, fd);
+      crtl_file_close(&fd_file);
+      return(rc);
+   }
+   if(crtl_segment_detect(fd_file)) {
+      int rc = crtl_segment_cat(filename, fd_file, fd);
+      crtl_file_close(&fd_file);
+      return(rc);
+   }
+   crtl_ring_file_header_t header;
+   int rc = crtl_storage_header_read(fd_file, &header);
+   if(rc < 0) {
+      crtl_file_close(&fd_file);
+      return(-1);
+   }
+   uint64_t position = (rc == 1) ? header.head : 0;
+   uint64_t end      = (rc == 1) ? header.tail : UINT64_MAX;
+   bool     failed   = false;
+   char buffer[64 * 1024];
+   while(position < end) {
+      uint64_t length = end - position;
+      off_t    offset = position;
+      if(rc == 1) {
+         offset = header.data_offset + (position % header.capacity);
+         if(length > header.capacity - (position % header.capacity)) {
+            length = header.capacity - (position % header.capacity);
+         }
+      }
+      if(length > sizeof(buffer)) {
+         length = sizeof(buffer);
+      }
+      int size = crtl_pread(fd_file, buffer, length, offset);
+      if(size < 0) {
+         int errsv = errno;
+         LOG_ERROR("error reading <%s> <%s>", filename, strerror(errsv));
+         failed = true;
+         break;
+      }
+      if(size == 0) { // End of a regular file, or a ring file whose data was never written
+         break;
+      }
+      if(size != crtl_write(fd, buffer, size)) {
+         failed = true;
+         break;
+      }
+      position += size;
+   }
+   crtl_file_close(&fd_file);
+   return(failed ? -1 : 0);
+}
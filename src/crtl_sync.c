@@ -0,0 +1,179 @@
+/**
+ * Copyright 2018 Comcast Cable Communications Management, LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Durability policy.  A background thread flushes the output file so that the writer never waits for the disk.  Writes
+// only add to a dirty byte count and wake the thread when it reaches sync_bytes; the thread also runs every sync_ms.
+// In fsync mode each pass is a group commit: one fdatasync (msync for mmap storage) covers everything written since the
+// last one, bounding the loss window.  In range mode each pass waits for the write-back started by the previous pass and
+// starts write-back of everything dirty with sync_file_range, which streams data to disk at a steady rate without
+// flushing metadata.  The whole file is given to sync_file_range as collapses move data to other offsets.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "curtail.h"
+#include "crtl_private.h"
+
+#define CRTL_SYNC_MS_DEFAULT          (1000)
+#define CRTL_SYNC_RANGE_BYTES_DEFAULT (1024 * 1024)
+
+struct crtl_syncer_s {
+   crtl_output_t *      output;
+   crtl_sync_t          mode;
+   uint64_t             threshold;  // Dirty bytes that wake the thread (0 for time only)
+   uint32_t             interval_ms;
+   atomic_uint_fast64_t dirty;
+   pthread_t            thread;
+   pthread_mutex_t      mutex;
+   pthread_cond_t       cond;
+   bool                 stop;
+   bool                 wake;
+};
+
+const char *crtl_sync_str(crtl_sync_t sync) {
+   switch(sync) {
+      case CRTL_SYNC_NONE:  return("none");
+      case CRTL_SYNC_FSYNC: return("fsync");
+      case CRTL_SYNC_RANGE: return("range");
+   }
+   return("invalid");
+}
+
+bool crtl_sync_parse(const char *str, crtl_sync_t *sync) {
+   for(crtl_sync_t index = CRTL_SYNC_NONE; index <= CRTL_SYNC_RANGE; index++) {
+      if(0 == strcmp(str, crtl_sync_str(index))) {
+         *sync = index;
+         return(true);
+      }
+   }
+   return(false);
+}
+
+static int crtl_sync_flush(crtl_syncer_t *syncer) {
+   crtl_output_t *output = syncer->output;
+   uint64_t       start  = crtl_stats_clock();
+   int            rc;
+   if(syncer->mode == CRTL_SYNC_RANGE) {
+      do {
+         rc = sync_file_range(output->fd, 0, 0, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE);
+      } while(rc < 0 && errno == EINTR);
+   } else if(output->map != NULL) {
+      rc = msync(output->map, output->ring_offset + output->ring_capacity, MS_SYNC);
+   } else {
+      do {
+         rc = fdatasync(output->fd);
+      } while(rc < 0 && errno == EINTR);
+   }
+   if(rc == 0 && output->segments != NULL) { // The index makes the synced data visible after a crash
+      rc = crtl_segment_sync(output->segments);
+   }
+   crtl_stats_time(CRTL_STAT_OP_SYNC, start);
+   if(rc < 0) {
+      int errsv = errno;
+      LOG_ERROR("unable to %s output file <%s>", crtl_sync_str(syncer->mode), strerror(errsv));
+      crtl_stats_add(CRTL_STAT_ERRORS, 1);
+   }
+   return(rc);
+}
+
+static void *crtl_sync_thread(void *param) {
+   crtl_syncer_t *syncer = param;
+   pthread_mutex_lock(&syncer->mutex);
+   while(!syncer->stop) {
+      struct timespec deadline;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec  += syncer->interval_ms / 1000;
+      deadline.tv_nsec += (long)(syncer->interval_ms % 1000) * 1000000;
+      deadline.tv_sec  += deadline.tv_nsec / 1000000000;
+      deadline.tv_nsec %= 1000000000;
+      while(!syncer->stop && !syncer->wake && ETIMEDOUT != pthread_cond_timedwait(&syncer->cond, &syncer->mutex, &deadline));
+      syncer->wake = false;
+      if(atomic_exchange_explicit(&syncer->dirty, 0, memory_order_relaxed) == 0) {
+         continue; // Nothing written since the last pass
+      }
+      pthread_mutex_unlock(&syncer->mutex);
+      crtl_sync_flush(syncer);
+      pthread_mutex_lock(&syncer->mutex);
+   }
+   pthread_mutex_unlock(&syncer->mutex);
+   return(NULL);
+}
+
+// Account for size bytes written to the output.  Wakes the thread once the threshold is crossed.
+void crtl_sync_written(crtl_syncer_t *syncer, uint64_t size) {
+   uint64_t dirty = atomic_fetch_add_explicit(&syncer->dirty, size, memory_order_relaxed);
+   if(syncer->threshold > 0 && dirty < syncer->threshold && dirty + size >= syncer->threshold) {
+      pthread_mutex_lock(&syncer->mutex);
+      syncer->wake = true;
+      pthread_cond_signal(&syncer->cond);
+      pthread_mutex_unlock(&syncer->mutex);
+   }
+}
+
+crtl_syncer_t *crtl_sync_open(crtl_output_t *output) {
+   crtl_syncer_t *syncer = calloc(1, sizeof(crtl_syncer_t));
+   if(syncer == NULL) {
+      return(NULL);
+   }
+   syncer->output      = output;
+   syncer->mode        = output->sync;
+   syncer->threshold   = output->sync_bytes;
+   syncer->interval_ms = (output->sync_ms > 0) ? output->sync_ms : CRTL_SYNC_MS_DEFAULT;
+   if(syncer->mode == CRTL_SYNC_RANGE && syncer->threshold == 0) {
+      syncer->threshold = CRTL_SYNC_RANGE_BYTES_DEFAULT;
+   }
+   pthread_mutex_init(&syncer->mutex, NULL);
+   pthread_cond_init(&syncer->cond, NULL);
+   if(0 != pthread_create(&syncer->thread, NULL, crtl_sync_thread, syncer)) {
+      LOG_ERROR("unable to create sync thread");
+      pthread_cond_destroy(&syncer->cond);
+      pthread_mutex_destroy(&syncer->mutex);
+      free(syncer);
+      return(NULL);
+   }
+   LOG_DEBUG("%s every %" PRIu64 " bytes or %u ms", crtl_sync_str(syncer->mode), syncer->threshold, syncer->interval_ms);
+   return(syncer);
+}
+
+// Stop the thread and flush what it hasn't
+void crtl_sync_close(crtl_syncer_t *syncer) {
+   if(syncer == NULL) {
+      return;
+   }
+   pthread_mutex_lock(&syncer->mutex);
+   syncer->stop = true;
+   pthread_cond_signal(&syncer->cond);
+   pthread_mutex_unlock(&syncer->mutex);
+   pthread_join(syncer->thread, NULL);
+   if(atomic_load_explicit(&syncer->dirty, memory_order_relaxed) > 0) {
+      crtl_sync_flush(syncer);
+   }
+   pthread_cond_destroy(&syncer->cond);
+   pthread_mutex_destroy(&syncer->mutex);
+   free(syncer);
+}
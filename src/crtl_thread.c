@@ -0,0 +1,270 @@
+/**
+ * Copyright 2018 Comcast Cable Communications Management, LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Per-thread log buffers.  Each producing thread owns a single producer/single consumer ring so writing a record is
+// wait-free: no locks, no system calls and no shared cache lines other than its own ring.  The processing thread
+// periodically gathers the records from every ring and writes them to the output in batches.  Records from a thread
+// are always written in order.  Optionally every record is stamped from a global sequence counter and the rings are
+// merged in stamp order, at the cost of one shared atomic increment per record.  A thread can be preempted between
+// taking its stamp and queueing the record, so while a record is being queued its buffer holds a lower bound of the
+// stamp and the merge stops short of it, leaving later records for the next drain.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <pthread.h>
+#include "curtail.h"
+#include "crtl_private.h"
+
+typedef struct {
+   uint64_t sequence;
+   uint32_t size;
+} crtl_record_t;
+
+typedef struct crtl_thread_buffer_s {
+   crtl_ring_t                  ring;
+   atomic_bool                  in_use;  // Owned by a live thread
+   _Atomic uint64_t             dropped; // Bytes dropped because the ring was full
+   _Atomic uint64_t             pending; // Ordered only: at most the stamp of the record being queued (UINT64_MAX if none)
+   uint64_t                     sequence;
+   struct crtl_thread_buffer_s *next;
+} crtl_thread_buffer_t;
+
+typedef struct {
+   bool                           initialized;
+   bool                           ordered;
+   uint32_t                       generation; // Changes each time the buffers are initialized
+   uint32_t                       size;
+   _Atomic uint64_t               sequence;
+   _Atomic(crtl_thread_buffer_t *) buffers;
+   atomic_bool                    wakeup_pending;
+   void                         (*wakeup)(void);
+   pthread_key_t                  key;
+   char                           batch[64 * 1024];
+} crtl_thread_global_t;
+
+static crtl_thread_global_t g_thread;
+
+static _Thread_local crtl_thread_buffer_t *t_buffer     = NULL;
+static _Thread_local uint32_t              t_generation = 0;
+
+// Thread exit, the buffer may be taken over by another thread once the processing thread has emptied it
+static void crtl_thread_buffer_release(void *param) {
+   crtl_thread_buffer_t *buffer = param;
+   atomic_store(&buffer->in_use, false);
+}
+
+bool crtl_thread_buffers_init(uint32_t size, bool ordered, void (*wakeup)(void)) {
+   if(g_thread.initialized) {
+      return(true);
+   }
+   if(0 != pthread_key_create(&g_thread.key, crtl_thread_buffer_release)) {
+      LOG_ERROR("unable to create thread key");
+      return(false);
+   }
+   g_thread.size    = size;
+   g_thread.ordered = ordered;
+   g_thread.wakeup  = wakeup;
+   g_thread.generation++;
+   atomic_init(&g_thread.sequence, 0);
+   atomic_init(&g_thread.buffers, NULL);
+   atomic_init(&g_thread.wakeup_pending, false);
+   g_thread.initialized = true;
+   return(true);
+}
+
+// Must only be called once no thread is writing and the processing thread has drained the buffers
+void crtl_thread_buffers_term(void) {
+   if(!g_thread.initialized) {
+      return;
+   }
+   crtl_thread_buffer_t *buffer = atomic_exchange(&g_thread.buffers, NULL);
+   while(buffer != NULL) {
+      crtl_thread_buffer_t *next = buffer->next;
+      crtl_ring_free(&buffer->ring);
+      free(buffer);
+      buffer = next;
+   }
+   pthread_key_delete(g_thread.key);
+   g_thread.initialized = false;
+}
+
+static crtl_thread_buffer_t *crtl_thread_buffer_get(void) {
+   if(t_buffer != NULL && t_generation == g_thread.generation) {
+      return(t_buffer);
+   }
+   // Reuse the buffer of a thread that has exited
+   crtl_thread_buffer_t *buffer = atomic_load(&g_thread.buffers);
+   for(; buffer != NULL; buffer = buffer->next) {
+      bool expected = false;
+      if(atomic_compare_exchange_strong(&buffer->in_use, &expected, true)) {
+         break;
+      }
+   }
+   if(buffer == NULL) {
+      buffer = calloc(1, sizeof(crtl_thread_buffer_t));
+      if(buffer == NULL || !crtl_ring_init(&buffer->ring, g_thread.size, NULL)) {
+         free(buffer);
+         return(NULL);
+      }
+      atomic_init(&buffer->in_use, true);
+      atomic_init(&buffer->dropped, 0);
+      atomic_init(&buffer->pending, UINT64_MAX);
+      // Push onto the list of buffers, which is only ever added to while initialized
+      buffer->next = atomic_load(&g_thread.buffers);
+      while(!atomic_compare_exchange_weak(&g_thread.buffers, &buffer->next, buffer)) {
+      }
+   }
+   pthread_setspecific(g_thread.key, buffer);
+   t_buffer     = buffer;
+   t_generation = g_thread.generation;
+   return(buffer);
+}
+
+// Queue a record in the calling thread's buffer.  Never blocks, data that does not fit is dropped and accounted for.
+int crtl_thread_buffer_write(const void *buf, size_t len) {
+   crtl_thread_buffer_t *buffer = crtl_thread_buffer_get();
+   if(buffer == NULL) {
+      errno = ENOMEM;
+      return(-1);
+   }
+   crtl_record_t record;
+   record.size = len;
+   if(g_thread.ordered) { // Published before the stamp is taken, the counter only grows
+      atomic_store(&buffer->pending, atomic_load(&g_thread.sequence));
+      record.sequence = atomic_fetch_add(&g_thread.sequence, 1);
+   } else {
+      record.sequence = buffer->sequence++;
+   }
+   bool queued = (len <= UINT32_MAX && crtl_ring_put(&buffer->ring, &record, sizeof(record), buf, len));
+   if(g_thread.ordered) {
+      atomic_store(&buffer->pending, UINT64_MAX);
+   }
+   if(!queued) {
+      atomic_fetch_add_explicit(&buffer->dropped, len, memory_order_relaxed);
+      crtl_stats_add(CRTL_STAT_BYTES_DROPPED, len);
+      return(0);
+   }
+   // Have the processing thread drain the buffers early once this one is half full
+   if(crtl_ring_used(&buffer->ring) > g_thread.size / 2 && !atomic_exchange(&g_thread.wakeup_pending, true) && g_thread.wakeup != NULL) {
+      g_thread.wakeup();
+   }
+   return(len);
+}
+
+static int crtl_thread_batch_flush(crtl_output_t *output, uint32_t *batch_size) {
+   int rc = 0;
+   if(*batch_size > 0) {
+      rc = crtl_process_input(output, g_thread.batch, *batch_size);
+      *batch_size = 0;
+   }
+   return(rc);
+}
+
+// Move one record from the buffer into the batch
+static int crtl_thread_record_take(crtl_thread_buffer_t *buffer, const crtl_record_t *record, crtl_output_t *output, uint32_t *batch_size) {
+   uint32_t batch_max = sizeof(g_thread.batch);
+   if(batch_max > output->size_max / 2) {
+      batch_max = output->size_max / 2;
+   }
+   crtl_ring_release(&buffer->ring, sizeof(*record));
+   uint32_t remaining = record->size;
+   while(remaining > 0) {
+      if(*batch_size == batch_max && 0 > crtl_thread_batch_flush(output, batch_size)) {
+         return(-1);
+      }
+      uint32_t length;
+      const char *data = crtl_ring_read_ptr(&buffer->ring, &length);
+      if(length > remaining) {
+         length = remaining;
+      }
+      if(length > batch_max - *batch_size) {
+         length = batch_max - *batch_size;
+      }
+      memcpy(g_thread.batch + *batch_size, data, length);
+      *batch_size += length;
+      remaining   -= length;
+      crtl_ring_release(&buffer->ring, length);
+   }
+   return(0);
+}
+
+// Write everything queued in the per-thread buffers to the output.  Called from the processing thread only.
+int crtl_thread_buffers_drain(crtl_output_t *output) {
+   if(!g_thread.initialized) {
+      return(0);
+   }
+   atomic_store(&g_thread.wakeup_pending, false);
+
+   uint32_t batch_size = 0;
+   int      rc         = 0;
+   // Every stamp below the limit was taken before the buffers are listed and its record is in a ring by now unless its
+   // buffer's pending stamp lowers the limit.  Later records could still be overtaken by one that is being queued.
+   uint64_t              limit = atomic_load(&g_thread.sequence);
+   crtl_thread_buffer_t *head  = atomic_load(&g_thread.buffers);
+   if(g_thread.ordered) { // Repeatedly take the record with the lowest stamp across all buffers below the limit
+      for(crtl_thread_buffer_t *buffer = head; buffer != NULL; buffer = buffer->next) {
+         uint64_t pending = atomic_load(&buffer->pending);
+         if(pending < limit) {
+            limit = pending;
+         }
+      }
+      do {
+         crtl_thread_buffer_t *lowest = NULL;
+         crtl_record_t         lowest_record;
+         for(crtl_thread_buffer_t *buffer = head; buffer != NULL; buffer = buffer->next) {
+            crtl_record_t record;
+            if(crtl_ring_peek(&buffer->ring, &record, sizeof(record)) && record.sequence < limit && (lowest == NULL || record.sequence < lowest_record.sequence)) {
+               lowest        = buffer;
+               lowest_record = record;
+            }
+         }
+         if(lowest == NULL) {
+            break;
+         }
+         rc = crtl_thread_record_take(lowest, &lowest_record, output, &batch_size);
+      } while(rc == 0);
+   } else { // Take each buffer's records in turn
+      for(crtl_thread_buffer_t *buffer = head; buffer != NULL && rc == 0; buffer = buffer->next) {
+         crtl_record_t record;
+         while(rc == 0 && crtl_ring_peek(&buffer->ring, &record, sizeof(record))) {
+            rc = crtl_thread_record_take(buffer, &record, output, &batch_size);
+         }
+      }
+   }
+   if(rc == 0) {
+      rc = crtl_thread_batch_flush(output, &batch_size);
+   }
+
+   // Account for anything that did not fit
+   for(crtl_thread_buffer_t *buffer = head; buffer != NULL && rc >= 0; buffer = buffer->next) {
+      uint64_t dropped = atomic_exchange(&buffer->dropped, 0);
+      if(dropped > 0) {
+         rc = crtl_process_dropped(output, dropped);
+      }
+   }
+   return(rc < 0 ? -1 : 0);
+}
+
+bool crtl_thread_buffers_active(void) {
+   return(g_thread.initialized && atomic_load(&g_thread.buffers) != NULL);
+}
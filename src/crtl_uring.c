@@ -0,0 +1,569 @@
+/**
+ * Copyright 2018 Comcast Cable Communications Management, LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// io_uring engine.  Input is read into a small set of buffers while the previously read buffers are written to the
+// output file.  Each collapse is linked to the write that follows it so that both are submitted, along with the next
+// read, in a single system call.  Only one read is in flight at a time since concurrent reads from a pipe may
+// complete out of order.  Likewise only one collapse/write chain is in flight since a collapse moves the data that
+// a previous write is targeting.
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "curtail.h"
+#include "crtl_private.h"
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+
+#define CRTL_URING_ENTRIES     (8)
+#define CRTL_URING_BUFFER_QTY  (4)
+#define CRTL_URING_BUFFER_SIZE (64 * 1024)
+
+typedef enum {
+   CRTL_URING_OP_READ     = 1,
+   CRTL_URING_OP_EVENT    = 2,
+   CRTL_URING_OP_COLLAPSE = 3,
+   CRTL_URING_OP_WRITE    = 4,
+   CRTL_URING_OP_CANCEL   = 5
+} crtl_uring_op_t;
+
+typedef enum {
+   CRTL_BUFFER_FREE    = 0,
+   CRTL_BUFFER_READING = 1,
+   CRTL_BUFFER_FILLED  = 2,
+   CRTL_BUFFER_WRITING = 3
+} crtl_buffer_state_t;
+
+typedef struct {
+   crtl_buffer_state_t state;
+   uint32_t            size;
+   uint32_t            offset; // Start of the data not yet written, after a short write
+   char *              data;
+} crtl_uring_buffer_t;
+
+typedef struct {
+   int                  fd;
+   void *               sq_ptr;
+   size_t               sq_size;
+   void *               cq_ptr;
+   size_t               cq_size;
+   struct io_uring_sqe *sqes;
+   size_t               sqes_size;
+   uint32_t *           sq_head;
+   uint32_t *           sq_tail;
+   uint32_t *           sq_mask;
+   uint32_t *           sq_array;
+   uint32_t *           cq_head;
+   uint32_t *           cq_tail;
+   uint32_t *           cq_mask;
+   struct io_uring_cqe *cqes;
+   uint32_t             to_submit;
+} crtl_uring_t;
+
+typedef struct {
+   crtl_uring_t        ring;
+   crtl_output_t *     output;
+   int                 fd_input;
+   int                 fd_event;
+   uint32_t            buffer_size;
+   crtl_uring_buffer_t buffers[CRTL_URING_BUFFER_QTY];
+   uint32_t            buffer_next;     // Oldest buffer in input order
+   struct iovec        iov[CRTL_URING_BUFFER_QTY];
+   uint64_t            collapse_length;
+   uint32_t            write_size;
+   uint64_t            collapse_start;  // Queue times for the latency statistics
+   uint64_t            write_start;
+   uint64_t            read_user_data;
+   bool                read_pending;
+   bool                read_canceled;
+   bool                event_pending;
+   bool                write_pending;
+   bool                collapse_pending;
+   bool                input_end;
+   bool                event_ready;
+   bool                error;
+} crtl_uring_engine_t;
+
+static int crtl_uring_setup(crtl_uring_t *ring) {
+   struct io_uring_params p;
+   memset(&p, 0, sizeof(p));
+   memset(ring, 0, sizeof(*ring));
+
+   ring->fd = syscall(__NR_io_uring_setup, CRTL_URING_ENTRIES, &p);
+   if(ring->fd < 0) {
+      return(-1);
+   }
+
+   ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+   ring->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+   if(p.features & IORING_FEAT_SINGLE_MMAP) {
+      if(ring->cq_size > ring->sq_size) {
+         ring->sq_size = ring->cq_size;
+      }
+      ring->cq_size = ring->sq_size;
+   }
+   ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+   if(ring->sq_ptr == MAP_FAILED) {
+      crtl_close(ring->fd);
+      return(-1);
+   }
+   if(p.features & IORING_FEAT_SINGLE_MMAP) {
+      ring->cq_ptr = ring->sq_ptr;
+   } else {
+      ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+      if(ring->cq_ptr == MAP_FAILED) {
+         munmap(ring->sq_ptr, ring->sq_size);
+         crtl_close(ring->fd);
+         return(-1);
+      }
+   }
+   ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+   ring->sqes      = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+   if(ring->sqes == MAP_FAILED) {
+      if(ring->cq_ptr != ring->sq_ptr) {
+         munmap(ring->cq_ptr, ring->cq_size);
+      }
+      munmap(ring->sq_ptr, ring->sq_size);
+      crtl_close(ring->fd);
+      return(-1);
+   }
+
+   ring->sq_head  = (uint32_t *)((char *)ring->sq_ptr + p.sq_off.head);
+   ring->sq_tail  = (uint32_t *)((char *)ring->sq_ptr + p.sq_off.tail);
+   ring->sq_mask  = (uint32_t *)((char *)ring->sq_ptr + p.sq_off.ring_mask);
+   ring->sq_array = (uint32_t *)((char *)ring->sq_ptr + p.sq_off.array);
+   ring->cq_head  = (uint32_t *)((char *)ring->cq_ptr + p.cq_off.head);
+   ring->cq_tail  = (uint32_t *)((char *)ring->cq_ptr + p.cq_off.tail);
+   ring->cq_mask  = (uint32_t *)((char *)ring->cq_ptr + p.cq_off.ring_mask);
+   ring->cqes     = (struct io_uring_cqe *)((char *)ring->cq_ptr + p.cq_off.cqes);
+   return(0);
+}
+
+static void crtl_uring_teardown(crtl_uring_t *ring) {
+   munmap(ring->sqes, ring->sqes_size);
+   if(ring->cq_ptr != ring->sq_ptr) {
+      munmap(ring->cq_ptr, ring->cq_size);
+   }
+   munmap(ring->sq_ptr, ring->sq_size);
+   crtl_close(ring->fd);
+   ring->fd = -1;
+}
+
+// Verify the kernel supports every operation used by the engine
+static bool crtl_uring_supported(crtl_uring_t *ring) {
+   static const uint8_t ops[] = { IORING_OP_READ, IORING_OP_WRITEV, IORING_OP_FALLOCATE, IORING_OP_POLL_ADD, IORING_OP_ASYNC_CANCEL };
+   size_t probe_size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+   struct io_uring_probe *probe = calloc(1, probe_size);
+   if(probe == NULL) {
+      return(false);
+   }
+   bool supported = false;
+   if(0 <= syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256)) {
+      supported = true;
+      for(size_t index = 0; index < sizeof(ops); index++) {
+         if(ops[index] > probe->last_op || !(probe->ops[ops[index]].flags & IO_URING_OP_SUPPORTED)) {
+            supported = false;
+         }
+      }
+   }
+   free(probe);
+   return(supported);
+}
+
+// Number of entries that can be queued before the submission queue is full
+static uint32_t crtl_uring_sq_space(crtl_uring_t *ring) {
+   uint32_t head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+   uint32_t tail = *ring->sq_tail + ring->to_submit;
+   return(*ring->sq_mask + 1 - (tail - head));
+}
+
+static struct io_uring_sqe *crtl_uring_sqe_get(crtl_uring_t *ring) {
+   if(crtl_uring_sq_space(ring) == 0) { // Submission queue is full
+      return(NULL);
+   }
+   uint32_t tail = *ring->sq_tail + ring->to_submit;
+   uint32_t index = tail & *ring->sq_mask;
+   struct io_uring_sqe *sqe = &ring->sqes[index];
+   memset(sqe, 0, sizeof(*sqe));
+   ring->sq_array[index] = index;
+   ring->to_submit++;
+   return(sqe);
+}
+
+// Submit all queued entries and wait for at least one completion
+static int crtl_uring_submit(crtl_uring_t *ring) {
+   __atomic_store_n(ring->sq_tail, *ring->sq_tail + ring->to_submit, __ATOMIC_RELEASE);
+   uint32_t to_submit = ring->to_submit;
+   ring->to_submit    = 0;
+   int rc;
+   do {
+      errno = 0;
+      rc    = syscall(__NR_io_uring_enter, ring->fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+      if(rc >= 0) {
+         to_submit = 0;
+      }
+   } while(rc < 0 && errno == EINTR);
+   return(rc);
+}
+
+// Buffers are used in input order.  Starting at the oldest buffer they are always in the sequence writing, filled,
+// reading, free so the next read goes into the first free buffer.
+static void crtl_uring_queue_read(crtl_uring_engine_t *engine) {
+   for(uint32_t count = 0; count < CRTL_URING_BUFFER_QTY; count++) {
+      uint32_t index = (engine->buffer_next + count) % CRTL_URING_BUFFER_QTY;
+      crtl_uring_buffer_t *buffer = &engine->buffers[index];
+      if(buffer->state != CRTL_BUFFER_FREE) {
+         continue;
+      }
+      struct io_uring_sqe *sqe = crtl_uring_sqe_get(&engine->ring);
+      if(sqe == NULL) {
+         return;
+      }
+      sqe->opcode    = IORING_OP_READ;
+      sqe->fd        = engine->fd_input;
+      sqe->addr      = (uintptr_t)buffer->data;
+      sqe->len       = engine->buffer_size;
+      sqe->off       = (uint64_t)-1; // Use and update the current file position
+      sqe->user_data = ((uint64_t)index << 8) | CRTL_URING_OP_READ;
+      buffer->state  = CRTL_BUFFER_READING;
+      engine->read_user_data = sqe->user_data;
+      engine->read_pending   = true;
+      engine->read_canceled  = false;
+      return;
+   }
+}
+
+// Queue a collapse (if needed) linked to a single write of all filled buffers in input order
+static void crtl_uring_queue_write(crtl_uring_engine_t *engine) {
+   uint32_t iovcnt    = 0;
+   uint32_t data_size = 0;
+   for(uint32_t count = 0; count < CRTL_URING_BUFFER_QTY; count++) {
+      crtl_uring_buffer_t *buffer = &engine->buffers[(engine->buffer_next + count) % CRTL_URING_BUFFER_QTY];
+      if(buffer->state != CRTL_BUFFER_FILLED || data_size + buffer->size > engine->output->size_max / 2) {
+         break;
+      }
+      engine->iov[iovcnt].iov_base = buffer->data + buffer->offset;
+      engine->iov[iovcnt].iov_len  = buffer->size - buffer->offset;
+      data_size += buffer->size - buffer->offset;
+      iovcnt++;
+   }
+   if(iovcnt == 0) {
+      return;
+   }
+
+   // Other writers to the output are held off until the write completes
+   crtl_output_lock(engine->output);
+   uint64_t collapse_length = crtl_file_collapse_length(engine->output, data_size);
+   if(crtl_uring_sq_space(&engine->ring) < ((collapse_length > 0) ? 2 : 1)) { // Retried once the queue is submitted
+      crtl_output_unlock(engine->output);
+      return;
+   }
+   if(collapse_length > 0) {
+      struct io_uring_sqe *sqe = crtl_uring_sqe_get(&engine->ring);
+      sqe->opcode    = IORING_OP_FALLOCATE;
+      sqe->fd        = engine->output->fd;
+      sqe->off       = 0;
+      sqe->addr      = collapse_length;
+      sqe->len       = FALLOC_FL_COLLAPSE_RANGE;
+      sqe->flags     = IOSQE_IO_LINK;
+      sqe->user_data = CRTL_URING_OP_COLLAPSE;
+      engine->collapse_pending = true;
+      crtl_file_collapsing(engine->output, collapse_length);
+   }
+   struct io_uring_sqe *sqe = crtl_uring_sqe_get(&engine->ring);
+   sqe->opcode    = IORING_OP_WRITEV;
+   sqe->fd        = engine->output->fd;
+   sqe->addr      = (uintptr_t)engine->iov;
+   sqe->len       = iovcnt;
+   sqe->off       = engine->output->size_cur - collapse_length;
+   sqe->user_data = CRTL_URING_OP_WRITE;
+
+   for(uint32_t count = 0; count < iovcnt; count++) {
+      engine->buffers[(engine->buffer_next + count) % CRTL_URING_BUFFER_QTY].state = CRTL_BUFFER_WRITING;
+   }
+   engine->collapse_length = collapse_length;
+   engine->write_size      = data_size;
+   engine->write_pending   = true;
+   engine->collapse_start  = crtl_stats_clock();
+   engine->write_start     = engine->collapse_start;
+}
+
+static void crtl_uring_queue_event(crtl_uring_engine_t *engine) {
+   struct io_uring_sqe *sqe = crtl_uring_sqe_get(&engine->ring);
+   if(sqe == NULL) {
+      return;
+   }
+   sqe->opcode        = IORING_OP_POLL_ADD;
+   sqe->fd            = engine->fd_event;
+   sqe->poll32_events = POLLIN;
+   sqe->user_data     = CRTL_URING_OP_EVENT;
+   engine->event_pending = true;
+}
+
+static void crtl_uring_queue_cancel(crtl_uring_engine_t *engine, uint64_t user_data) {
+   struct io_uring_sqe *sqe = crtl_uring_sqe_get(&engine->ring);
+   if(sqe == NULL) {
+      return;
+   }
+   sqe->opcode    = IORING_OP_ASYNC_CANCEL;
+   sqe->addr      = user_data;
+   sqe->user_data = CRTL_URING_OP_CANCEL;
+}
+
+static void crtl_uring_complete(crtl_uring_engine_t *engine, uint64_t user_data, int32_t res) {
+   switch(user_data & 0xFF) {
+      case CRTL_URING_OP_READ: {
+         crtl_uring_buffer_t *buffer = &engine->buffers[user_data >> 8];
+         engine->read_pending = false;
+         buffer->offset = 0;
+         if(res > 0) {
+            buffer->state = CRTL_BUFFER_FILLED;
+            buffer->size  = res;
+            crtl_stats_add(CRTL_STAT_BYTES_IN, res);
+         } else {
+            buffer->state = CRTL_BUFFER_FREE;
+            if(res == 0) {
+               engine->input_end = true;
+            } else if(res != -EINTR && res != -EAGAIN && res != -ECANCELED) {
+               LOG_ERROR("error reading input <%s>", strerror(-res));
+               crtl_stats_add(CRTL_STAT_ERRORS, 1);
+               engine->error = true;
+            }
+         }
+         break;
+      }
+      case CRTL_URING_OP_EVENT: {
+         engine->event_pending = false;
+         if(res >= 0) {
+            engine->event_ready = true;
+         }
+         break;
+      }
+      case CRTL_URING_OP_COLLAPSE: {
+         engine->collapse_pending = false;
+         crtl_stats_time(CRTL_STAT_OP_FALLOCATE, engine->collapse_start);
+         if(res < 0) {
+            LOG_ERROR("error fallocate output file <%s>", strerror(-res));
+            crtl_stats_add(CRTL_STAT_ERRORS, 1);
+            crtl_file_collapsing(engine->output, 0);
+            engine->error = true;
+         } else {
+            LOG_DEBUG("truncated output file from %" PRIu64 " to %" PRIu64 " bytes", engine->output->size_cur, engine->output->size_cur - engine->collapse_length);
+            crtl_file_collapsed(engine->output, engine->collapse_length);
+         }
+         break;
+      }
+      case CRTL_URING_OP_WRITE: {
+         engine->write_pending = false;
+         crtl_stats_time(CRTL_STAT_OP_WRITE, engine->write_start);
+         if(res < 0) {
+            if(res != -ECANCELED) {
+               LOG_ERROR("error writing to output file <%s>", strerror(-res));
+               crtl_stats_add(CRTL_STAT_ERRORS, 1);
+            }
+            engine->error = true;
+         } else if((uint32_t)res != engine->write_size) {
+            LOG_WARN("short write to output file %d of %u bytes", res, engine->write_size);
+            crtl_stats_add(CRTL_STAT_SHORT_WRITES, 1);
+            if(res == 0) { // Would be retried forever
+               engine->error = true;
+            }
+         }
+         // Account for and release the written buffers
+         uint32_t written = (res > 0) ? res : 0;
+         while(engine->buffers[engine->buffer_next].state == CRTL_BUFFER_WRITING) {
+            crtl_uring_buffer_t *buffer = &engine->buffers[engine->buffer_next];
+            uint32_t size = (buffer->size - buffer->offset < written) ? buffer->size - buffer->offset : written;
+            crtl_file_written(engine->output, buffer->data + buffer->offset, size);
+            written        -= size;
+            buffer->offset += size;
+            if(buffer->offset < buffer->size) { // Short write, the rest is queued again with the next write
+               break;
+            }
+            buffer->state = CRTL_BUFFER_FREE;
+            engine->buffer_next = (engine->buffer_next + 1) % CRTL_URING_BUFFER_QTY;
+         }
+         for(uint32_t count = 0; count < CRTL_URING_BUFFER_QTY; count++) {
+            crtl_uring_buffer_t *buffer = &engine->buffers[(engine->buffer_next + count) % CRTL_URING_BUFFER_QTY];
+            if(buffer->state == CRTL_BUFFER_WRITING) {
+               buffer->state = CRTL_BUFFER_FILLED;
+            }
+         }
+         crtl_output_unlock(engine->output);
+         break;
+      }
+      default: {
+         break;
+      }
+   }
+}
+
+static int crtl_uring_reap(crtl_uring_engine_t *engine) {
+   crtl_uring_t *ring = &engine->ring;
+   uint32_t head = *ring->cq_head;
+   uint32_t tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+   int count = 0;
+   while(head != tail) {
+      struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+      crtl_uring_complete(engine, cqe->user_data, cqe->res);
+      head++;
+      count++;
+   }
+   __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+   return(count);
+}
+
+// Process input until the end of input or until an event is received on fd_event (if fd_event >= 0).  Returns 0 at
+// end of input, 1 if the caller should continue with the synchronous loop (io_uring is not available or an event is
+// pending on fd_event) or -1 on error.
+int crtl_uring_run(int fd_input, int fd_event, crtl_output_t *output) {
+   crtl_uring_engine_t engine;
+   memset(&engine, 0, sizeof(engine));
+   engine.output   = output;
+   engine.fd_input = fd_input;
+   engine.fd_event = fd_event;
+
+   if(CRTL_STORAGE_IS_RING(output)) { // Writes are linked to collapses, which ring files don't use
+      LOG_INFO("io_uring engine not used with ring file storage, using synchronous I/O");
+      return(1);
+   }
+   if(output->storage == CRTL_STORAGE_SEGMENT) {
+      LOG_INFO("io_uring engine not used with segment storage, using synchronous I/O");
+      return(1);
+   }
+   if(output->compressor != NULL) { // Frames are written by the compression threads
+      LOG_INFO("io_uring engine not used with compression, using synchronous I/O");
+      return(1);
+   }
+   if(output->tee != NULL) { // Every read goes to several files
+      LOG_INFO("io_uring engine not used with tee outputs, using synchronous I/O");
+      return(1);
+   }
+   if(output->stamp != NULL) { // Lines are prefixed on the way to the file
+      LOG_INFO("io_uring engine not used with timestamps, using synchronous I/O");
+      return(1);
+   }
+   if(output->matcher != NULL) { // Lines are matched on the way to the file
+      LOG_INFO("io_uring engine not used with line routing, using synchronous I/O");
+      return(1);
+   }
+   if(output->staging != NULL) { // Direct I/O writes go through the block aligned buffer
+      LOG_INFO("io_uring engine not used with direct I/O, using synchronous I/O");
+      return(1);
+   }
+   if(0 > crtl_uring_setup(&engine.ring)) {
+      int errsv = errno;
+      LOG_INFO("io_uring not available <%s>, using synchronous I/O", strerror(errsv));
+      return(1);
+   }
+   if(!crtl_uring_supported(&engine.ring)) {
+      LOG_INFO("io_uring operations not supported, using synchronous I/O");
+      crtl_uring_teardown(&engine.ring);
+      return(1);
+   }
+
+   // Each buffer must fit within a single collapse
+   engine.buffer_size = CRTL_URING_BUFFER_SIZE;
+   if(engine.buffer_size > output->size_max / 2) {
+      engine.buffer_size = output->size_max / 2;
+   }
+   char *memory = malloc((size_t)engine.buffer_size * CRTL_URING_BUFFER_QTY);
+   if(memory == NULL) {
+      LOG_ERROR("unable to allocate buffers");
+      crtl_uring_teardown(&engine.ring);
+      return(1);
+   }
+   for(uint32_t index = 0; index < CRTL_URING_BUFFER_QTY; index++) {
+      engine.buffers[index].data = memory + (size_t)index * engine.buffer_size;
+   }
+
+   LOG_DEBUG("io_uring engine started");
+   bool running = true;
+   while(running) {
+      if(!engine.read_pending && !engine.input_end && !engine.event_ready && !engine.error) {
+         crtl_uring_queue_read(&engine);
+      }
+      if(!engine.write_pending && !engine.error) {
+         crtl_uring_queue_write(&engine);
+      }
+      if(!engine.event_pending && !engine.event_ready && fd_event >= 0) {
+         crtl_uring_queue_event(&engine);
+      }
+      if(engine.read_pending && !engine.read_canceled && (engine.event_ready || engine.error)) { // Stop reading, the caller takes over the input
+         crtl_uring_queue_cancel(&engine, engine.read_user_data);
+         engine.read_canceled = true;
+      }
+      if(!engine.read_pending && !engine.write_pending && !engine.collapse_pending &&
+         (engine.input_end || engine.event_ready || engine.error)) {
+         bool filled = false;
+         for(uint32_t index = 0; index < CRTL_URING_BUFFER_QTY; index++) {
+            filled |= (engine.buffers[index].state == CRTL_BUFFER_FILLED);
+         }
+         if(!filled || engine.error) {
+            break;
+         }
+      }
+      if(0 > crtl_uring_submit(&engine.ring)) {
+         int errsv = errno;
+         LOG_ERROR("io_uring submit failed <%s>", strerror(errsv));
+         engine.error = true;
+         break;
+      }
+      crtl_uring_reap(&engine);
+   }
+
+   if(engine.event_pending) { // Remove the outstanding poll before tearing down
+      crtl_uring_queue_cancel(&engine, CRTL_URING_OP_EVENT);
+      while(engine.event_pending && 0 <= crtl_uring_submit(&engine.ring)) {
+         crtl_uring_reap(&engine);
+      }
+   }
+   crtl_uring_teardown(&engine.ring);
+   free(memory);
+
+   // Writes were positioned, move the file pointer to the end for the synchronous path
+   crtl_seek(output->fd, 0, SEEK_END);
+   LOG_DEBUG("io_uring engine stopped");
+
+   if(engine.error) {
+      return(-1);
+   }
+   return(engine.input_end ? 0 : 1);
+}
+
+#else
+
+int crtl_uring_run(int fd_input, int fd_event, crtl_output_t *output) {
+   LOG_INFO("io_uring not supported by this build, using synchronous I/O");
+   return(1);
+}
+
+#endif
@@ -0,0 +1,209 @@
+/**
+ * Copyright 2018 Comcast Cable Communications Management, LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Crash capture.  The ring between the library's reader and writer threads lives in a memfd mapping shared with a
+// watcher process forked by crtl_init_ex.  The writer only releases data from the ring once it is in the output file,
+// so the ring from tail to head, followed by whatever is still in the stdout pipe (which the watcher also holds open),
+// is everything not yet written.  When the library process goes away without crtl_term, whether it crashed, was
+// killed or simply exited, the watcher opens the output file itself, writes that out and exits.  Nothing is synced
+// on the way, so this costs one copy into the ring and no system calls.
+//
+// Data being written when the process died is written again, so a few bytes can appear twice but none are lost.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "curtail.h"
+#include "crtl_private.h"
+
+#define CRTL_WATCH_POLL_MS (1000) // How often the watcher checks that its parent is still there
+
+struct crtl_watcher_s {
+   pid_t               pid;
+   int                 fd_lifeline; // Our end of a socket pair the watcher waits on, closed when this process goes away
+   crtl_ring_shared_t *shared;
+   size_t              map_size;
+};
+
+// Wait until the parent asks the watcher to exit (true) or goes away (false)
+static bool crtl_watch_wait(int fd_lifeline, pid_t parent) {
+   struct pollfd pfd = { .fd = fd_lifeline, .events = POLLIN };
+   while(1) {
+      int rc = poll(&pfd, 1, CRTL_WATCH_POLL_MS);
+      if(rc > 0) {
+         char command;
+         return(1 == crtl_read(fd_lifeline, &command, sizeof(command)));
+      }
+      // The lifeline stays open in children forked without exec, but they don't keep the parent id
+      if(getppid() != parent) {
+         return(false);
+      }
+   }
+}
+
+// Write out what the ring and the pipe hold once the parent has gone away, as its writer would have
+static void crtl_watch_rescue(const char *filename, const crtl_output_t *limits, int fd_input, crtl_ring_shared_t *shared, uint32_t size) {
+   crtl_output_t output;
+   crtl_output_settings(&output, limits);
+   if(!crtl_file_open(filename, &output)) {
+      LOG_ERROR("unable to open output file, data of the crashed process is lost");
+      return;
+   }
+
+   uint32_t chunk   = (output.size_max / 2 < 64 * 1024) ? output.size_max / 2 : 64 * 1024;
+   uint64_t rescued = 0;
+   uint64_t tail    = atomic_load(&shared->tail);
+   uint64_t head    = atomic_load(&shared->head);
+   while(tail < head) {
+      uint32_t offset = tail % size;
+      uint64_t length = head - tail;
+      if(length > size - offset) {
+         length = size - offset;
+      }
+      if(length > chunk) {
+         length = chunk;
+      }
+      if(0 > crtl_process_input(&output, shared->data + offset, length)) {
+         break;
+      }
+      tail    += length;
+      rescued += length;
+   }
+
+   // Programs started by the crashed one may still hold the pipe open, so only take what is there now
+   int flags = fcntl(fd_input, F_GETFL, 0);
+   fcntl(fd_input, F_SETFL, flags | O_NONBLOCK);
+   char buffer[64 * 1024];
+   int  rc;
+   while(0 < (rc = crtl_read(fd_input, buffer, chunk))) {
+      if(0 > crtl_process_input(&output, buffer, rc)) {
+         break;
+      }
+      rescued += rc;
+   }
+   LOG_INFO("wrote %" PRIu64 " bytes left by the crashed process", rescued);
+   crtl_storage_sync(&output);
+   crtl_storage_close(&output);
+}
+
+// Body of the watcher process, never returns
+static void crtl_watch_run(const char *filename, const crtl_output_t *limits, int fd_lifeline, int fd_input, crtl_ring_shared_t *shared, uint32_t size, pid_t parent) {
+   // Signals sent to the whole process group must not take the watcher down with its parent, and the parent's crash
+   // handlers don't apply here
+   const int ignored[] = { SIGINT, SIGTERM, SIGHUP, SIGQUIT, SIGPIPE, SIGUSR1 };
+   const int reset[]   = { SIGILL, SIGABRT, SIGFPE, SIGSEGV, SIGBUS, SIGSYS };
+   for(size_t index = 0; index < sizeof(ignored) / sizeof(ignored[0]); index++) {
+      signal(ignored[index], SIG_IGN);
+   }
+   for(size_t index = 0; index < sizeof(reset) / sizeof(reset[0]); index++) {
+      signal(reset[index], SIG_DFL);
+   }
+   prctl(PR_SET_NAME, "curtail-watch", 0, 0, 0);
+
+   if(!crtl_watch_wait(fd_lifeline, parent)) {
+      crtl_watch_rescue(filename, limits, fd_input, shared, size);
+   }
+   _exit(0);
+}
+
+// Create a shared ring of size bytes and fork the watcher.  fd_input is the read end of the stdout pipe and
+// fd_input_wr its write end, which the watcher must not keep open.
+crtl_watcher_t *crtl_watch_start(const char *filename, const crtl_output_t *limits, int fd_input, int fd_input_wr, uint32_t size) {
+   crtl_watcher_t *watcher = calloc(1, sizeof(crtl_watcher_t));
+   if(watcher == NULL) {
+      LOG_ERROR("unable to allocate watcher");
+      return(NULL);
+   }
+   watcher->map_size = sizeof(crtl_ring_shared_t) + size;
+   int fd_memory = memfd_create("curtail-ring", MFD_CLOEXEC);
+   if(fd_memory < 0 || 0 > ftruncate(fd_memory, watcher->map_size)) {
+      int errsv = errno;
+      LOG_ERROR("unable to create shared ring <%s>", strerror(errsv));
+      crtl_file_close(&fd_memory);
+      free(watcher);
+      return(NULL);
+   }
+   // The mapping is inherited by the watcher, the memfd itself is not needed once mapped
+   watcher->shared = mmap(NULL, watcher->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd_memory, 0);
+   int errsv = errno;
+   crtl_file_close(&fd_memory);
+   if(watcher->shared == MAP_FAILED) {
+      LOG_ERROR("unable to map shared ring <%s>", strerror(errsv));
+      free(watcher);
+      return(NULL);
+   }
+   atomic_store(&watcher->shared->head, 0);
+   atomic_store(&watcher->shared->tail, 0);
+
+   // A socket pair rather than a pipe so that telling a watcher that already died to exit doesn't raise SIGPIPE
+   int fd_lifeline[2];
+   if(0 > socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fd_lifeline)) {
+      errsv = errno;
+      LOG_ERROR("unable to create watcher pipe <%s>", strerror(errsv));
+      munmap(watcher->shared, watcher->map_size);
+      free(watcher);
+      return(NULL);
+   }
+   pid_t parent = getpid();
+   watcher->pid = fork();
+   if(watcher->pid == 0) {
+      crtl_close(fd_lifeline[1]);
+      crtl_close(fd_input_wr);
+      crtl_watch_run(filename, limits, fd_lifeline[0], fd_input, watcher->shared, size, parent);
+   }
+   crtl_close(fd_lifeline[0]);
+   if(watcher->pid < 0) {
+      errsv = errno;
+      LOG_ERROR("unable to start watcher process <%s>", strerror(errsv));
+      crtl_close(fd_lifeline[1]);
+      munmap(watcher->shared, watcher->map_size);
+      free(watcher);
+      return(NULL);
+   }
+   watcher->fd_lifeline = fd_lifeline[1];
+   LOG_INFO("watcher process %d started with a %u byte shared ring", (int)watcher->pid, size);
+   return(watcher);
+}
+
+crtl_ring_shared_t *crtl_watch_ring(crtl_watcher_t *watcher) {
+   return(watcher->shared);
+}
+
+// Tell the watcher that everything was written and wait for it to exit
+void crtl_watch_stop(crtl_watcher_t *watcher) {
+   if(watcher == NULL) {
+      return;
+   }
+   char command = 'q';
+   send(watcher->fd_lifeline, &command, sizeof(command), MSG_NOSIGNAL);
+   crtl_file_close(&watcher->fd_lifeline);
+   while(0 > waitpid(watcher->pid, NULL, 0) && errno == EINTR) {
+   }
+   munmap(watcher->shared, watcher->map_size);
+   free(watcher);
+}
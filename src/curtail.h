@@ -19,8 +19,10 @@
 #ifndef __CURTAIL_H__
 #define __CURTAIL_H__
 
+#include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <sys/types.h>
 
 typedef enum {
    CRTL_LEVEL_DEBUG = 0,
@@ -30,15 +32,111 @@ typedef enum {
    CRTL_LEVEL_NONE  = 4
 } crtl_log_level_t;
 
+typedef enum {
+   CRTL_ENGINE_AUTO   = 0, // splice when the input is a pipe, copy otherwise
+   CRTL_ENGINE_COPY   = 1, // read and write through a user space buffer
+   CRTL_ENGINE_SPLICE = 2, // move data from the input pipe to the file in the kernel
+   CRTL_ENGINE_URING  = 3  // batch reads, collapses and writes through io_uring
+} crtl_engine_t;
+
+typedef enum {
+   CRTL_STORAGE_AUTO     = 0, // ring file on filesystems that can't collapse (new files only), collapse otherwise
+   CRTL_STORAGE_COLLAPSE = 1, // plain file, old data is removed from the start with FALLOC_FL_COLLAPSE_RANGE
+   CRTL_STORAGE_RING     = 2, // fixed size circular file with a header, read back with curtail --cat
+   CRTL_STORAGE_MMAP     = 3, // ring file written through a shared mapping, flushed every msync_ms and on crtl_fsync
+   CRTL_STORAGE_SEGMENT  = 4  // index file of segment files <file>.<n>, the oldest is renamed and rewritten once all are used
+} crtl_storage_t;
+
+// Durability policy for data written to the output file
+typedef enum {
+   CRTL_SYNC_NONE  = 0, // leave write-back to the kernel, data is only flushed by crtl_fsync and crtl_term
+   CRTL_SYNC_FSYNC = 1, // group commit: a background thread fdatasyncs every sync_bytes or sync_ms
+   CRTL_SYNC_RANGE = 2  // a background thread streams write-back with sync_file_range (no metadata flush)
+} crtl_sync_t;
+
+// How written data is kept in the page cache
+typedef enum {
+   CRTL_CACHE_DEFAULT  = 0, // leave written pages to the kernel
+   CRTL_CACHE_DONTNEED = 1, // drop written pages with posix_fadvise after every 1M written
+   CRTL_CACHE_DIRECT   = 2  // write with O_DIRECT through a block aligned buffer (collapse storage only)
+} crtl_cache_t;
+
+// Optional parameters for crtl_init_ex.  Zero initialize for default behavior.
+typedef struct {
+   uint64_t       size_low;           // Size the file is reduced to once it reaches size_max (0 frees only what is needed)
+   crtl_engine_t  engine;             // I/O engine used to move data from the input to the file
+   uint32_t       ring_size;          // Size of the ring between the input and a separate writer thread (0 reads and writes on one thread)
+   bool           direct_only;        // Leave stdout alone, output is only written with crtl_direct_write
+   uint32_t       thread_buffer_size; // Size of each thread's crtl_thread_write buffer (0 makes crtl_thread_write a direct write)
+   bool           thread_order;       // Write records from all threads in the order crtl_thread_write was called
+   crtl_storage_t storage;            // How old data is discarded from the output file
+   uint32_t       msync_ms;           // Interval between writebacks of mmap storage (0 for 1 second)
+   bool           line_head;          // Publish the offset of the first complete line (user.curtail.head xattr or <file>.head)
+   bool           compress;           // Write compressed frames (collapse storage only, read back with curtail --cat)
+   uint32_t       compress_threads;   // Number of compression threads (0 for 2)
+   const char *   stats_file;         // Periodically replaced with the statistics in the Prometheus text format (NULL for none)
+   uint32_t       stats_ms;           // Interval between updates of stats_file (0 for 1 second)
+   crtl_sync_t    sync;               // Durability policy
+   uint64_t       sync_bytes;         // Bytes written that trigger a sync (0 for time only with fsync, 1M with range)
+   uint32_t       sync_ms;            // Longest time between syncs of written data (0 for 1 second)
+   crtl_cache_t   cache;              // Page cache footprint of the output file
+   bool           timestamp;          // Prefix each line with the local time it is written, to the millisecond
+   bool           drop;               // Never block the writers of stdout: drop whole lines when the ring (16M if ring_size is 0) is full
+   uint64_t       drop_rate;          // Drop mode only: drop lines written faster than this many bytes per second (0 for no limit)
+   bool           prealloc;           // Reserve size_max on disk beyond the end of the file so it stays in a few extents (collapse storage only)
+   uint32_t       pipe_size_max;      // Largest capacity the stdout pipe is grown to when bursts fill it (0 for 1M)
+   uint32_t       segments;           // Number of files segment storage splits size_max across (0 for 4)
+   bool           publish_offsets;    // Publish the bytes collapsed over the life of the file so that curtail --follow can follow it (collapse storage only)
+   bool           crash_capture;      // Keep unwritten data in a shared ring that a watcher process writes out if this process dies (1M ring unless ring_size is given, not with compress)
+} crtl_params_t;
+
+#define CRTL_STATS_BUCKETS (32)
+
+// Latency histogram.  buckets[n] counts operations that took less than 2^n microseconds (and at least 2^(n-1) for n > 0).
+typedef struct {
+   uint64_t count;
+   uint64_t sum_us;
+   uint64_t buckets[CRTL_STATS_BUCKETS];
+} crtl_stats_histogram_t;
+
+// Process wide statistics returned by crtl_get_stats
+typedef struct {
+   uint64_t               bytes_in;        // Accepted from the input
+   uint64_t               bytes_written;   // Written to the output file
+   uint64_t               bytes_collapsed; // Discarded from the start of the output file (or the head of a ring file)
+   uint64_t               collapses;       // FALLOC_FL_COLLAPSE_RANGE calls
+   uint64_t               short_writes;
+   uint64_t               errors;          // Failed system calls
+   uint64_t               bytes_dropped;   // Discarded under overload (drop mode or full thread buffers)
+   uint64_t               extents;         // Extents in the main output file when it was opened or last collapsed with prealloc
+   crtl_stats_histogram_t read;            // Reads of the output file
+   crtl_stats_histogram_t write;
+   crtl_stats_histogram_t fallocate;
+   crtl_stats_histogram_t sync;            // Background syncs of the durability policy
+} crtl_stats_t;
+
 #ifdef __cplusplus
 extern "C"
 {
 #endif
 
 bool crtl_init(const char *filename, uint64_t size_max, crtl_log_level_t level, bool include_stderr);
+bool crtl_init_ex(const char *filename, uint64_t size_max, crtl_log_level_t level, bool include_stderr, const crtl_params_t *params);
 int  crtl_fsync(void);
 void crtl_term(void);
 
+// Write to the output file from the calling thread without going through stdout.  Safe to call from multiple threads.
+// Returns the number of bytes written like write, or -1.
+ssize_t crtl_direct_write(const void *buf, size_t len);
+FILE *  crtl_direct_open(size_t buffer_size);
+
+// Queue a record in a buffer owned by the calling thread, written out in batches by the processing thread.  Never
+// blocks, a record that does not fit in the buffer is dropped and a marker with the number of bytes lost is written.
+int   crtl_thread_write(const void *buf, size_t len);
+
+// Copy the counters and latency histograms.  Also dumped to stderr on SIGUSR1 unless the program handles that signal.
+int   crtl_get_stats(crtl_stats_t *stats);
+
 #ifdef __cplusplus
 }
 #endif